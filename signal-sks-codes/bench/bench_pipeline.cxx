@@ -0,0 +1,564 @@
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <boost/thread.hpp>
+
+#include "../include-shared/messages.hpp"
+#include "../include-shared/util.hpp"
+#include "../include/drivers/crypto_driver.hpp"
+#include "../include/drivers/kem_driver.hpp"
+#include "../include/drivers/network_driver.hpp"
+#include "../include/pkg/client.hpp"
+
+// Usage: ./benchmarks --benchmark_out=benchmarks.json
+//                     --benchmark_out_format=json
+// Every benchmark reports p50_ns and p99_ns counters next to the usual mean,
+// and bytes_per_second where a payload is involved.
+
+using Clock = std::chrono::steady_clock;
+
+static const int BENCH_PORT = 47123;
+
+/**
+ * Collects per-iteration latencies and publishes percentiles as counters.
+ */
+class LatencyRecorder {
+public:
+  LatencyRecorder(benchmark::State &state) : state(state) {
+    this->samples.reserve(std::min<size_t>(state.max_iterations, 1 << 20));
+  }
+
+  void record(Clock::time_point start) {
+    this->samples.push_back(
+        std::chrono::duration<double, std::nano>(Clock::now() - start)
+            .count());
+  }
+
+  /**
+   * @param bytes payload bytes handled per iteration, or 0 for none
+   */
+  void report(size_t bytes) {
+    if (bytes > 0)
+      this->state.SetBytesProcessed(this->state.iterations() * bytes);
+    if (this->samples.empty())
+      return;
+    this->state.counters["p50_ns"] = this->percentile(0.50);
+    this->state.counters["p99_ns"] = this->percentile(0.99);
+  }
+
+private:
+  double percentile(double p) {
+    size_t k = std::min(this->samples.size() - 1,
+                        (size_t)(p * this->samples.size()));
+    std::nth_element(this->samples.begin(), this->samples.begin() + k,
+                     this->samples.end());
+    return this->samples[k];
+  }
+
+  benchmark::State &state;
+  std::vector<double> samples;
+};
+
+static std::string payload(size_t size) { return std::string(size, 'x'); }
+
+static void payload_sizes(benchmark::internal::Benchmark *b) {
+  for (int size : {16, 256, 4096, 65536})
+    b->Arg(size);
+}
+
+/**
+ * Two clients that have exchanged public values in memory, without a
+ * network in between. They settle on whichever suite this CPU prefers.
+ */
+struct ClientPair {
+  ClientPair(RatchetPolicy policy = RatchetPolicy()) {
+    auto crypto_driver = std::make_shared<CryptoDriver>();
+    this->alice = std::make_shared<Client>(nullptr, crypto_driver);
+    this->bob = std::make_shared<Client>(nullptr, crypto_driver);
+    this->alice->set_ratchet_policy(policy);
+    this->bob->set_ratchet_policy(policy);
+    std::vector<unsigned char> alice_pk = this->alice->start_key_exchange();
+    std::vector<unsigned char> bob_pk = this->bob->start_key_exchange();
+    this->alice->finish_key_exchange(bob_pk);
+    this->bob->finish_key_exchange(alice_pk);
+  }
+
+  /**
+   * Sends plaintext from one client to the other through the wire format.
+   */
+  static void deliver(Client &from, Client &to, const std::string &plaintext) {
+    Message_Message msg = from.send(plaintext);
+    std::vector<unsigned char> data;
+    msg.serialize(data);
+    Message_Message received;
+    received.deserialize(data);
+    if (!to.receive(received).second)
+      throw std::runtime_error("Benchmark message failed to verify.");
+  }
+
+  std::shared_ptr<Client> alice;
+  std::shared_ptr<Client> bob;
+};
+
+// ================================================
+// CLIENT
+// ================================================
+
+/**
+ * One direction only: after the first message every send only steps the
+ * epoch's symmetric chain, so this is the steady-state cost of a message.
+ */
+static void BM_Client_SendReceive(benchmark::State &state) {
+  ClientPair pair;
+  std::string plaintext = payload(state.range(0));
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    ClientPair::deliver(*pair.alice, *pair.bob, plaintext);
+    latency.record(start);
+  }
+  latency.report(plaintext.size());
+}
+BENCHMARK(BM_Client_SendReceive)->Apply(payload_sizes);
+
+/**
+ * The same through the in-place path: sealed straight into a reused frame and
+ * opened where it lies, as the network threads do.
+ */
+static void BM_Client_SendReceiveInPlace(benchmark::State &state) {
+  ClientPair pair;
+  std::string plaintext = payload(state.range(0));
+  std::vector<unsigned char> frame;
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    pair.alice->send(bytes_of(plaintext), frame);
+    if (!pair.bob->receive(MutableByteView{frame.data(), frame.size()}).second)
+      throw std::runtime_error("Benchmark message failed to verify.");
+    latency.record(start);
+  }
+  latency.report(plaintext.size());
+}
+BENCHMARK(BM_Client_SendReceiveInPlace)->Apply(payload_sizes);
+
+/**
+ * Alternating directions under the default ratchet policy: most turns only
+ * step the symmetric chains, and a KEM step runs every few dozen messages.
+ */
+static void BM_Client_RatchetRoundTrip(benchmark::State &state) {
+  ClientPair pair;
+  std::string plaintext = payload(state.range(0));
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    ClientPair::deliver(*pair.alice, *pair.bob, plaintext);
+    ClientPair::deliver(*pair.bob, *pair.alice, plaintext);
+    latency.record(start);
+  }
+  latency.report(2 * plaintext.size());
+}
+BENCHMARK(BM_Client_RatchetRoundTrip)->Apply(payload_sizes);
+
+/**
+ * Alternating directions with a KEM step on every turn, so each iteration
+ * pays for two.
+ */
+static void BM_Client_KEMRoundTrip(benchmark::State &state) {
+  RatchetPolicy policy;
+  policy.messages = 1;
+  ClientPair pair(policy);
+  std::string plaintext = payload(state.range(0));
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    ClientPair::deliver(*pair.alice, *pair.bob, plaintext);
+    ClientPair::deliver(*pair.bob, *pair.alice, plaintext);
+    latency.record(start);
+  }
+  latency.report(2 * plaintext.size());
+}
+BENCHMARK(BM_Client_KEMRoundTrip)->Apply(payload_sizes);
+
+/**
+ * The hybrid X25519 + Kyber handshake followed by the first message each
+ * way, which carries the Kyber ciphertexts: everything a new session pays
+ * before steady state.
+ */
+static void BM_Client_Handshake(benchmark::State &state) {
+  ClientPair pair;
+  std::string plaintext = payload(16);
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    std::vector<unsigned char> alice_pk = pair.alice->start_key_exchange();
+    std::vector<unsigned char> bob_pk = pair.bob->start_key_exchange();
+    pair.alice->finish_key_exchange(bob_pk);
+    pair.bob->finish_key_exchange(alice_pk);
+    ClientPair::deliver(*pair.alice, *pair.bob, plaintext);
+    ClientPair::deliver(*pair.bob, *pair.alice, plaintext);
+    latency.record(start);
+  }
+  latency.report(0);
+}
+BENCHMARK(BM_Client_Handshake);
+
+// ================================================
+// MESSAGES
+// ================================================
+
+static Message_Message sample_message(size_t size, bool epoch_start) {
+  Message_Message msg;
+  msg.epoch = 1;
+  msg.key_id = SecByteBlock(KEY_ID_SIZE);
+  msg.iv = SecByteBlock(AEAD_IV_SIZE);
+  msg.ciphertext = payload(size + AEAD_TAG_SIZE);
+  if (epoch_start) {
+    msg.public_value = SecByteBlock(800);
+    msg.ct = SecByteBlock(768);
+  }
+  return msg;
+}
+
+static void BM_Message_Serialize(benchmark::State &state) {
+  Message_Message msg = sample_message(state.range(0), state.range(1));
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    std::vector<unsigned char> data;
+    msg.serialize(data);
+    benchmark::DoNotOptimize(data.data());
+    latency.record(start);
+  }
+  latency.report(state.range(0));
+}
+BENCHMARK(BM_Message_Serialize)
+    ->ArgsProduct({{16, 256, 4096, 65536}, {0, 1}});
+
+static void BM_Message_Deserialize(benchmark::State &state) {
+  std::vector<unsigned char> data;
+  sample_message(state.range(0), state.range(1)).serialize(data);
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    Message_Message msg;
+    msg.deserialize(data);
+    benchmark::DoNotOptimize(msg.ciphertext.data());
+    latency.record(start);
+  }
+  latency.report(state.range(0));
+}
+BENCHMARK(BM_Message_Deserialize)
+    ->ArgsProduct({{16, 256, 4096, 65536}, {0, 1}});
+
+// ================================================
+// CRYPTO
+// ================================================
+
+static SecByteBlock shared_secret() {
+  SecByteBlock secret(32);
+  DRBGRandomPool().GenerateBlock(secret, secret.size());
+  return secret;
+}
+
+static void BM_Crypto_AESEncrypt(benchmark::State &state) {
+  CryptoDriver crypto_driver;
+  SecByteBlock key = crypto_driver.AES_generate_key(shared_secret());
+  std::string plaintext = payload(state.range(0));
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    benchmark::DoNotOptimize(crypto_driver.AES_encrypt(key, plaintext));
+    latency.record(start);
+  }
+  latency.report(plaintext.size());
+}
+BENCHMARK(BM_Crypto_AESEncrypt)->Apply(payload_sizes);
+
+static void BM_Crypto_AESDecrypt(benchmark::State &state) {
+  CryptoDriver crypto_driver;
+  SecByteBlock key = crypto_driver.AES_generate_key(shared_secret());
+  auto ciphertext = crypto_driver.AES_encrypt(key, payload(state.range(0)));
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    benchmark::DoNotOptimize(
+        crypto_driver.AES_decrypt(key, ciphertext.second, ciphertext.first));
+    latency.record(start);
+  }
+  latency.report(state.range(0));
+}
+BENCHMARK(BM_Crypto_AESDecrypt)->Apply(payload_sizes);
+
+static void BM_Crypto_HMACGenerate(benchmark::State &state) {
+  CryptoDriver crypto_driver;
+  SecByteBlock key = crypto_driver.HMAC_generate_key(shared_secret());
+  std::string data = payload(state.range(0));
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    benchmark::DoNotOptimize(crypto_driver.HMAC_generate(key, data));
+    latency.record(start);
+  }
+  latency.report(data.size());
+}
+BENCHMARK(BM_Crypto_HMACGenerate)->Apply(payload_sizes);
+
+static void BM_Crypto_HMACVerify(benchmark::State &state) {
+  CryptoDriver crypto_driver;
+  SecByteBlock key = crypto_driver.HMAC_generate_key(shared_secret());
+  std::string data = payload(state.range(0));
+  std::string mac = crypto_driver.HMAC_generate(key, data);
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    benchmark::DoNotOptimize(crypto_driver.HMAC_verify(key, data, mac));
+    latency.record(start);
+  }
+  latency.report(data.size());
+}
+BENCHMARK(BM_Crypto_HMACVerify)->Apply(payload_sizes);
+
+static void BM_Crypto_AEADEncrypt(benchmark::State &state) {
+  CryptoDriver crypto_driver;
+  CipherSuite::T suite = (CipherSuite::T)state.range(0);
+  SecByteBlock key = crypto_driver.AEAD_generate_key(shared_secret(), suite);
+  std::string plaintext = payload(state.range(1));
+  std::string header(4 + KEY_ID_SIZE, '\0');
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    benchmark::DoNotOptimize(
+        crypto_driver.AEAD_encrypt(suite, key, plaintext, header));
+    latency.record(start);
+  }
+  latency.report(plaintext.size());
+}
+BENCHMARK(BM_Crypto_AEADEncrypt)
+    ->ArgsProduct({{CipherSuite::AES_GCM, CipherSuite::CHACHA20_POLY1305},
+                   {16, 256, 4096, 65536}});
+
+static void BM_Crypto_AEADDecrypt(benchmark::State &state) {
+  CryptoDriver crypto_driver;
+  CipherSuite::T suite = (CipherSuite::T)state.range(0);
+  SecByteBlock key = crypto_driver.AEAD_generate_key(shared_secret(), suite);
+  std::string header(4 + KEY_ID_SIZE, '\0');
+  auto ciphertext =
+      crypto_driver.AEAD_encrypt(suite, key, payload(state.range(1)), header);
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    benchmark::DoNotOptimize(crypto_driver.AEAD_decrypt(
+        suite, key, ciphertext.second, ciphertext.first, header));
+    latency.record(start);
+  }
+  latency.report(state.range(1));
+}
+BENCHMARK(BM_Crypto_AEADDecrypt)
+    ->ArgsProduct({{CipherSuite::AES_GCM, CipherSuite::CHACHA20_POLY1305},
+                   {16, 256, 4096, 65536}});
+
+// The span forms, writing into buffers sized once outside the loop.
+static void BM_Crypto_AEADEncryptInto(benchmark::State &state) {
+  CryptoDriver crypto_driver;
+  CipherSuite::T suite = (CipherSuite::T)state.range(0);
+  SecByteBlock key = crypto_driver.AEAD_generate_key(shared_secret(), suite);
+  std::string plaintext = payload(state.range(1));
+  std::string header(4 + KEY_ID_SIZE, '\0');
+  SecByteBlock iv(AEAD_IV_SIZE);
+  std::string ciphertext(plaintext.size() + AEAD_TAG_SIZE, '\0');
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    crypto_driver.AEAD_encrypt(suite, bytes_of(key), bytes_of(plaintext),
+                               bytes_of(header), buffer_of(iv),
+                               buffer_of(ciphertext));
+    benchmark::DoNotOptimize(ciphertext.data());
+    latency.record(start);
+  }
+  latency.report(plaintext.size());
+}
+BENCHMARK(BM_Crypto_AEADEncryptInto)
+    ->ArgsProduct({{CipherSuite::AES_GCM, CipherSuite::CHACHA20_POLY1305},
+                   {16, 256, 4096, 65536}});
+
+static void BM_Crypto_HashInto(benchmark::State &state) {
+  CryptoDriver crypto_driver;
+  std::string data = payload(state.range(0));
+  SecByteBlock digest(SHA256::DIGESTSIZE);
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    crypto_driver.hash({bytes_of(data)}, buffer_of(digest));
+    benchmark::DoNotOptimize(digest.BytePtr());
+    latency.record(start);
+  }
+  latency.report(data.size());
+}
+BENCHMARK(BM_Crypto_HashInto)->Apply(payload_sizes);
+
+static void BM_Crypto_Hash(benchmark::State &state) {
+  CryptoDriver crypto_driver;
+  SecByteBlock data((const byte *)payload(state.range(0)).data(),
+                    state.range(0));
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    benchmark::DoNotOptimize(crypto_driver.hash(data));
+    latency.record(start);
+  }
+  latency.report(data.size());
+}
+BENCHMARK(BM_Crypto_Hash)->Apply(payload_sizes);
+
+static void BM_KEM_Keypair(benchmark::State &state) {
+  KEMDriver kem_driver;
+  state.SetLabel(kem_driver.backend_name());
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    benchmark::DoNotOptimize(kem_driver.generate_keypair());
+    latency.record(start);
+  }
+  latency.report(0);
+}
+BENCHMARK(BM_KEM_Keypair);
+
+static void BM_KEM_Encapsulate(benchmark::State &state) {
+  KEMDriver kem_driver;
+  state.SetLabel(kem_driver.backend_name());
+  auto keys = kem_driver.generate_keypair();
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    benchmark::DoNotOptimize(kem_driver.encapsulate(keys.first));
+    latency.record(start);
+  }
+  latency.report(0);
+}
+BENCHMARK(BM_KEM_Encapsulate);
+
+static void BM_KEM_Decapsulate(benchmark::State &state) {
+  KEMDriver kem_driver;
+  state.SetLabel(kem_driver.backend_name());
+  auto keys = kem_driver.generate_keypair();
+  auto ct_ss = kem_driver.encapsulate(keys.first);
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    benchmark::DoNotOptimize(kem_driver.decapsulate(ct_ss.first, keys.second));
+    latency.record(start);
+  }
+  latency.report(0);
+}
+BENCHMARK(BM_KEM_Decapsulate);
+
+/**
+ * Encapsulations to `range(0)` public keys in one batched call; items/s is
+ * comparable with BM_KEM_Encapsulate's iterations/s.
+ */
+static void BM_KEM_EncapsulateBatch(benchmark::State &state) {
+  KEMDriver kem_driver;
+  state.SetLabel(kem_driver.backend_name());
+  std::vector<SecByteBlock> public_keys;
+  for (auto &keys : kem_driver.generate_keypairs(state.range(0)))
+    public_keys.push_back(keys.first);
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    benchmark::DoNotOptimize(kem_driver.encapsulate(public_keys));
+    latency.record(start);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  latency.report(0);
+}
+BENCHMARK(BM_KEM_EncapsulateBatch)->Arg(4)->Arg(16);
+
+// ================================================
+// NETWORK
+// ================================================
+
+/**
+ * One frame to an echo peer over loopback TCP and back again. Both ends
+ * receive into pooled buffers, as Client does.
+ */
+static void BM_Network_LoopbackRoundTrip(benchmark::State &state) {
+  int port = BENCH_PORT;
+  // The echo thread owns its end and reports through the promise whether it
+  // got a connection; an exception escaping it would terminate the run.
+  std::shared_ptr<NetworkDriverImpl> server =
+      std::make_shared<NetworkDriverImpl>();
+  std::shared_ptr<std::promise<void>> accepted =
+      std::make_shared<std::promise<void>>();
+  std::future<void> connected = accepted->get_future();
+  boost::thread echo([server, accepted, port]() {
+    try {
+      server->listen(port);
+      accepted->set_value();
+    } catch (std::exception &) {
+      accepted->set_exception(std::current_exception());
+      return;
+    }
+    try {
+      while (true) {
+        FrameBuffer frame = server->read_frame();
+        server->send(ByteView{frame.data(), frame.size()});
+      }
+    } catch (std::runtime_error &) {
+      // Client hung up.
+    }
+  });
+
+  NetworkDriverImpl client;
+  std::string error;
+  for (int attempt = 0;; attempt++) {
+    // Only a failed listen settles the future before we connect.
+    if (connected.wait_for(std::chrono::seconds(0)) ==
+        std::future_status::ready)
+      break;
+    try {
+      client.connect("127.0.0.1", port);
+      break;
+    } catch (boost::system::system_error &e) {
+      if (attempt == 100) {
+        error = e.what();
+        break;
+      }
+      boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+    }
+  }
+  if (error.empty()) {
+    try {
+      connected.get();
+    } catch (std::exception &e) {
+      error = e.what();
+    }
+  }
+  if (!error.empty()) {
+    // An echo thread still waiting to accept keeps its end alive itself.
+    echo.detach();
+    state.SkipWithError(("Loopback setup failed: " + error).c_str());
+    return;
+  }
+
+  std::vector<unsigned char> data(state.range(0), 'x');
+  LatencyRecorder latency(state);
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    client.send(data);
+    FrameBuffer frame = client.read_frame();
+    benchmark::DoNotOptimize(frame.data());
+    latency.record(start);
+  }
+  latency.report(2 * data.size());
+  client.disconnect();
+  echo.join();
+}
+BENCHMARK(BM_Network_LoopbackRoundTrip)->Apply(payload_sizes)->UseRealTime();
+
+BENCHMARK_MAIN();
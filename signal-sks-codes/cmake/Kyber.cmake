@@ -0,0 +1,131 @@
+# --------------------------------------------------------------------------------
+#                         Kyber (vendored pq-crystals sources).
+# --------------------------------------------------------------------------------
+# Builds every Kyber parameter set (512/768/1024, each with SHAKE or with the
+# AES/SHA-2 "90s" symmetric primitives) as a static library for the reference
+# backend and, on x86-64, the AVX2 backend. The AVX2 objects are compiled with
+# -mavx2 (and -maes for the 90s variants) but are only ever called after
+# KEMDriver has checked the CPU at runtime, so the binary stays portable.
+enable_language(ASM)
+
+set(KYBER_DIR ${PROJECT_SOURCE_DIR}/kyber)
+
+option(KYBER_AVX2 "Build the AVX2 Kyber backend with runtime CPU dispatch" ON)
+if(NOT CMAKE_SYSTEM_PROCESSOR MATCHES "x86_64|AMD64|amd64")
+  set(KYBER_AVX2 OFF)
+endif()
+
+# name:KYBER_K:90s for every parameter set.
+set(KYBER_PARAMETER_SETS
+  kyber512:2:0 kyber768:3:0 kyber1024:4:0
+  kyber512_90s:2:1 kyber768_90s:3:1 kyber1024_90s:4:1)
+
+# Symmetric primitives for the reference backend and the DRBG.
+add_library(pqcrystals_fips202_ref STATIC ${KYBER_DIR}/ref/fips202.c)
+add_library(pqcrystals_aes256ctr_ref STATIC ${KYBER_DIR}/ref/aes256ctr.c)
+add_library(pqcrystals_sha2_ref STATIC ${KYBER_DIR}/ref/sha256.c ${KYBER_DIR}/ref/sha512.c)
+foreach(target pqcrystals_fips202_ref pqcrystals_aes256ctr_ref pqcrystals_sha2_ref)
+  target_compile_options(${target} PRIVATE -O3 -fomit-frame-pointer)
+  set_target_properties(${target} PROPERTIES POSITION_INDEPENDENT_CODE ON)
+endforeach()
+
+# randombytes() is shared by every backend. It is served from our per-thread
+# DRBG (src/drivers/drbg.cxx) instead of ref/randombytes.c, which made a
+# getrandom syscall on every call.
+find_package(Threads REQUIRED)
+add_library(pqcrystals_randombytes STATIC ${PROJECT_SOURCE_DIR}/src/drivers/drbg.cxx)
+target_link_libraries(pqcrystals_randombytes PUBLIC pqcrystals_fips202_ref Threads::Threads)
+set_target_properties(pqcrystals_randombytes PROPERTIES
+  POSITION_INDEPENDENT_CODE ON
+  CXX_STANDARD 17
+  CXX_STANDARD_REQUIRED YES)
+
+set(KYBER_LIBRARIES)
+
+# Reference backend.
+set(KYBER_REF_SRCS
+  ${KYBER_DIR}/ref/kem.c
+  ${KYBER_DIR}/ref/kex.c
+  ${KYBER_DIR}/ref/indcpa.c
+  ${KYBER_DIR}/ref/polyvec.c
+  ${KYBER_DIR}/ref/poly.c
+  ${KYBER_DIR}/ref/ntt.c
+  ${KYBER_DIR}/ref/cbd.c
+  ${KYBER_DIR}/ref/reduce.c
+  ${KYBER_DIR}/ref/verify.c)
+foreach(params ${KYBER_PARAMETER_SETS})
+  string(REPLACE ":" ";" params ${params})
+  list(GET params 0 name)
+  list(GET params 1 k)
+  list(GET params 2 nineties)
+  set(target pqcrystals_${name}_ref)
+  if(nineties)
+    add_library(${target} STATIC ${KYBER_REF_SRCS} ${KYBER_DIR}/ref/symmetric-aes.c)
+    target_compile_definitions(${target} PRIVATE KYBER_K=${k} KYBER_90S)
+    target_link_libraries(${target} PUBLIC pqcrystals_aes256ctr_ref pqcrystals_sha2_ref)
+  else()
+    add_library(${target} STATIC ${KYBER_REF_SRCS} ${KYBER_DIR}/ref/symmetric-shake.c)
+    target_compile_definitions(${target} PRIVATE KYBER_K=${k})
+    target_link_libraries(${target} PUBLIC pqcrystals_fips202_ref)
+  endif()
+  target_compile_options(${target} PRIVATE -O3 -fomit-frame-pointer)
+  set_target_properties(${target} PROPERTIES POSITION_INDEPENDENT_CODE ON)
+  target_link_libraries(${target} PUBLIC pqcrystals_randombytes)
+  list(APPEND KYBER_LIBRARIES ${target})
+endforeach()
+
+# AVX2 backend (NTT/basemul in assembly, 4-way Keccak, AES-NI for 90s).
+if(KYBER_AVX2)
+  set(KYBER_AVX2_FLAGS -mavx2 -mbmi2 -mpopcnt -O3 -fomit-frame-pointer)
+
+  add_library(pqcrystals_fips202_avx2 STATIC
+    ${KYBER_DIR}/avx2/fips202.c
+    ${KYBER_DIR}/avx2/fips202x4.c
+    ${KYBER_DIR}/avx2/keccak4x/KeccakP-1600-times4-SIMD256.c)
+  target_compile_options(pqcrystals_fips202_avx2 PRIVATE ${KYBER_AVX2_FLAGS})
+  add_library(pqcrystals_aes256ctr_avx2 STATIC ${KYBER_DIR}/avx2/aes256ctr.c)
+  target_compile_options(pqcrystals_aes256ctr_avx2 PRIVATE ${KYBER_AVX2_FLAGS} -maes)
+  set_target_properties(pqcrystals_fips202_avx2 pqcrystals_aes256ctr_avx2
+    PROPERTIES POSITION_INDEPENDENT_CODE ON)
+
+  set(KYBER_AVX2_SRCS
+    ${KYBER_DIR}/avx2/kem.c
+    ${KYBER_DIR}/avx2/kex.c
+    ${KYBER_DIR}/avx2/indcpa.c
+    ${KYBER_DIR}/avx2/polyvec.c
+    ${KYBER_DIR}/avx2/poly.c
+    ${KYBER_DIR}/avx2/fq.S
+    ${KYBER_DIR}/avx2/shuffle.S
+    ${KYBER_DIR}/avx2/ntt.S
+    ${KYBER_DIR}/avx2/invntt.S
+    ${KYBER_DIR}/avx2/basemul.S
+    ${KYBER_DIR}/avx2/consts.c
+    ${KYBER_DIR}/avx2/rejsample.c
+    ${KYBER_DIR}/avx2/cbd.c
+    ${KYBER_DIR}/avx2/verify.c)
+  foreach(params ${KYBER_PARAMETER_SETS})
+    string(REPLACE ":" ";" params ${params})
+    list(GET params 0 name)
+    list(GET params 1 k)
+    list(GET params 2 nineties)
+    set(target pqcrystals_${name}_avx2)
+    if(nineties)
+      add_library(${target} STATIC ${KYBER_AVX2_SRCS})
+      target_compile_definitions(${target} PRIVATE KYBER_K=${k} KYBER_90S)
+      target_compile_options(${target} PRIVATE -maes)
+      target_link_libraries(${target} PUBLIC pqcrystals_aes256ctr_avx2 pqcrystals_sha2_ref)
+    else()
+      add_library(${target} STATIC ${KYBER_AVX2_SRCS} ${KYBER_DIR}/avx2/symmetric-shake.c)
+      target_compile_definitions(${target} PRIVATE KYBER_K=${k})
+      target_link_libraries(${target} PUBLIC pqcrystals_fips202_avx2)
+    endif()
+    # The .S files pull in fq.inc/shuffle.inc with a bare `.include`.
+    target_include_directories(${target} PRIVATE ${KYBER_DIR}/avx2)
+    target_compile_options(${target} PRIVATE ${KYBER_AVX2_FLAGS}
+      $<$<COMPILE_LANGUAGE:ASM>:-Wa,--noexecstack>)
+    set_target_properties(${target} PROPERTIES POSITION_INDEPENDENT_CODE ON)
+    target_link_libraries(${target} PUBLIC pqcrystals_randombytes)
+    list(APPEND KYBER_LIBRARIES ${target})
+  endforeach()
+  add_definitions(-DKYBER_AVX2)
+endif()
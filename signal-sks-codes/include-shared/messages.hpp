@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <stdexcept>
@@ -15,13 +16,56 @@
 
 namespace MessageType {
 enum T {
-  DHParams_Message = 0,
   PublicValue = 1,
   Message = 2,
+  Onion_Create = 3,
+  Onion_Created = 4,
+  Onion_Relay = 5,
+  Onion_Destroy = 6,
+  Resume = 7,
+  SessionTicket = 8,
 };
 }
 MessageType::T get_message_type(std::vector<unsigned char> &data);
 
+// ================================================
+// CIPHER SUITES
+// ================================================
+
+namespace CipherSuite {
+enum T {
+  AES_CBC_HMAC_SHA256 = 0,
+  AES_GCM = 1,
+  CHACHA20_POLY1305 = 2,
+};
+}
+
+// Kyber parameter sets. The _90S variants swap SHAKE for AES-256-CTR and
+// SHA-2, which is faster on hosts with AES-NI.
+namespace KEMParams {
+enum T {
+  KYBER512 = 1,
+  KYBER768 = 2,
+  KYBER1024 = 3,
+  KYBER512_90S = 4,
+  KYBER768_90S = 5,
+  KYBER1024_90S = 6,
+};
+}
+
+// Commands carried inside the layered payload of an Onion_Relay cell.
+namespace RelayCommand {
+enum T {
+  EXTEND = 1,
+  EXTENDED = 2,
+  BEGIN = 3,
+  CONNECTED = 4,
+  DATA = 5,
+  END = 6,
+  SENDME = 7,
+};
+}
+
 // ================================================
 // SERIALIZABLE
 // ================================================
@@ -40,27 +84,125 @@ int get_string(std::string *s, std::vector<unsigned char> &data, int idx);
 int get_integer(CryptoPP::Integer *i, std::vector<unsigned char> &data,
                 int idx);
 
+// ================================================
+// BINARY WIRE FORMAT
+// ================================================
+
+// Version byte written after the message type by put_bytes-framed messages.
+const unsigned char WIRE_FORMAT_VERSION = 7;
+
+// Size of the key ID that binds a message to its ratchet epoch.
+const size_t KEY_ID_SIZE = 8;
+
+// Non-owning view of bytes inside a receive buffer.
+struct ByteView {
+  const unsigned char *data = nullptr;
+  size_t size = 0;
+};
+
+// Non-owning view of a caller-provided buffer to write into.
+struct MutableByteView {
+  unsigned char *data = nullptr;
+  size_t size = 0;
+};
+
+// Views of a whole block or string, to read from or to write into.
+ByteView bytes_of(const CryptoPP::SecByteBlock &block);
+ByteView bytes_of(const std::string &s);
+MutableByteView buffer_of(CryptoPP::SecByteBlock &block);
+MutableByteView buffer_of(std::string &s);
+
+// Fields are framed by a little-endian u32 length.
+void put_u16(uint16_t v, unsigned char *out);
+uint16_t get_u16(const unsigned char *in);
+void put_u32(uint32_t v, unsigned char *out);
+uint32_t get_u32(const unsigned char *in);
+int put_bytes(const unsigned char *bytes, size_t size,
+              std::vector<unsigned char> &data);
+int get_bytes(ByteView *view, const unsigned char *data, size_t size,
+              size_t idx);
+
 // ================================================
 // MESSAGES
 // ================================================
 
-struct DHParams_Message : public Serializable {
-  CryptoPP::Integer p;
-  CryptoPP::Integer q;
-  CryptoPP::Integer g;
+struct PublicValue_Message : public Serializable {
+  CryptoPP::SecByteBlock public_value;
+  CryptoPP::SecByteBlock dh_public_value;
+  CipherSuite::T cipher_suite = CipherSuite::AES_CBC_HMAC_SHA256;
+  KEMParams::T kem_params = KEMParams::KYBER512;
+
+  // Authenticated handshakes only; empty otherwise. The sender's long-term
+  // key ID, the long-term key ID the initiator authenticates to, and the
+  // initiator's or responder's authenticated key exchange message.
+  CryptoPP::SecByteBlock sender_key_id;
+  CryptoPP::SecByteBlock recipient_key_id;
+  CryptoPP::SecByteBlock ake_message;
+  // A resumption ticket, in a server's answer; empty otherwise.
+  CryptoPP::SecByteBlock ticket;
 
   void serialize(std::vector<unsigned char> &data);
   int deserialize(std::vector<unsigned char> &data);
 };
 
-struct PublicValue_Message : public Serializable {
-  CryptoPP::SecByteBlock public_value;
+// Size of each side's nonce in a resumption.
+const size_t RESUME_NONCE_SIZE = 32;
+
+// Sent by a client instead of PublicValue_Message to resume a session, and
+// answered in kind by the server: with its own nonce and a fresh ticket if it
+// accepts the ticket, or with an empty nonce if the client must fall back to
+// a full key exchange.
+struct Resume_Message : public Serializable {
+  CryptoPP::SecByteBlock ticket;
+  CryptoPP::SecByteBlock nonce;
+
+  void serialize(std::vector<unsigned char> &data);
+  int deserialize(std::vector<unsigned char> &data);
+};
+
+// What a session can be resumed from. The server seals it, without the
+// ticket, into the ticket it issues; the client keeps it with the ticket.
+struct SessionTicket : public Serializable {
+  CryptoPP::SecByteBlock ticket;
+  CryptoPP::SecByteBlock resumption_secret;
+  CipherSuite::T cipher_suite = CipherSuite::AES_CBC_HMAC_SHA256;
+  KEMParams::T kem_params = KEMParams::KYBER512;
+  CryptoPP::SecByteBlock peer_key_id;
 
   void serialize(std::vector<unsigned char> &data);
   int deserialize(std::vector<unsigned char> &data);
 };
 
+// Zero-copy decoding of a serialized Message_Message; every field points into
+// the buffer that was parsed, which must outlive the view.
+struct Message_View {
+  uint32_t epoch;
+  uint32_t counter;
+  ByteView key_id;
+  ByteView iv;
+  ByteView public_value;
+  ByteView ciphertext;
+  ByteView mac;
+  ByteView ct;
+
+  int parse(const unsigned char *data, size_t size);
+};
+
+// Room for a message's sealed fields inside a serialized frame, so they can
+// be encrypted in place. Valid until the frame is next resized.
+struct Message_Frame {
+  MutableByteView iv;
+  MutableByteView ciphertext;
+  MutableByteView mac;
+};
+
+// public_value and ct are only sent on the first message of a ratchet epoch;
+// every message names its epoch by number and key ID, and its position in the
+// epoch's symmetric chain by counter.
 struct Message_Message : public Serializable {
+  uint32_t epoch = 0;
+  uint32_t counter = 0;
+  CryptoPP::SecByteBlock key_id;
   CryptoPP::SecByteBlock iv;
   CryptoPP::SecByteBlock public_value;
   std::string ciphertext;
@@ -69,4 +211,88 @@ struct Message_Message : public Serializable {
 
   void serialize(std::vector<unsigned char> &data);
   int deserialize(std::vector<unsigned char> &data);
+  // Serializes everything but iv, ciphertext and mac, which get room of the
+  // given sizes to be written in place.
+  Message_Frame serialize_frame(size_t iv_size, size_t ciphertext_size,
+                                size_t mac_size,
+                                std::vector<unsigned char> &data);
+  // A view of this message's own fields, as if it had been parsed.
+  Message_View view() const;
+};
+
+// ================================================
+// ONION CIRCUITS
+// ================================================
+
+// Links between onion relays carry a stream of fixed-size cells: u32 circuit
+// ID, u8 command (one of the Onion_* message types), u16 payload length, then
+// the payload padded with zeros to CELL_SIZE. Every cell looks alike on the
+// wire whatever it carries, and relays handle them in place, in batches, with
+// no per-cell allocation. A cell holds a Kyber1024 public value plus an
+// EXTEND header, so every handshake fits in one.
+const size_t CELL_SIZE = 2048;
+const size_t CELL_HEADER_SIZE = sizeof(uint32_t) + 1 + sizeof(uint16_t);
+const size_t CELL_PAYLOAD_SIZE = CELL_SIZE - CELL_HEADER_SIZE;
+
+// Relay payloads start with a u16 "recognized" field that is zero in
+// plaintext, a 4-byte running digest, the command and a u16 data length. The
+// whole CELL_PAYLOAD_SIZE is layered, padding included.
+const size_t RELAY_DIGEST_OFFSET = 2;
+const size_t RELAY_DIGEST_SIZE = 4;
+const size_t RELAY_HEADER_SIZE = 2 + RELAY_DIGEST_SIZE + 1 + sizeof(uint16_t);
+const size_t RELAY_DATA_SIZE = CELL_PAYLOAD_SIZE - RELAY_HEADER_SIZE;
+
+// End-to-end flow control between the client and the exit, per circuit and
+// direction. Each side may send CIRCUIT_WINDOW_START RELAY_DATA cells ahead;
+// the receiver answers every CIRCUIT_WINDOW_INCREMENT cells it has delivered
+// with a SENDME that lets the sender have that many more.
+const int CIRCUIT_WINDOW_START = 1000;
+const int CIRCUIT_WINDOW_INCREMENT = 100;
+
+// Create: payload is the client's Kyber public value. Created: payload is the
+// KEM ciphertext. Relay: payload is a layered relay message. Destroy: empty.
+void put_cell(uint32_t circuit_id, MessageType::T command,
+              const unsigned char *payload, size_t size, unsigned char *cell);
+void put_relay_cell(uint32_t circuit_id, RelayCommand::T command,
+                    const unsigned char *data, size_t size,
+                    unsigned char *cell);
+
+// In-place view of one CELL_SIZE cell; relays peel or add a layer through it
+// and forward the same bytes.
+struct Cell_View {
+  uint32_t circuit_id;
+  MessageType::T command;
+  unsigned char *payload;
+  size_t size;
+
+  void parse(unsigned char *cell);
+};
+
+// Zero-copy decoding of a recognized relay payload.
+struct Relay_View {
+  RelayCommand::T command;
+  ByteView data;
+
+  void parse(const unsigned char *payload, size_t size);
+};
+
+// Plaintext of one onion layer. The recognized and digest fields are written
+// as zero here and filled in by OnionLayer::seal.
+struct Relay_Message {
+  RelayCommand::T command = RelayCommand::DATA;
+  std::vector<unsigned char> data;
+
+  void serialize_cell(uint32_t circuit_id, unsigned char *cell);
+  void deserialize(const unsigned char *payload, size_t size);
+};
+
+// Where to extend a circuit or open a stream. EXTEND carries the client's
+// Kyber public value for the next hop; BEGIN leaves it empty.
+struct RelayTarget {
+  std::string address;
+  uint32_t port = 0;
+  CryptoPP::SecByteBlock public_value;
+
+  void serialize(std::vector<unsigned char> &out);
+  int deserialize(const unsigned char *in, size_t size);
 };
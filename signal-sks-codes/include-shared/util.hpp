@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <stdexcept>
@@ -30,3 +31,7 @@ void print_key_as_hex(const CryptoPP::SecByteBlock &block);
 std::string concat_msg_fields(CryptoPP::SecByteBlock iv,
                               CryptoPP::SecByteBlock public_value,
                               std::string ciphertext);
+
+// Epoch number, counter and key ID as the bytes that get authenticated.
+CryptoPP::SecByteBlock epoch_header(uint32_t epoch, uint32_t counter,
+                                    const CryptoPP::SecByteBlock &key_id);
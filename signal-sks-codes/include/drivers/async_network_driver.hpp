@@ -0,0 +1,159 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/thread.hpp>
+
+#include "../../include/drivers/frame_pool.hpp"
+
+class AsyncConnection;
+
+/**
+ * Per-connection state and callbacks. One handler is created for every
+ * accepted or dialed connection and lives as long as the connection does.
+ * All callbacks for a connection run on that connection's io_context thread,
+ * so a handler never sees concurrent calls.
+ *
+ * A handler whose cell_size() is 0 gets length-prefixed frames through
+ * on_frame. Otherwise the connection carries fixed-size cells: on_cells gets
+ * every whole cell that arrived in one read, in place in the read buffer, and
+ * send_cells must be used to write. A cell size of 1 makes the connection a
+ * plain byte stream. Cells are queued per sender-chosen queue (e.g. one per
+ * circuit) and written round-robin, so one busy queue cannot starve the
+ * others sharing the connection.
+ *
+ * A handler whose queue_limit() is not 0 caps how many bytes may wait to be
+ * written. In cell mode the cap is per queue: cells that would take a queue
+ * past it are dropped along with the rest of that queue, and on_overflow is
+ * told which queue it was. In frame mode the cap covers every queued frame,
+ * and going past it closes the connection. on_written runs after every
+ * write in cell mode, so a handler can let more in once queued_bytes has
+ * gone down.
+ */
+class SessionHandler {
+public:
+  virtual ~SessionHandler() = default;
+  virtual size_t cell_size() { return 0; }
+  virtual void on_open(std::shared_ptr<AsyncConnection>) {}
+  virtual void on_frame(std::shared_ptr<AsyncConnection>,
+                        std::vector<unsigned char> &) {}
+  virtual void on_cells(std::shared_ptr<AsyncConnection>, unsigned char *,
+                        size_t) {}
+  virtual void on_close(std::shared_ptr<AsyncConnection>) {}
+  virtual size_t queue_limit() { return 0; }
+  virtual void on_overflow(std::shared_ptr<AsyncConnection>, uint32_t) {}
+  virtual void on_written(std::shared_ptr<AsyncConnection>) {}
+};
+
+using SessionFactory = std::function<std::shared_ptr<SessionHandler>()>;
+using ConnectHandler = std::function<void(std::shared_ptr<AsyncConnection>)>;
+
+/**
+ * One TCP connection framed the same way as NetworkDriverImpl (4-byte
+ * big-endian length, then payload), or carrying fixed-size cells if the
+ * handler asks for them. Reads run continuously once started; writes are
+ * queued and may be issued from any thread. Frames are read into one buffer
+ * that is reused for every frame, and a frame over the maximum frame size
+ * closes the connection.
+ */
+class AsyncConnection : public std::enable_shared_from_this<AsyncConnection> {
+public:
+  AsyncConnection(boost::asio::ip::tcp::socket socket,
+                  std::shared_ptr<SessionHandler> handler,
+                  size_t max_frame_size = MAX_FRAME_SIZE);
+  void start();
+  void send(std::vector<unsigned char> data);
+  void send_cells(const unsigned char *cells, size_t count,
+                  uint32_t queue = 0);
+  size_t queued_bytes(uint32_t queue = 0);
+  void set_reading(bool reading);
+  void disconnect();
+  std::string get_remote_info();
+
+private:
+  void read_header();
+  void read_body();
+  void read_cells();
+  void write_next();
+  void write_cells();
+  void close();
+
+  boost::asio::ip::tcp::socket socket;
+  std::shared_ptr<SessionHandler> handler;
+  std::string remote_info;
+  bool closed;
+
+  size_t max_frame_size;
+  uint32_t read_length;
+  std::vector<unsigned char> read_buffer;
+
+  size_t queue_limit;
+  uint32_t write_length;
+  std::deque<std::vector<unsigned char>> write_queue;
+  size_t write_queued;
+
+  // Cell mode. Reads fill read_buffer with up to a batch of cells, unless
+  // paused by set_reading. Writers append to their queue under cell_mtx; the
+  // io thread builds each write in cell_batch by taking a turn from every
+  // active queue in rotation.
+  struct CellQueue {
+    std::vector<unsigned char> bytes;
+    size_t head = 0;
+  };
+  size_t cell_size;
+  size_t read_filled;
+  bool reading_paused;
+  bool read_stalled;
+  std::mutex cell_mtx;
+  std::unordered_map<uint32_t, CellQueue> cell_queues;
+  std::deque<uint32_t> active_queues;
+  std::vector<unsigned char> cell_batch;
+  bool cell_writing;
+  bool cells_closed;
+};
+
+/**
+ * Serves many connections from a pool of io_contexts, one per thread.
+ * Accepted sockets are assigned round-robin, so a connection is pinned to a
+ * single thread for its whole life and needs no locking.
+ */
+class AsyncNetworkDriver {
+public:
+  AsyncNetworkDriver(int num_threads = 0,
+                     size_t max_frame_size = MAX_FRAME_SIZE);
+  void listen(int port, SessionFactory factory);
+  std::shared_ptr<AsyncConnection>
+  connect(std::string address, int port,
+          std::shared_ptr<SessionHandler> handler);
+  void async_connect(std::string address, int port,
+                     std::shared_ptr<SessionHandler> handler,
+                     ConnectHandler on_connect);
+  void run();
+  void stop();
+
+private:
+  void accept();
+  boost::asio::io_context &next_io_context();
+
+  std::vector<std::shared_ptr<boost::asio::io_context>> io_contexts;
+  std::vector<boost::asio::executor_work_guard<
+      boost::asio::io_context::executor_type>>
+      work_guards;
+  std::atomic<size_t> next_context;
+  boost::thread_group threads;
+  size_t max_frame_size;
+
+  std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor;
+  std::unique_ptr<boost::asio::steady_timer> accept_timer;
+  SessionFactory factory;
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+
+#include <crypto++/rijndael.h>
+#include <crypto++/sha.h>
+
+#include "../../include-shared/messages.hpp"
+
+using namespace CryptoPP;
+
+// Nonce and tag sizes shared by AES-GCM and ChaCha20-Poly1305.
+const size_t AEAD_IV_SIZE = 12;
+const size_t AEAD_TAG_SIZE = 16;
+
+// Most key material any suite needs: the legacy suite's AES and HMAC keys.
+const size_t MAX_KEY_MATERIAL_SIZE = AES::DEFAULT_KEYLENGTH + SHA256::BLOCKSIZE;
+
+/**
+ * How each cipher suite lays out a message: the sizes of its sealed fields
+ * and how much key material it takes. Every message is sealed under its own
+ * key from the ratchet chain, which replaced contexts keyed once per epoch
+ * and reused for every message, so nothing here holds keys.
+ */
+class CipherContext {
+public:
+  static size_t key_material_size(CipherSuite::T suite);
+  static size_t iv_size(CipherSuite::T suite);
+  static size_t ciphertext_size(CipherSuite::T suite, size_t plaintext_size);
+  static size_t mac_size(CipherSuite::T suite);
+};
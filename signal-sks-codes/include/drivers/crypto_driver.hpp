@@ -2,45 +2,123 @@
 
 #include <cmath>
 #include <cstdlib>
+#include <initializer_list>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <tuple>
 
+#include <crypto++/chachapoly.h>
+#include <crypto++/cpu.h>
 #include <crypto++/cryptlib.h>
-#include <crypto++/dh.h>
-#include <crypto++/dh2.h>
 #include <crypto++/files.h>
+#include <crypto++/gcm.h>
 #include <crypto++/hex.h>
 #include <crypto++/hkdf.h>
 #include <crypto++/hmac.h>
 #include <crypto++/integer.h>
 #include <crypto++/modes.h>
-#include <crypto++/nbtheory.h>
 #include <crypto++/osrng.h>
 #include <crypto++/rijndael.h>
 #include <crypto++/sha.h>
+#include <crypto++/xed25519.h>
 
 #include "../../include-shared/messages.hpp"
+#include "../../include/drivers/cipher_context.hpp"
+#include "../../include/drivers/drbg.hpp"
+#include "../../include/drivers/onion_layer.hpp"
 
 using namespace CryptoPP;
 
+/**
+ * Crypto++ interface to the per-thread DRBG. Stateless, so one instance can
+ * be shared across threads; each call draws from the caller's own buffer.
+ */
+class DRBGRandomPool : public RandomNumberGenerator {
+public:
+  void GenerateBlock(byte *output, size_t size) override;
+};
+
+CipherSuite::T cipher_suite_from_name(const std::string &name);
+
+/**
+ * Every primitive comes in two forms. The span forms read from ByteViews and
+ * write into caller-provided buffers of the sizes given with each, driving
+ * Crypto++ through ProcessData/Update/Final with no filter chain and no
+ * intermediate copies; the message path uses them. The forms that take and
+ * return blocks and strings are wrappers around them.
+ */
 class CryptoDriver {
 public:
-  DHParams_Message DH_generate_params();
-  std::tuple<DH, SecByteBlock, SecByteBlock>
-  DH_initialize(const DHParams_Message &DH_params);
-  SecByteBlock
-  DH_generate_shared_key(const DH &DH_obj, const SecByteBlock &DH_private_value,
-                         const SecByteBlock &DH_other_public_value);
+  CryptoDriver();
+  explicit CryptoDriver(CipherSuite::T preferred_suite);
+
+  std::pair<SecByteBlock, SecByteBlock> X25519_generate_keypair();
+  SecByteBlock X25519_generate_shared_key(const SecByteBlock &private_value,
+                                          const SecByteBlock &other_public_value);
+  SecByteBlock hybrid_shared_key(const SecByteBlock &X25519_shared_key,
+                                 const SecByteBlock &KEM_shared_secret);
+  SecByteBlock resumption_secret(const SecByteBlock &handshake_key);
+  SecByteBlock resumed_handshake_key(const SecByteBlock &resumption_secret,
+                                     const SecByteBlock &nonces);
+  SecByteBlock ticket_key(const SecByteBlock &long_term_private_key);
+  SecByteBlock bind_offers(const SecByteBlock &handshake_key,
+                           const SecByteBlock &offers);
+  std::pair<SecByteBlock, SecByteBlock>
+  chain_step(const SecByteBlock &chain_key);
+  void chain_step(ByteView chain_key, MutableByteView next_chain_key,
+                  MutableByteView message_key);
 
   SecByteBlock AES_generate_key(const SecByteBlock &DH_shared_key);
-  std::pair<std::string, SecByteBlock> AES_encrypt(SecByteBlock key,
-                                                   std::string plaintext);
-  std::string AES_decrypt(SecByteBlock key, SecByteBlock iv,
-                          std::string ciphertext);
+  static size_t AES_ciphertext_size(size_t plaintext_size);
+  std::pair<std::string, SecByteBlock> AES_encrypt(const SecByteBlock &key,
+                                                   const std::string &plaintext);
+  size_t AES_encrypt(ByteView key, ByteView plaintext, MutableByteView iv,
+                     MutableByteView ciphertext);
+  std::string AES_decrypt(const SecByteBlock &key, const SecByteBlock &iv,
+                          const std::string &ciphertext);
+  size_t AES_decrypt(ByteView key, ByteView iv, ByteView ciphertext,
+                     MutableByteView plaintext);
 
   SecByteBlock HMAC_generate_key(const SecByteBlock &DH_shared_key);
-  std::string HMAC_generate(SecByteBlock key, std::string ciphertext);
-  bool HMAC_verify(SecByteBlock key, std::string ciphertext, std::string hmac);
-  SecByteBlock hash(SecByteBlock msg);
+  std::string HMAC_generate(const SecByteBlock &key,
+                            const std::string &ciphertext);
+  void HMAC_generate(ByteView key, std::initializer_list<ByteView> message,
+                     MutableByteView mac);
+  bool HMAC_verify(const SecByteBlock &key, const std::string &ciphertext,
+                   const std::string &mac);
+  bool HMAC_verify(ByteView key, std::initializer_list<ByteView> message,
+                   ByteView mac);
+
+  CipherSuite::T AEAD_preferred_suite();
+  CipherSuite::T AEAD_negotiate_suite(CipherSuite::T ours,
+                                      CipherSuite::T theirs);
+  SecByteBlock AEAD_generate_key(const SecByteBlock &DH_shared_key,
+                                 CipherSuite::T suite);
+  std::pair<std::string, SecByteBlock>
+  AEAD_encrypt(CipherSuite::T suite, const SecByteBlock &key,
+               const std::string &plaintext,
+               const std::string &associated_data);
+  void AEAD_encrypt(CipherSuite::T suite, ByteView key, ByteView plaintext,
+                    ByteView associated_data, MutableByteView iv,
+                    MutableByteView ciphertext);
+  std::pair<std::string, bool>
+  AEAD_decrypt(CipherSuite::T suite, const SecByteBlock &key,
+               const SecByteBlock &iv, const std::string &ciphertext,
+               const std::string &associated_data);
+  bool AEAD_decrypt(CipherSuite::T suite, ByteView key, ByteView iv,
+                    ByteView ciphertext, ByteView associated_data,
+                    MutableByteView plaintext);
+
+  void CipherContext_derive_keys(ByteView DH_shared_key,
+                                 MutableByteView key_material);
+
+  std::shared_ptr<OnionLayer>
+  OnionLayer_generate(const SecByteBlock &shared_secret);
+
+  SecByteBlock hash(const SecByteBlock &msg);
+  void hash(std::initializer_list<ByteView> msg, MutableByteView digest);
+
+private:
+  CipherSuite::T preferred_suite;
 };
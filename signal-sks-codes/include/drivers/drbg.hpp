@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Buffered SHAKE256 generator with one instance per thread. It is seeded from
+ * the OS once, then serves randombytes() (Kyber keygen and encapsulation) and
+ * message IVs from a buffer, so steady-state calls make no syscalls. After
+ * every refill it re-keys from its own output, so earlier output cannot be
+ * recovered from a captured state. It reseeds from the OS every
+ * RESEED_INTERVAL bytes and in a child process after fork().
+ */
+class DRBG {
+public:
+  static const size_t SEED_SIZE = 32;
+  static const size_t RESEED_INTERVAL = 1 << 20;
+
+  static void generate(uint8_t *out, size_t outlen);
+  static void reseed();
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../../include-shared/messages.hpp"
+
+// Largest frame a connection accepts unless told otherwise. Frame lengths
+// come from the peer, so this bounds what a single frame can make us
+// allocate.
+const size_t MAX_FRAME_SIZE = 1 << 20;
+
+// Smallest limit a connection may be configured with: room for a key
+// exchange, or a message starting a ratchet epoch, at the largest Kyber
+// parameter set.
+const size_t MIN_FRAME_SIZE = 16 << 10;
+
+class FramePool;
+
+/**
+ * One received frame, in a buffer borrowed from a FramePool and handed back
+ * to it when the frame is destroyed, so consumers release a frame just by
+ * dropping it. Move-only. A frame made from a vector belongs to no pool and
+ * simply frees it.
+ */
+class FrameBuffer {
+public:
+  FrameBuffer() = default;
+  explicit FrameBuffer(std::vector<unsigned char> bytes);
+  FrameBuffer(FrameBuffer &&other) noexcept;
+  FrameBuffer &operator=(FrameBuffer &&other) noexcept;
+  FrameBuffer(const FrameBuffer &) = delete;
+  FrameBuffer &operator=(const FrameBuffer &) = delete;
+  ~FrameBuffer();
+
+  unsigned char *data();
+  size_t size() const;
+  MutableByteView view();
+
+private:
+  friend class FramePool;
+  void release();
+
+  std::shared_ptr<FramePool> pool;
+  size_t slab = 0;
+  std::vector<unsigned char> buffer;
+  size_t length = 0;
+};
+
+/**
+ * Recycled receive buffers for one connection, in slab classes whose sizes
+ * double from MIN_SLAB_SIZE up to the maximum frame size. A frame takes a
+ * buffer from the smallest class it fits and gives it back when released, so
+ * a connection in steady state allocates nothing. Each class keeps at most
+ * `spares_per_class` buffers and frames over the maximum are refused, so
+ * memory stays bounded whatever lengths a peer sends. Create it with
+ * std::make_shared; frames keep their pool alive. Thread-safe.
+ */
+class FramePool : public std::enable_shared_from_this<FramePool> {
+public:
+  static const size_t MIN_SLAB_SIZE = 256;
+
+  FramePool(size_t max_frame_size = MAX_FRAME_SIZE,
+            size_t spares_per_class = 4);
+  FrameBuffer take(size_t size);
+  size_t max_frame_size() const;
+  size_t spares();
+
+private:
+  friend class FrameBuffer;
+  size_t slab_of(size_t size) const;
+  void give_back(size_t slab, std::vector<unsigned char> &buffer);
+
+  size_t max_size;
+  size_t spares_per_class;
+
+  std::mutex mtx;
+  std::vector<std::vector<std::vector<unsigned char>>> slabs;
+};
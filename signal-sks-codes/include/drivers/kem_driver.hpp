@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <crypto++/cryptlib.h>
+#include <crypto++/secblock.h>
+
+#include "../../include-shared/messages.hpp"
+
+using namespace CryptoPP;
+
+bool kem_params_valid(int params);
+KEMParams::T kem_params_from_name(const std::string &name);
+KEMParams::T kem_negotiate_params(KEMParams::T ours, KEMParams::T theirs);
+
+/**
+ * Function table for one compiled Kyber implementation of one parameter set.
+ * The ake_ entries are the vendored authenticated key exchange (kex.c). The
+ * _x4 entries run four independent operations at once, one per lane of the
+ * 4-way Keccak; they are null if the backend has no batched path.
+ */
+struct KEMBackend {
+  const char *name;
+  const char *algorithm;
+  size_t public_key_bytes;
+  size_t secret_key_bytes;
+  size_t ciphertext_bytes;
+  size_t shared_secret_bytes;
+  int (*keypair)(uint8_t *pk, uint8_t *sk);
+  int (*enc)(uint8_t *ct, uint8_t *ss, const uint8_t *pk);
+  int (*dec)(uint8_t *ss, const uint8_t *ct, const uint8_t *sk);
+  void (*ake_init_a)(uint8_t *send, uint8_t *tk, uint8_t *sk,
+                     const uint8_t *pkb);
+  void (*ake_shared_b)(uint8_t *send, uint8_t *k, const uint8_t *recv,
+                       const uint8_t *skb, const uint8_t *pka);
+  void (*ake_shared_a)(uint8_t *k, const uint8_t *recv, const uint8_t *tk,
+                       const uint8_t *sk, const uint8_t *ska);
+  int (*keypair_x4)(uint8_t *const pk[4], uint8_t *const sk[4]);
+  int (*enc_x4)(uint8_t *const ct[4], uint8_t *const ss[4],
+                const uint8_t *const pk[4]);
+  int (*dec_x4)(uint8_t *const ss[4], const uint8_t *const ct[4],
+                const uint8_t *const sk[4]);
+};
+
+const KEMBackend &select_kem_backend(KEMParams::T params);
+const KEMBackend &ref_kem_backend(KEMParams::T params);
+
+class KEMDriver {
+public:
+  KEMDriver(KEMParams::T params = KEMParams::KYBER512);
+  std::string backend_name();
+  KEMParams::T params();
+  size_t public_key_size();
+
+  std::pair<SecByteBlock, SecByteBlock> generate_keypair();
+  std::pair<SecByteBlock, SecByteBlock>
+  encapsulate(const SecByteBlock &public_key);
+  SecByteBlock decapsulate(const SecByteBlock &ciphertext,
+                           const SecByteBlock &private_key);
+
+  // Batched forms: four at a time where the backend allows, the rest one by
+  // one. Results are in input order.
+  std::vector<std::pair<SecByteBlock, SecByteBlock>>
+  generate_keypairs(size_t count);
+  std::vector<std::pair<SecByteBlock, SecByteBlock>>
+  encapsulate(const std::vector<SecByteBlock> &public_keys);
+  std::vector<SecByteBlock>
+  decapsulate(const std::vector<SecByteBlock> &ciphertexts,
+              const std::vector<SecByteBlock> &private_keys);
+
+  // Authenticated key exchange between two long-term keypairs in one round
+  // trip: the initiator sends ake_init's message, the responder answers with
+  // ake_respond's, and ake_finish gives the initiator the same key.
+  std::pair<SecByteBlock, SecByteBlock>
+  ake_init(const SecByteBlock &responder_public_key);
+  std::pair<SecByteBlock, SecByteBlock>
+  ake_respond(const SecByteBlock &message,
+              const SecByteBlock &responder_private_key,
+              const SecByteBlock &initiator_public_key);
+  SecByteBlock ake_finish(const SecByteBlock &reply, const SecByteBlock &state,
+                          const SecByteBlock &initiator_private_key);
+
+private:
+  KEMParams::T kem_params;
+  const KEMBackend *backend;
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <crypto++/cryptlib.h>
+#include <crypto++/secblock.h>
+
+using namespace CryptoPP;
+
+// What a stored keypair is for. REVOKED records retire an earlier key. PEER
+// keys are other parties' long-term public keys that we trust; they have no
+// private key. TICKET records hold a session ticket in place of the private
+// key, under a destination address in place of the public key; a newer one
+// for the same address replaces the older.
+namespace KeyKind {
+enum T {
+  LONG_TERM = 1,
+  PREKEY = 2,
+  REVOKED = 3,
+  PEER = 4,
+  TICKET = 5,
+};
+}
+
+/**
+ * Kyber keypairs kept on disk in an append-only binary file and indexed in
+ * memory by key ID, the first KEY_ID_SIZE bytes of SHA-256 of the public key.
+ *
+ * The file is a short header followed by records, each carrying its kind,
+ * key ID, both keys and a CRC-32 of the whole record. Opening the store maps
+ * the file and walks the records once to build the index; nothing is parsed
+ * beyond the record headers, and lookups are a hash probe plus a copy out of
+ * the mapping. A record is written and synced before it enters the index,
+ * so a crash can at worst leave a torn record at the tail, which the next
+ * open detects by its checksum and truncates away. Replaced tickets and
+ * revoked keys leave dead records behind; once those outweigh the live ones
+ * the file is rewritten without them, so it stays proportional to what is
+ * stored rather than to how often it changed.
+ *
+ * One process at a time: an open store holds an exclusive lock on its file.
+ * Thread-safe; lookups run concurrently, additions serialize.
+ */
+class KeyStore {
+public:
+  KeyStore(std::string path);
+  ~KeyStore();
+  KeyStore(const KeyStore &) = delete;
+  KeyStore &operator=(const KeyStore &) = delete;
+
+  static SecByteBlock key_id(const SecByteBlock &public_key);
+
+  SecByteBlock add(const std::pair<SecByteBlock, SecByteBlock> &keypair,
+                   KeyKind::T kind);
+  SecByteBlock long_term_key_id(
+      const std::function<std::pair<SecByteBlock, SecByteBlock>()> &generate);
+  bool revoke(const SecByteBlock &key_id);
+  bool contains(const SecByteBlock &key_id);
+  KeyKind::T kind(const SecByteBlock &key_id);
+  std::pair<SecByteBlock, SecByteBlock> get(const SecByteBlock &key_id);
+  std::vector<SecByteBlock> key_ids(KeyKind::T kind);
+  size_t size();
+
+private:
+  struct Entry {
+    size_t offset;
+    KeyKind::T kind;
+  };
+
+  void load();
+  void map(size_t length);
+  void publish(size_t offset, KeyKind::T kind, uint64_t key);
+  void append(KeyKind::T kind, const SecByteBlock &key_id,
+              const SecByteBlock &public_key, const SecByteBlock &private_key);
+  void compact();
+
+  std::string path;
+  int fd;
+  unsigned char *mapping;
+  size_t mapped_length;
+  size_t file_length;
+  // Bytes taken up by the records in the index; the rest of the file past
+  // the header is superseded or revoked.
+  size_t live_length;
+
+  // Readers take mtx shared. Writers serialize on append_mtx and only take
+  // mtx to remap or publish a record they have already synced.
+  std::mutex append_mtx;
+  std::shared_mutex mtx;
+  std::unordered_map<uint64_t, Entry> index;
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <crypto++/secblock.h>
+
+#include "../../include/drivers/kem_driver.hpp"
+
+using namespace CryptoPP;
+
+// Keypairs generated per batch; one per lane of the 4-way Keccak.
+const size_t KEYPAIR_BATCH_SIZE = 4;
+
+/**
+ * Kyber keypairs generated ahead of time on a background thread, so a ratchet
+ * step only has to pop one. Whenever the pool drops to `watermark` or below,
+ * the worker fills it back up to `depth` in batches of up to
+ * KEYPAIR_BATCH_SIZE that never take it past `depth`. If the pool runs dry,
+ * pop() generates a keypair inline rather than waiting. Thread-safe; one pool
+ * can serve many clients.
+ * Clients that settle on another parameter set draw from a sibling pool for
+ * that set, created the first time it is asked for and shared from then on,
+ * so there is at most one worker per set however many clients there are.
+ * Create pools with std::make_shared.
+ */
+class KeypairPool : public std::enable_shared_from_this<KeypairPool> {
+public:
+  KeypairPool(std::shared_ptr<KEMDriver> kem_driver, size_t depth = 4,
+              size_t watermark = 1);
+  ~KeypairPool();
+  std::pair<SecByteBlock, SecByteBlock> pop();
+  size_t size();
+  KEMParams::T params();
+  std::shared_ptr<KeypairPool> for_params(KEMParams::T params);
+
+private:
+  void refill();
+
+  std::shared_ptr<KEMDriver> kem_driver;
+  size_t depth;
+  size_t watermark;
+
+  // Siblings for other parameter sets belong to the pool they were asked of,
+  // and point back to it.
+  std::mutex siblings_mtx;
+  std::map<KEMParams::T, std::shared_ptr<KeypairPool>> siblings;
+  std::weak_ptr<KeypairPool> origin;
+
+  std::mutex mtx;
+  std::condition_variable wake;
+  std::deque<std::pair<SecByteBlock, SecByteBlock>> keypairs;
+  bool stopping;
+  boost::thread worker;
+};
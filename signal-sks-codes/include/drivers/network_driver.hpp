@@ -6,29 +6,48 @@
 #include <boost/system/error_code.hpp>
 
 #include "../../include-shared/messages.hpp"
+#include "../../include/drivers/frame_pool.hpp"
 
 class NetworkDriver {
 public:
   virtual void listen(int port) = 0;
   virtual void connect(std::string address, int port) = 0;
   virtual void disconnect() = 0;
-  virtual void send(std::vector<unsigned char> data) = 0;
+  virtual void send(const std::vector<unsigned char> &data) = 0;
+  virtual void send(ByteView data) = 0;
+  virtual void send(const std::vector<ByteView> &parts) = 0;
   virtual std::vector<unsigned char> read() = 0;
+  virtual FrameBuffer read_frame();
   virtual std::string get_remote_info() = 0;
+  virtual void set_nodelay(bool nodelay) = 0;
 };
 
 class NetworkDriverImpl : public NetworkDriver {
 public:
-  NetworkDriverImpl();
+  NetworkDriverImpl(bool nodelay = true,
+                    size_t max_frame_size = MAX_FRAME_SIZE);
   void listen(int port);
   void connect(std::string address, int port);
   void disconnect();
-  void send(std::vector<unsigned char> data);
+  void send(const std::vector<unsigned char> &data);
+  void send(ByteView data);
+  void send(const std::vector<ByteView> &parts);
   std::vector<unsigned char> read();
+  FrameBuffer read_frame();
   std::string get_remote_info();
+  void set_nodelay(bool nodelay);
+
+  void send_bytes(ByteView data);
+  void read_bytes(unsigned char *data, size_t size);
 
 private:
+  void apply_socket_options();
+  size_t read_length();
+
   int port;
+  bool nodelay;
+  // Receive buffers, recycled across frames; also caps the frame size.
+  std::shared_ptr<FramePool> frame_pool;
   boost::asio::io_context io_context;
   std::shared_ptr<boost::asio::ip::tcp::socket> socket;
 };
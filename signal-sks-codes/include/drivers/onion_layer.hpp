@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+
+#include <crypto++/cryptlib.h>
+#include <crypto++/modes.h>
+#include <crypto++/rijndael.h>
+#include <crypto++/secblock.h>
+#include <crypto++/sha.h>
+
+using namespace CryptoPP;
+
+// Forward runs from the circuit's origin towards the exit; backward runs
+// from the exit (or any relay) back to the origin.
+namespace OnionDirection {
+enum T {
+  FORWARD = 0,
+  BACKWARD = 1,
+};
+}
+
+/**
+ * Keys shared between the origin of a circuit and one relay on it. Each
+ * direction has an AES-CTR keystream that runs for the life of the circuit
+ * and a running SHA-256 over every cell sealed for that hop, of which 4 bytes
+ * go in the cell. Both ends apply the same keystream, so encrypting and
+ * decrypting a layer are the same operation.
+ * Not thread-safe; callers serialize access per direction.
+ */
+class OnionLayer {
+public:
+  static const size_t KEY_SIZE = 32;
+  static const size_t KEY_MATERIAL_SIZE = 4 * KEY_SIZE;
+
+  OnionLayer(const SecByteBlock &key_material);
+  void crypt(OnionDirection::T direction, unsigned char *payload, size_t size);
+  void seal(OnionDirection::T direction, unsigned char *payload, size_t size);
+  bool open(OnionDirection::T direction, unsigned char *payload, size_t size);
+
+private:
+  CTR_Mode<AES>::Encryption keystream[2];
+  SHA256 digest[2];
+};
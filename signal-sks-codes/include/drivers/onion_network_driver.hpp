@@ -0,0 +1,79 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../../include-shared/messages.hpp"
+#include "../../include/drivers/crypto_driver.hpp"
+#include "../../include/drivers/kem_driver.hpp"
+#include "../../include/drivers/network_driver.hpp"
+#include "../../include/drivers/onion_layer.hpp"
+
+/**
+ * NetworkDriver that reaches its peer through a circuit of onion relays.
+ * connect() builds the circuit one hop at a time, then asks the last relay
+ * to open a stream to the destination. Frames are then length-prefixed as
+ * NetworkDriverImpl would, split across fixed-size RELAY_DATA cells and given
+ * one layer per relay; the exit writes the stream to the destination as is.
+ * Sending only touches the forward keys and reading only the backward keys,
+ * so one thread may send while another reads. Sends block once the circuit's
+ * package window is used up, until read() sees the exit's SENDME, so a
+ * sender needs a reader running alongside it.
+ */
+class OnionNetworkDriver : public NetworkDriver {
+public:
+  OnionNetworkDriver(std::vector<std::pair<std::string, int>> relays,
+                     std::shared_ptr<CryptoDriver> crypto_driver,
+                     std::shared_ptr<KEMDriver> kem_driver,
+                     size_t max_frame_size = MAX_FRAME_SIZE);
+  void listen(int port);
+  void connect(std::string address, int port);
+  void disconnect();
+  void send(const std::vector<unsigned char> &data);
+  void send(ByteView data);
+  void send(const std::vector<ByteView> &parts);
+  std::vector<unsigned char> read();
+  std::string get_remote_info();
+  void set_nodelay(bool nodelay);
+
+private:
+  void extend(const std::string &address, int port);
+  void wrap(size_t hop, unsigned char *cell);
+  void send_relay(size_t hop, RelayCommand::T command,
+                  const unsigned char *data, size_t size);
+  void send_stream(const std::vector<ByteView> &parts);
+  size_t take_window(size_t wanted);
+  void close_window();
+  Relay_View read_relay(size_t *hop);
+
+  std::vector<std::pair<std::string, int>> relays;
+  std::shared_ptr<CryptoDriver> crypto_driver;
+  std::shared_ptr<KEMDriver> kem_driver;
+  std::shared_ptr<NetworkDriverImpl> guard;
+  size_t max_frame_size;
+
+  uint32_t circuit_id;
+  std::vector<std::shared_ptr<OnionLayer>> layers;
+  std::string remote_info;
+
+  // Guards the forward keys and the link, which read() also uses to answer
+  // with SENDMEs. The buffers belong to the sending thread.
+  std::mutex send_mtx;
+  std::vector<unsigned char> send_stream_buffer;
+  std::vector<unsigned char> send_cells;
+
+  // Flow control, counted in RELAY_DATA cells.
+  std::mutex window_mtx;
+  std::condition_variable window_cv;
+  int package_window;
+  bool window_closed;
+
+  // Owned by the reading thread.
+  int deliver_window;
+  std::vector<unsigned char> read_cell;
+  std::vector<unsigned char> read_stream_buffer;
+};
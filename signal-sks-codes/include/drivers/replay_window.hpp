@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <crypto++/secblock.h>
+
+using namespace CryptoPP;
+
+/**
+ * Which of the latest SIZE positions of a chain have been received, as a
+ * bitmap that slides forward with the highest one. A position is fresh if it
+ * is ahead of everything seen, or inside the window and not seen yet;
+ * anything older than the window is refused. Fixed size; copying it is a
+ * memcpy, so it can live in an immutable chain snapshot.
+ */
+class ReplayWindow {
+public:
+  static const uint32_t SIZE = 1024;
+
+  bool fresh(uint32_t counter) const;
+  void mark(uint32_t counter);
+
+private:
+  static const uint32_t WORD_BITS = 64;
+
+  // One past the highest position marked.
+  uint64_t next = 0;
+  uint64_t bits[SIZE / WORD_BITS] = {};
+};
+
+/**
+ * Keys of messages a chain stepped past before they arrived, so a message
+ * delivered late or out of order decrypts with one lookup instead of
+ * re-deriving its chain. Holds at most `capacity` keys in one buffer
+ * allocated on first use, and once full drops the oldest to make room;
+ * memory stays bounded however long the session runs. Keys are wiped when
+ * taken, evicted or dropped. Not thread-safe; the receive path owns it.
+ */
+class SkippedKeys {
+public:
+  static const size_t KEY_SIZE = 32;
+
+  SkippedKeys(size_t capacity = 1024);
+  void put(uint32_t epoch, uint32_t counter, const SecByteBlock &key);
+  bool find(uint32_t epoch, uint32_t counter, SecByteBlock &key);
+  void erase(uint32_t epoch, uint32_t counter);
+  void drop_epochs_before(uint32_t epoch);
+  void clear();
+  size_t size();
+
+private:
+  static uint64_t slot_key(uint32_t epoch, uint32_t counter);
+  void clear_slot(size_t slot);
+
+  size_t capacity;
+  // Ring of slots, oldest overwritten first, and the index into it.
+  SecByteBlock keys;
+  std::vector<uint64_t> ids;
+  std::vector<bool> live;
+  size_t oldest;
+  std::unordered_map<uint64_t, size_t> index;
+};
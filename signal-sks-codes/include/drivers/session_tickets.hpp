@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include <crypto++/secblock.h>
+
+#include "../../include-shared/messages.hpp"
+#include "../../include/drivers/crypto_driver.hpp"
+
+using namespace CryptoPP;
+
+// How long a ticket can be redeemed for after it is issued.
+const uint32_t TICKET_LIFETIME = 7 * 24 * 60 * 60;
+
+/**
+ * Issues and redeems session resumption tickets on the server side. A ticket
+ * is the session's SessionTicket state, stamped with its issue time and
+ * sealed with ChaCha20-Poly1305 under a key only the server holds, so the
+ * server keeps no per-session state: whoever presents a ticket it can open
+ * gets the state back. Thread-safe; one instance serves every session.
+ */
+class SessionTickets {
+public:
+  SessionTickets(std::shared_ptr<CryptoDriver> crypto_driver,
+                 const SecByteBlock &key = SecByteBlock(),
+                 uint32_t lifetime = TICKET_LIFETIME);
+  SecByteBlock issue(const SessionTicket &state);
+  bool redeem(const SecByteBlock &ticket, SessionTicket &state);
+
+private:
+  std::shared_ptr<CryptoDriver> crypto_driver;
+  SecByteBlock key;
+  uint32_t lifetime;
+};
@@ -1,53 +1,225 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <iostream>
-#include <mutex>
+#include <memory>
+#include <utility>
 
 #include <boost/chrono.hpp>
 #include <boost/thread.hpp>
 #include <crypto++/cryptlib.h>
-#include <crypto++/dh.h>
-#include <crypto++/dh2.h>
 #include <crypto++/integer.h>
-#include <crypto++/nbtheory.h>
 #include <crypto++/osrng.h>
 
 #include "../../include-shared/messages.hpp"
 #include "../../include/drivers/cli_driver.hpp"
 #include "../../include/drivers/crypto_driver.hpp"
+#include "../../include/drivers/kem_driver.hpp"
+#include "../../include/drivers/key_store.hpp"
+#include "../../include/drivers/keypair_pool.hpp"
 #include "../../include/drivers/network_driver.hpp"
+#include "../../include/drivers/replay_window.hpp"
+#include "../../include/drivers/session_tickets.hpp"
 
-extern "C" {
-#include "../../kyber/ref/api.h"
-#include "../../kyber/ref/rng.h"
-}
+// Furthest a received message may skip ahead in its chain, and the most keys
+// of skipped messages a session holds on to.
+const uint32_t MAX_CHAIN_SKIP = 1024;
+const size_t MAX_SKIPPED_KEYS = 1024;
+
+// Most bytes of messages held until the first message of their epoch, which
+// carries its KEM ciphertext, arrives; at most MAX_SKIPPED_KEYS of them.
+const size_t MAX_EARLY_BYTES = 1 << 22;
+
+/**
+ * A shared_ptr that one thread can publish while others load it. Goes
+ * through the free std::atomic_load/std::atomic_store overloads, which C++20
+ * deprecates in favor of std::atomic<std::shared_ptr<T>>; moving over means
+ * changing `ptr` to that type and load()/store() to its members, here only.
+ */
+template <typename T> class AtomicSharedPtr {
+public:
+  std::shared_ptr<T> load() const { return std::atomic_load(&this->ptr); }
+  void store(std::shared_ptr<T> value) {
+    std::atomic_store(&this->ptr, std::move(value));
+  }
+
+private:
+  std::shared_ptr<T> ptr;
+};
+
+/**
+ * One direction of one ratchet epoch: a symmetric chain that steps once per
+ * message, so every message has its own key. Never modified after it is
+ * published; each step publishes a new one, so a chain can be handed between
+ * threads by swapping a shared_ptr.
+ */
+struct RatchetChain {
+  uint32_t epoch;
+  SecByteBlock key_id;
+  // Position of the next message, and the chain key it is keyed from.
+  uint32_t counter;
+  SecByteBlock chain_key;
+  std::chrono::steady_clock::time_point started;
+  // Receiving chains only: the positions already received.
+  ReplayWindow window;
+};
+
+/**
+ * When to run the asymmetric KEM step. Every message steps the symmetric
+ * chain; a new epoch is started, once the other party has announced a new
+ * public value, only after this many messages went out in the current one or
+ * once it is this many seconds old. Zero disables a trigger; messages = 1
+ * runs a KEM step on every turn of the conversation.
+ */
+struct RatchetPolicy {
+  uint32_t messages = 64;
+  uint32_t seconds = 60;
+};
+
+/**
+ * Our Kyber keypairs that the other party may still encapsulate to: the one
+ * we announced last, and the one before it in case a message crossed ours
+ * on the wire. Our first keypair is in our preferred parameter set and the
+ * rest in the negotiated one, so each keeps its set.
+ */
+struct OwnKeys {
+  std::pair<SecByteBlock, SecByteBlock> current;
+  KEMParams::T current_params;
+  std::pair<SecByteBlock, SecByteBlock> previous;
+  KEMParams::T previous_params;
+};
+
+/**
+ * The other party's latest public value and the parameter set it is in.
+ */
+struct PeerKey {
+  SecByteBlock public_value;
+  KEMParams::T params;
+};
 
 class Client {
 public:
   Client(std::shared_ptr<NetworkDriver> network_driver,
-         std::shared_ptr<CryptoDriver> crypto_driver);
+         std::shared_ptr<CryptoDriver> crypto_driver,
+         std::shared_ptr<KeypairPool> keypair_pool = nullptr,
+         std::shared_ptr<KeyStore> key_store = nullptr,
+         SecByteBlock peer_key_id = SecByteBlock(),
+         std::shared_ptr<SessionTickets> tickets = nullptr);
   void prepare_keys();
   Message_Message send(std::string plaintext);
+  void send(ByteView plaintext, std::vector<unsigned char> &frame);
   std::pair<std::string, bool> receive(Message_Message ciphertext);
+  std::pair<ByteView, bool> receive(MutableByteView frame,
+                                    bool *held = nullptr);
+  std::vector<std::string> take_released();
   void run(std::string command);
   void HandleKeyExchange(std::string command);
+  std::vector<unsigned char> start_key_exchange();
+  std::vector<unsigned char>
+  finish_key_exchange(std::vector<unsigned char> &other_public_value);
+  bool handshake_complete();
+  void set_ratchet_policy(RatchetPolicy policy);
+  void resume_from(const std::string &destination);
+  std::shared_ptr<const SessionTicket> session_ticket();
+  std::shared_ptr<RatchetChain> advance_chain(
+      const RatchetChain &chain, uint32_t counter, SecByteBlock &message_key,
+      std::vector<std::pair<uint32_t, SecByteBlock>> *skipped = nullptr);
 
 private:
   void ReceiveThread();
   void SendThread();
-
-  std::mutex mtx;
+  PublicValue_Message public_value_message();
+  void begin_full_exchange();
+  std::vector<unsigned char> finish_resume(std::vector<unsigned char> &data);
+  void start_resumed(const SessionTicket &state,
+                     const SecByteBlock &client_nonce,
+                     const SecByteBlock &server_nonce);
+  void use_kem_params(KEMParams::T params);
+  void keep_ticket(const SessionTicket &state);
+  std::shared_ptr<RatchetChain>
+  start_chain(uint32_t epoch, const SecByteBlock &key_id,
+              const SecByteBlock &shared_secret);
+  SecByteBlock next_message(Message_Message &message,
+                            SecByteBlock &message_key);
+  std::pair<ByteView, bool> receive_in_place(const Message_View &msg,
+                                             MutableByteView ciphertext,
+                                             bool *held = nullptr);
+  bool hold_early(const Message_View &msg);
+  void release_early(uint32_t epoch);
+  void encrypt_message(const SecByteBlock &message_key, ByteView plaintext,
+                       const SecByteBlock &header,
+                       const Message_Frame &sealed);
+  std::pair<ByteView, bool> decrypt_message(const SecByteBlock &message_key,
+                                            const Message_View &msg,
+                                            MutableByteView ciphertext,
+                                            const SecByteBlock &header);
+  std::pair<ByteView, bool> open_message(const RatchetChain &chain,
+                                         const Message_View &msg,
+                                         MutableByteView ciphertext,
+                                         const SecByteBlock &header,
+                                         std::shared_ptr<RatchetChain> &next);
+  bool kem_step_due(const std::shared_ptr<const RatchetChain> &chain);
+  SecByteBlock chain_key_id(ByteView recipient_public_value,
+                            ByteView sender_public_value, ByteView ct);
 
   std::shared_ptr<CLIDriver> cli_driver;
   std::shared_ptr<CryptoDriver> crypto_driver;
+  std::shared_ptr<KEMDriver> kem_driver;
+  std::shared_ptr<KeypairPool> keypair_pool;
   std::shared_ptr<NetworkDriver> network_driver;
 
-  SecByteBlock AES_key;
-  SecByteBlock HMAC_key;
+  CipherSuite::T cipher_suite;
+  KEMParams::T kem_params;
+  // X25519 half of the hybrid key exchange. The private value is wiped once
+  // the shared key is agreed. The handshake key is the X25519 key, mixed with
+  // the authenticated key exchange's key if there was one, and goes into
+  // every chain.
+  SecByteBlock dh_public_value;
+  SecByteBlock dh_private_value;
+  SecByteBlock handshake_key;
+
+  // Authenticated handshake: our long-term key ID, the peer's, and the
+  // initiator's state between its two steps.
+  std::shared_ptr<KeyStore> key_store;
+  SecByteBlock identity;
+  SecByteBlock peer_key_id;
+  SecByteBlock ake_state;
+  // The responder waits for the other party's first message; it is the
+  // listening side whenever it authenticates peers or issues tickets.
+  bool responder;
+  bool exchanged;
+
+  // Session resumption: the server's ticket sealer, and the client's ticket,
+  // first the one it resumes from and then the one it was issued, kept in the
+  // key store under the destination's address.
+  std::shared_ptr<SessionTickets> tickets;
+  std::shared_ptr<const SessionTicket> ticket;
+  SecByteBlock ticket_destination;
+  SecByteBlock resume_nonce;
+  std::shared_ptr<RandomNumberGenerator> rng;
 
-  // Key Exchange Ratchet Fields
-  bool switched;
-  SecByteBlock current_private_value;
-  SecByteBlock current_public_value;
-  SecByteBlock last_other_public_value;
+  // Key Exchange Ratchet Fields. The sending chain belongs to the send path
+  // and the receiving chains to the receive path; the two only exchange public
+  // values and keypairs, always through atomic shared_ptr swaps, so neither
+  // path ever waits for the other. The previous receiving chain stays open
+  // for messages sent before the other party's latest KEM step, and the keys
+  // of messages either chain stepped past wait in skipped_keys.
+  AtomicSharedPtr<const RatchetChain> sending_chain;
+  AtomicSharedPtr<const RatchetChain> receiving_chain;
+  AtomicSharedPtr<const RatchetChain> previous_receiving_chain;
+  SkippedKeys skipped_keys;
+  // Receive path only: messages of the next epoch that overtook its first
+  // message, and the plaintexts of those opened since take_released.
+  std::deque<Message_Message> early_messages;
+  size_t early_bytes;
+  std::vector<std::string> released;
+  AtomicSharedPtr<const OwnKeys> own_keys;
+  AtomicSharedPtr<const PeerKey> other_public_value;
+  std::atomic<bool> switched;
+  RatchetPolicy ratchet_policy;
+  // After a resumption, our next message announces our public value so the
+  // other party can restart the KEM ratchet.
+  std::atomic<bool> announce;
 };
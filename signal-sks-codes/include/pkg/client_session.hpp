@@ -0,0 +1,62 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../../include/drivers/async_network_driver.hpp"
+#include "../../include/drivers/cli_driver.hpp"
+#include "../../include/drivers/crypto_driver.hpp"
+#include "../../include/drivers/key_store.hpp"
+#include "../../include/drivers/keypair_pool.hpp"
+#include "../../include/drivers/session_tickets.hpp"
+#include "../../include/pkg/client.hpp"
+
+/**
+ * Runs the Client protocol for one connection of an AsyncNetworkDriver, so a
+ * single process can hold many conversations at once. Each session owns its
+ * own Client and therefore its own ratchet state. Messages to the peer are
+ * sealed by the session's Client and queued on the connection. Whatever goes
+ * wrong on one session closes that session only.
+ */
+class ClientSession : public SessionHandler {
+public:
+  ClientSession(std::shared_ptr<CryptoDriver> crypto_driver,
+                std::shared_ptr<CLIDriver> cli_driver,
+                std::shared_ptr<KeypairPool> keypair_pool,
+                std::shared_ptr<KeyStore> key_store = nullptr,
+                std::shared_ptr<SessionTickets> tickets = nullptr,
+                RatchetPolicy ratchet_policy = RatchetPolicy());
+  void on_open(std::shared_ptr<AsyncConnection> conn) override;
+  void on_frame(std::shared_ptr<AsyncConnection> conn,
+                std::vector<unsigned char> &data) override;
+  void on_close(std::shared_ptr<AsyncConnection> conn) override;
+  bool send(ByteView plaintext);
+
+private:
+  void fail(std::shared_ptr<AsyncConnection> conn, const std::string &reason);
+
+  std::shared_ptr<Client> client;
+  std::shared_ptr<CLIDriver> cli_driver;
+
+  // The send path: the connection once open, and a lock that keeps sends
+  // from other threads off the key exchange, which runs on the connection's.
+  std::mutex send_mtx;
+  std::weak_ptr<AsyncConnection> conn;
+  bool closed = false;
+};
+
+/**
+ * The sessions a server has open, so it can write to them from outside their
+ * connections' threads. Thread-safe.
+ */
+class SessionRegistry {
+public:
+  void add(std::shared_ptr<ClientSession> session);
+  size_t broadcast(ByteView plaintext);
+
+private:
+  std::mutex mtx;
+  std::vector<std::weak_ptr<ClientSession>> sessions;
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../../include-shared/messages.hpp"
+#include "../../include/drivers/async_network_driver.hpp"
+#include "../../include/drivers/cli_driver.hpp"
+#include "../../include/drivers/crypto_driver.hpp"
+#include "../../include/drivers/kem_driver.hpp"
+#include "../../include/drivers/key_store.hpp"
+#include "../../include/drivers/onion_layer.hpp"
+
+class Relay;
+class RelayLink;
+
+using LinkHandler = std::function<void(std::shared_ptr<AsyncConnection>,
+                                       std::shared_ptr<RelayLink>)>;
+
+/**
+ * One circuit through this relay. The previous hop is the link the CREATE
+ * arrived on; the next hop is either another relay (after EXTEND) or, at the
+ * exit, a plain connection to the destination (after BEGIN). The mutex keeps
+ * each direction's keystream in step with the order cells leave in.
+ */
+struct Circuit {
+  std::mutex mtx;
+  std::shared_ptr<OnionLayer> layer;
+  bool destroyed = false;
+
+  std::weak_ptr<RelayLink> prev_link;
+  std::shared_ptr<AsyncConnection> prev;
+  uint32_t prev_id = 0;
+
+  std::weak_ptr<RelayLink> next_link;
+  std::shared_ptr<AsyncConnection> next;
+  uint32_t next_id = 0;
+
+  // Set while EXTEND or BEGIN waits for its connection. Cells for the next
+  // hop that arrive meanwhile are peeled and held in next_pending.
+  bool dialing = false;
+  std::vector<unsigned char> next_pending;
+
+  // At the exit: the stream to the destination and its flow control. The
+  // package window counts RELAY_DATA cells we may still send back; bytes
+  // from the destination wait in exit_pending, with reads paused, while it
+  // is empty. The deliver window counts cells until we owe a SENDME, which
+  // is held back while the destination is slow to take what it was sent.
+  std::shared_ptr<AsyncConnection> exit;
+  int package_window = CIRCUIT_WINDOW_START;
+  int deliver_window = CIRCUIT_WINDOW_START;
+  std::vector<unsigned char> exit_pending;
+  std::vector<unsigned char> exit_cells;
+};
+
+/**
+ * Cells being forwarded out of one read batch. Consecutive cells for the same
+ * circuit that sit next to each other in the read buffer go out in a single
+ * send_cells call, queued under the circuit's ID on the outgoing link.
+ */
+struct CellRun {
+  std::shared_ptr<AsyncConnection> conn;
+  uint32_t circuit_id = 0;
+  unsigned char *start = nullptr;
+  size_t count = 0;
+
+  void add(std::shared_ptr<AsyncConnection> conn, uint32_t circuit_id,
+           unsigned char *cell);
+  void flush();
+};
+
+/**
+ * Handles the cells on one connection between relays, or between a client
+ * and its first relay. Any number of circuits share the link; they are
+ * looked up by the ID they carry on it, and the same circuit has a different
+ * ID on its other link. Each circuit gets its own write queue on the
+ * connection, so circuits take turns on the wire.
+ */
+class RelayLink : public SessionHandler,
+                  public std::enable_shared_from_this<RelayLink> {
+public:
+  RelayLink(Relay *relay, std::string pool_key = "");
+  size_t cell_size() override;
+  void on_cells(std::shared_ptr<AsyncConnection> conn, unsigned char *cells,
+                size_t count) override;
+  void on_close(std::shared_ptr<AsyncConnection> conn) override;
+  size_t queue_limit() override;
+  void on_overflow(std::shared_ptr<AsyncConnection> conn,
+                   uint32_t circuit_id) override;
+
+  uint32_t add_outbound(std::shared_ptr<Circuit> circuit);
+  void remove(uint32_t circuit_id);
+
+private:
+  void handle_cell(std::shared_ptr<AsyncConnection> conn, unsigned char *data,
+                   CellRun &run, std::vector<Cell_View> &creates);
+  void handle_creates(std::shared_ptr<AsyncConnection> conn,
+                      std::vector<Cell_View> &creates);
+  void handle_forward(std::shared_ptr<Circuit> circuit, unsigned char *data,
+                      Cell_View &cell, CellRun &run);
+  void handle_backward(std::shared_ptr<Circuit> circuit, unsigned char *data,
+                       Cell_View &cell, CellRun &run);
+  void handle_created(std::shared_ptr<Circuit> circuit, Cell_View &cell);
+  void handle_command(std::shared_ptr<Circuit> circuit, Relay_View &msg);
+  void reject(std::shared_ptr<AsyncConnection> conn, uint32_t circuit_id,
+              const std::string &reason);
+
+  Relay *relay;
+  std::string pool_key;
+
+  // Circuit ID on this link -> circuit, and whether this link is the
+  // circuit's previous hop (true) or its next hop (false).
+  std::mutex mtx;
+  std::map<uint32_t, std::pair<std::shared_ptr<Circuit>, bool>> circuits;
+  std::atomic<uint32_t> next_circuit_id;
+};
+
+/**
+ * The exit's connection to a circuit's destination, carried as a plain byte
+ * stream: RELAY_DATA bytes are written to it as they arrive, and whatever the
+ * destination sends goes back down the circuit as RELAY_DATA.
+ */
+class ExitStream : public SessionHandler {
+public:
+  ExitStream(Relay *relay, std::weak_ptr<Circuit> circuit);
+  size_t cell_size() override;
+  void on_cells(std::shared_ptr<AsyncConnection> conn, unsigned char *bytes,
+                size_t count) override;
+  void on_close(std::shared_ptr<AsyncConnection> conn) override;
+  size_t queue_limit() override;
+  void on_overflow(std::shared_ptr<AsyncConnection> conn,
+                   uint32_t queue) override;
+  void on_written(std::shared_ptr<AsyncConnection> conn) override;
+
+private:
+  Relay *relay;
+  std::weak_ptr<Circuit> circuit;
+};
+
+/**
+ * Onion relay. Accepts circuits from clients and other relays, peels one
+ * layer off every forward cell, adds one to every backward cell, and either
+ * forwards the cell or acts on it when it is addressed to this hop.
+ * Connections to other relays are pooled so circuits to the same next hop
+ * share one link. Given a key store, the relay keeps its long-term identity
+ * keypair there, generating it on first start.
+ */
+class Relay {
+public:
+  Relay(int num_threads = 0, std::shared_ptr<KeyStore> key_store = nullptr);
+  SecByteBlock identity_key_id();
+  void listen(int port);
+  void run();
+  void stop();
+
+  void send_backward(std::shared_ptr<Circuit> circuit, RelayCommand::T command,
+                     const unsigned char *data = nullptr, size_t size = 0);
+  void destroy(std::shared_ptr<Circuit> circuit);
+
+private:
+  friend class RelayLink;
+  friend class ExitStream;
+
+  void link_to(std::string address, int port, LinkHandler on_link);
+  void drop_link(const std::string &pool_key, RelayLink *link);
+
+  AsyncNetworkDriver network_driver;
+  std::shared_ptr<CryptoDriver> crypto_driver;
+  std::shared_ptr<KEMDriver> kem_driver;
+  std::shared_ptr<CLIDriver> cli_driver;
+  std::shared_ptr<KeyStore> key_store;
+  SecByteBlock identity;
+
+  std::mutex links_mtx;
+  std::map<std::string, std::pair<std::shared_ptr<AsyncConnection>,
+                                  std::shared_ptr<RelayLink>>>
+      links;
+  // Links being dialed, and who is waiting for each.
+  std::map<std::string, std::vector<LinkHandler>> dialing;
+};
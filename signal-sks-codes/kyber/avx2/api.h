@@ -16,6 +16,12 @@
 int pqcrystals_kyber512_avx2_keypair(uint8_t *pk, uint8_t *sk);
 int pqcrystals_kyber512_avx2_enc(uint8_t *ct, uint8_t *ss, const uint8_t *pk);
 int pqcrystals_kyber512_avx2_dec(uint8_t *ss, const uint8_t *ct, const uint8_t *sk);
+void pqcrystals_kyber512_avx2_kex_ake_initA(uint8_t *send, uint8_t *tk, uint8_t *sk, const uint8_t *pkb);
+void pqcrystals_kyber512_avx2_kex_ake_sharedB(uint8_t *send, uint8_t *k, const uint8_t *recv, const uint8_t *skb, const uint8_t *pka);
+void pqcrystals_kyber512_avx2_kex_ake_sharedA(uint8_t *k, const uint8_t *recv, const uint8_t *tk, const uint8_t *sk, const uint8_t *ska);
+int pqcrystals_kyber512_avx2_keypair_x4(uint8_t *const pk[4], uint8_t *const sk[4]);
+int pqcrystals_kyber512_avx2_enc_x4(uint8_t *const ct[4], uint8_t *const ss[4], const uint8_t *const pk[4]);
+int pqcrystals_kyber512_avx2_dec_x4(uint8_t *const ss[4], const uint8_t *const ct[4], const uint8_t *const sk[4]);
 
 #define pqcrystals_kyber512_90s_avx2_SECRETKEYBYTES pqcrystals_kyber512_SECRETKEYBYTES
 #define pqcrystals_kyber512_90s_avx2_PUBLICKEYBYTES pqcrystals_kyber512_PUBLICKEYBYTES
@@ -25,6 +31,9 @@ int pqcrystals_kyber512_avx2_dec(uint8_t *ss, const uint8_t *ct, const uint8_t *
 int pqcrystals_kyber512_90s_avx2_keypair(uint8_t *pk, uint8_t *sk);
 int pqcrystals_kyber512_90s_avx2_enc(uint8_t *ct, uint8_t *ss, const uint8_t *pk);
 int pqcrystals_kyber512_90s_avx2_dec(uint8_t *ss, const uint8_t *ct, const uint8_t *sk);
+void pqcrystals_kyber512_90s_avx2_kex_ake_initA(uint8_t *send, uint8_t *tk, uint8_t *sk, const uint8_t *pkb);
+void pqcrystals_kyber512_90s_avx2_kex_ake_sharedB(uint8_t *send, uint8_t *k, const uint8_t *recv, const uint8_t *skb, const uint8_t *pka);
+void pqcrystals_kyber512_90s_avx2_kex_ake_sharedA(uint8_t *k, const uint8_t *recv, const uint8_t *tk, const uint8_t *sk, const uint8_t *ska);
 
 #define pqcrystals_kyber768_SECRETKEYBYTES 2400
 #define pqcrystals_kyber768_PUBLICKEYBYTES 1184
@@ -39,6 +48,12 @@ int pqcrystals_kyber512_90s_avx2_dec(uint8_t *ss, const uint8_t *ct, const uint8
 int pqcrystals_kyber768_avx2_keypair(uint8_t *pk, uint8_t *sk);
 int pqcrystals_kyber768_avx2_enc(uint8_t *ct, uint8_t *ss, const uint8_t *pk);
 int pqcrystals_kyber768_avx2_dec(uint8_t *ss, const uint8_t *ct, const uint8_t *sk);
+void pqcrystals_kyber768_avx2_kex_ake_initA(uint8_t *send, uint8_t *tk, uint8_t *sk, const uint8_t *pkb);
+void pqcrystals_kyber768_avx2_kex_ake_sharedB(uint8_t *send, uint8_t *k, const uint8_t *recv, const uint8_t *skb, const uint8_t *pka);
+void pqcrystals_kyber768_avx2_kex_ake_sharedA(uint8_t *k, const uint8_t *recv, const uint8_t *tk, const uint8_t *sk, const uint8_t *ska);
+int pqcrystals_kyber768_avx2_keypair_x4(uint8_t *const pk[4], uint8_t *const sk[4]);
+int pqcrystals_kyber768_avx2_enc_x4(uint8_t *const ct[4], uint8_t *const ss[4], const uint8_t *const pk[4]);
+int pqcrystals_kyber768_avx2_dec_x4(uint8_t *const ss[4], const uint8_t *const ct[4], const uint8_t *const sk[4]);
 
 #define pqcrystals_kyber768_90s_avx2_SECRETKEYBYTES pqcrystals_kyber768_SECRETKEYBYTES
 #define pqcrystals_kyber768_90s_avx2_PUBLICKEYBYTES pqcrystals_kyber768_PUBLICKEYBYTES
@@ -48,6 +63,9 @@ int pqcrystals_kyber768_avx2_dec(uint8_t *ss, const uint8_t *ct, const uint8_t *
 int pqcrystals_kyber768_90s_avx2_keypair(uint8_t *pk, uint8_t *sk);
 int pqcrystals_kyber768_90s_avx2_enc(uint8_t *ct, uint8_t *ss, const uint8_t *pk);
 int pqcrystals_kyber768_90s_avx2_dec(uint8_t *ss, const uint8_t *ct, const uint8_t *sk);
+void pqcrystals_kyber768_90s_avx2_kex_ake_initA(uint8_t *send, uint8_t *tk, uint8_t *sk, const uint8_t *pkb);
+void pqcrystals_kyber768_90s_avx2_kex_ake_sharedB(uint8_t *send, uint8_t *k, const uint8_t *recv, const uint8_t *skb, const uint8_t *pka);
+void pqcrystals_kyber768_90s_avx2_kex_ake_sharedA(uint8_t *k, const uint8_t *recv, const uint8_t *tk, const uint8_t *sk, const uint8_t *ska);
 
 #define pqcrystals_kyber1024_SECRETKEYBYTES 3168
 #define pqcrystals_kyber1024_PUBLICKEYBYTES 1568
@@ -62,6 +80,12 @@ int pqcrystals_kyber768_90s_avx2_dec(uint8_t *ss, const uint8_t *ct, const uint8
 int pqcrystals_kyber1024_avx2_keypair(uint8_t *pk, uint8_t *sk);
 int pqcrystals_kyber1024_avx2_enc(uint8_t *ct, uint8_t *ss, const uint8_t *pk);
 int pqcrystals_kyber1024_avx2_dec(uint8_t *ss, const uint8_t *ct, const uint8_t *sk);
+void pqcrystals_kyber1024_avx2_kex_ake_initA(uint8_t *send, uint8_t *tk, uint8_t *sk, const uint8_t *pkb);
+void pqcrystals_kyber1024_avx2_kex_ake_sharedB(uint8_t *send, uint8_t *k, const uint8_t *recv, const uint8_t *skb, const uint8_t *pka);
+void pqcrystals_kyber1024_avx2_kex_ake_sharedA(uint8_t *k, const uint8_t *recv, const uint8_t *tk, const uint8_t *sk, const uint8_t *ska);
+int pqcrystals_kyber1024_avx2_keypair_x4(uint8_t *const pk[4], uint8_t *const sk[4]);
+int pqcrystals_kyber1024_avx2_enc_x4(uint8_t *const ct[4], uint8_t *const ss[4], const uint8_t *const pk[4]);
+int pqcrystals_kyber1024_avx2_dec_x4(uint8_t *const ss[4], const uint8_t *const ct[4], const uint8_t *const sk[4]);
 
 #define pqcrystals_kyber1024_90s_avx2_SECRETKEYBYTES pqcrystals_kyber1024_SECRETKEYBYTES
 #define pqcrystals_kyber1024_90s_avx2_PUBLICKEYBYTES pqcrystals_kyber1024_PUBLICKEYBYTES
@@ -71,5 +95,8 @@ int pqcrystals_kyber1024_avx2_dec(uint8_t *ss, const uint8_t *ct, const uint8_t
 int pqcrystals_kyber1024_90s_avx2_keypair(uint8_t *pk, uint8_t *sk);
 int pqcrystals_kyber1024_90s_avx2_enc(uint8_t *ct, uint8_t *ss, const uint8_t *pk);
 int pqcrystals_kyber1024_90s_avx2_dec(uint8_t *ss, const uint8_t *ct, const uint8_t *sk);
+void pqcrystals_kyber1024_90s_avx2_kex_ake_initA(uint8_t *send, uint8_t *tk, uint8_t *sk, const uint8_t *pkb);
+void pqcrystals_kyber1024_90s_avx2_kex_ake_sharedB(uint8_t *send, uint8_t *k, const uint8_t *recv, const uint8_t *skb, const uint8_t *pka);
+void pqcrystals_kyber1024_90s_avx2_kex_ake_sharedA(uint8_t *k, const uint8_t *recv, const uint8_t *tk, const uint8_t *sk, const uint8_t *ska);
 
 #endif
@@ -198,3 +198,45 @@ void shake256x4(uint8_t *out0,
     }
   }
 }
+
+void sha3_256x4(uint8_t h0[32],
+                uint8_t h1[32],
+                uint8_t h2[32],
+                uint8_t h3[32],
+                const uint8_t *in0,
+                const uint8_t *in1,
+                const uint8_t *in2,
+                const uint8_t *in3,
+                size_t inlen)
+{
+  uint8_t t[4][SHA3_256_RATE];
+  __m256i s[25];
+
+  keccakx4_absorb_once(s, SHA3_256_RATE, in0, in1, in2, in3, inlen, 0x06);
+  keccakx4_squeezeblocks(t[0], t[1], t[2], t[3], 1, SHA3_256_RATE, s);
+  memcpy(h0, t[0], 32);
+  memcpy(h1, t[1], 32);
+  memcpy(h2, t[2], 32);
+  memcpy(h3, t[3], 32);
+}
+
+void sha3_512x4(uint8_t h0[64],
+                uint8_t h1[64],
+                uint8_t h2[64],
+                uint8_t h3[64],
+                const uint8_t *in0,
+                const uint8_t *in1,
+                const uint8_t *in2,
+                const uint8_t *in3,
+                size_t inlen)
+{
+  uint8_t t[4][SHA3_512_RATE];
+  __m256i s[25];
+
+  keccakx4_absorb_once(s, SHA3_512_RATE, in0, in1, in2, in3, inlen, 0x06);
+  keccakx4_squeezeblocks(t[0], t[1], t[2], t[3], 1, SHA3_512_RATE, s);
+  memcpy(h0, t[0], 64);
+  memcpy(h1, t[1], 64);
+  memcpy(h2, t[2], 64);
+  memcpy(h3, t[3], 64);
+}
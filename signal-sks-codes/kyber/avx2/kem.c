@@ -122,3 +122,136 @@ int crypto_kem_dec(uint8_t *ss,
   kdf(ss, kr, 2*KYBER_SYMBYTES);
   return 0;
 }
+
+#ifndef KYBER_90S
+/*************************************************
+* Name:        crypto_kem_keypair_x4
+*
+* Description: Generates four independent keypairs, as crypto_kem_keypair.
+*              The hash of each public key runs on one lane of the 4-way
+*              Keccak.
+*
+* Arguments:   - uint8_t *const pk[4]: pointers to output public keys
+*              - uint8_t *const sk[4]: pointers to output private keys
+*
+* Returns 0 (success)
+**************************************************/
+int crypto_kem_keypair_x4(uint8_t *const pk[4],
+                          uint8_t *const sk[4])
+{
+  unsigned int i;
+
+  for(i=0;i<4;i++) {
+    indcpa_keypair(pk[i], sk[i]);
+    memcpy(sk[i]+KYBER_INDCPA_SECRETKEYBYTES, pk[i], KYBER_INDCPA_PUBLICKEYBYTES);
+  }
+  sha3_256x4(sk[0]+KYBER_SECRETKEYBYTES-2*KYBER_SYMBYTES,
+             sk[1]+KYBER_SECRETKEYBYTES-2*KYBER_SYMBYTES,
+             sk[2]+KYBER_SECRETKEYBYTES-2*KYBER_SYMBYTES,
+             sk[3]+KYBER_SECRETKEYBYTES-2*KYBER_SYMBYTES,
+             pk[0], pk[1], pk[2], pk[3], KYBER_PUBLICKEYBYTES);
+  /* Value z for pseudo-random output on reject */
+  for(i=0;i<4;i++)
+    randombytes(sk[i]+KYBER_SECRETKEYBYTES-KYBER_SYMBYTES, KYBER_SYMBYTES);
+  return 0;
+}
+
+/*************************************************
+* Name:        crypto_kem_enc_x4
+*
+* Description: Four independent encapsulations, as crypto_kem_enc. Every
+*              hash step runs on one lane of the 4-way Keccak.
+*
+* Arguments:   - uint8_t *const ct[4]: pointers to output cipher texts
+*              - uint8_t *const ss[4]: pointers to output shared secrets
+*              - const uint8_t *const pk[4]: pointers to input public keys
+*
+* Returns 0 (success)
+**************************************************/
+int crypto_kem_enc_x4(uint8_t *const ct[4],
+                      uint8_t *const ss[4],
+                      const uint8_t *const pk[4])
+{
+  unsigned int i;
+  uint8_t buf[4][2*KYBER_SYMBYTES];
+  /* Will contain key, coins */
+  uint8_t kr[4][2*KYBER_SYMBYTES];
+
+  for(i=0;i<4;i++)
+    randombytes(buf[i], KYBER_SYMBYTES);
+  /* Don't release system RNG output */
+  sha3_256x4(buf[0], buf[1], buf[2], buf[3],
+             buf[0], buf[1], buf[2], buf[3], KYBER_SYMBYTES);
+
+  /* Multitarget countermeasure for coins + contributory KEM */
+  sha3_256x4(buf[0]+KYBER_SYMBYTES, buf[1]+KYBER_SYMBYTES,
+             buf[2]+KYBER_SYMBYTES, buf[3]+KYBER_SYMBYTES,
+             pk[0], pk[1], pk[2], pk[3], KYBER_PUBLICKEYBYTES);
+  sha3_512x4(kr[0], kr[1], kr[2], kr[3],
+             buf[0], buf[1], buf[2], buf[3], 2*KYBER_SYMBYTES);
+
+  /* coins are in kr+KYBER_SYMBYTES */
+  for(i=0;i<4;i++)
+    indcpa_enc(ct[i], buf[i], pk[i], kr[i]+KYBER_SYMBYTES);
+
+  /* overwrite coins in kr with H(c) */
+  sha3_256x4(kr[0]+KYBER_SYMBYTES, kr[1]+KYBER_SYMBYTES,
+             kr[2]+KYBER_SYMBYTES, kr[3]+KYBER_SYMBYTES,
+             ct[0], ct[1], ct[2], ct[3], KYBER_CIPHERTEXTBYTES);
+  /* hash concatenation of pre-k and H(c) to k */
+  shake256x4(ss[0], ss[1], ss[2], ss[3], KYBER_SSBYTES,
+             kr[0], kr[1], kr[2], kr[3], 2*KYBER_SYMBYTES);
+  return 0;
+}
+
+/*************************************************
+* Name:        crypto_kem_dec_x4
+*
+* Description: Four independent decapsulations, as crypto_kem_dec. Every
+*              hash step runs on one lane of the 4-way Keccak.
+*
+* Arguments:   - uint8_t *const ss[4]: pointers to output shared secrets
+*              - const uint8_t *const ct[4]: pointers to input cipher texts
+*              - const uint8_t *const sk[4]: pointers to input private keys
+*
+* Returns 0.
+*
+* On failure, ss[i] will contain a pseudo-random value.
+**************************************************/
+int crypto_kem_dec_x4(uint8_t *const ss[4],
+                      const uint8_t *const ct[4],
+                      const uint8_t *const sk[4])
+{
+  unsigned int i;
+  int fail;
+  uint8_t buf[4][2*KYBER_SYMBYTES];
+  /* Will contain key, coins */
+  uint8_t kr[4][2*KYBER_SYMBYTES];
+  ALIGNED_UINT8(KYBER_CIPHERTEXTBYTES) cmp;
+
+  for(i=0;i<4;i++) {
+    indcpa_dec(buf[i], ct[i], sk[i]);
+    /* Multitarget countermeasure for coins + contributory KEM */
+    memcpy(buf[i]+KYBER_SYMBYTES, sk[i]+KYBER_SECRETKEYBYTES-2*KYBER_SYMBYTES, KYBER_SYMBYTES);
+  }
+  sha3_512x4(kr[0], kr[1], kr[2], kr[3],
+             buf[0], buf[1], buf[2], buf[3], 2*KYBER_SYMBYTES);
+
+  for(i=0;i<4;i++) {
+    /* coins are in kr+KYBER_SYMBYTES */
+    indcpa_enc(cmp.coeffs, buf[i], sk[i]+KYBER_INDCPA_SECRETKEYBYTES, kr[i]+KYBER_SYMBYTES);
+    fail = verify(ct[i], cmp.coeffs, KYBER_CIPHERTEXTBYTES);
+    /* Stash pre-k or z in buf until H(c) is known */
+    memcpy(buf[i], kr[i], KYBER_SYMBYTES);
+    cmov(buf[i], sk[i]+KYBER_SECRETKEYBYTES-KYBER_SYMBYTES, KYBER_SYMBYTES, fail);
+  }
+  sha3_256x4(buf[0]+KYBER_SYMBYTES, buf[1]+KYBER_SYMBYTES,
+             buf[2]+KYBER_SYMBYTES, buf[3]+KYBER_SYMBYTES,
+             ct[0], ct[1], ct[2], ct[3], KYBER_CIPHERTEXTBYTES);
+
+  /* hash concatenation of pre-k and H(c) to k */
+  shake256x4(ss[0], ss[1], ss[2], ss[3], KYBER_SSBYTES,
+             buf[0], buf[1], buf[2], buf[3], 2*KYBER_SYMBYTES);
+  return 0;
+}
+#endif
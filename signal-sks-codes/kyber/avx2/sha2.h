@@ -0,0 +1 @@
+../ref/sha2.h
\ No newline at end of file
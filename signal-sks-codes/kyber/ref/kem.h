@@ -38,4 +38,16 @@ int crypto_kem_enc(uint8_t *ct, uint8_t *ss, const uint8_t *pk);
 #define crypto_kem_dec KYBER_NAMESPACE(dec)
 int crypto_kem_dec(uint8_t *ss, const uint8_t *ct, const uint8_t *sk);
 
+/* Batched over the 4-way Keccak; AVX2 backend only. */
+#ifndef KYBER_90S
+#define crypto_kem_keypair_x4 KYBER_NAMESPACE(keypair_x4)
+int crypto_kem_keypair_x4(uint8_t *const pk[4], uint8_t *const sk[4]);
+
+#define crypto_kem_enc_x4 KYBER_NAMESPACE(enc_x4)
+int crypto_kem_enc_x4(uint8_t *const ct[4], uint8_t *const ss[4], const uint8_t *const pk[4]);
+
+#define crypto_kem_dec_x4 KYBER_NAMESPACE(dec_x4)
+int crypto_kem_dec_x4(uint8_t *const ss[4], const uint8_t *const ct[4], const uint8_t *const sk[4]);
+#endif
+
 #endif
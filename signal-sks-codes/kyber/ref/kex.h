@@ -12,6 +12,13 @@
 
 #define KEX_SSBYTES KYBER_SSBYTES
 
+#define kex_uake_initA KYBER_NAMESPACE(kex_uake_initA)
+#define kex_uake_sharedB KYBER_NAMESPACE(kex_uake_sharedB)
+#define kex_uake_sharedA KYBER_NAMESPACE(kex_uake_sharedA)
+#define kex_ake_initA KYBER_NAMESPACE(kex_ake_initA)
+#define kex_ake_sharedB KYBER_NAMESPACE(kex_ake_sharedB)
+#define kex_ake_sharedA KYBER_NAMESPACE(kex_ake_sharedA)
+
 void kex_uake_initA(uint8_t *send, uint8_t *tk, uint8_t *sk, const uint8_t *pkb);
 
 void kex_uake_sharedB(uint8_t *send, uint8_t *k, const uint8_t *recv, const uint8_t *skb);
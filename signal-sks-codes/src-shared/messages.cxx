@@ -65,102 +65,504 @@ int get_integer(CryptoPP::Integer *i, std::vector<unsigned char> &data,
   return n;
 }
 
+// ================================================
+// BINARY WIRE FORMAT
+// ================================================
+
+/**
+ * Write v as two little-endian bytes.
+ */
+void put_u16(uint16_t v, unsigned char *out) {
+  out[0] = v & 0xff;
+  out[1] = (v >> 8) & 0xff;
+}
+
+/**
+ * Read two little-endian bytes.
+ */
+uint16_t get_u16(const unsigned char *in) {
+  return (uint16_t)in[0] | ((uint16_t)in[1] << 8);
+}
+
+/**
+ * Write v as four little-endian bytes.
+ */
+void put_u32(uint32_t v, unsigned char *out) {
+  out[0] = v & 0xff;
+  out[1] = (v >> 8) & 0xff;
+  out[2] = (v >> 16) & 0xff;
+  out[3] = (v >> 24) & 0xff;
+}
+
+/**
+ * Read four little-endian bytes.
+ */
+uint32_t get_u32(const unsigned char *in) {
+  return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) |
+         ((uint32_t)in[3] << 24);
+}
+
+/**
+ * Put bytes into data; prepend with a u32 length.
+ */
+int put_bytes(const unsigned char *bytes, size_t size,
+              std::vector<unsigned char> &data) {
+  if (size > UINT32_MAX)
+    throw std::runtime_error("Field too large to serialize.");
+  size_t idx = data.size();
+  data.resize(idx + sizeof(uint32_t) + size);
+  put_u32(size, &data[idx]);
+  if (size > 0)
+    std::memcpy(&data[idx + sizeof(uint32_t)], bytes, size);
+  return sizeof(uint32_t) + size;
+}
+
+/**
+ * Points view at the next length-prefixed field of data at index idx.
+ * @throws std::runtime_error if the field runs past the end of data.
+ */
+int get_bytes(ByteView *view, const unsigned char *data, size_t size,
+              size_t idx) {
+  if (idx > size || size - idx < sizeof(uint32_t))
+    throw std::runtime_error("Truncated message.");
+  uint32_t field_size = get_u32(data + idx);
+  idx += sizeof(uint32_t);
+  if (size - idx < field_size)
+    throw std::runtime_error("Truncated message.");
+  view->data = data + idx;
+  view->size = field_size;
+  return sizeof(uint32_t) + field_size;
+}
+
+/**
+ * Views of a whole block or string. A string's bytes are written in place, so
+ * size it first.
+ */
+ByteView bytes_of(const CryptoPP::SecByteBlock &block) {
+  return ByteView{block.BytePtr(), block.size()};
+}
+
+ByteView bytes_of(const std::string &s) {
+  return ByteView{(const unsigned char *)s.data(), s.size()};
+}
+
+MutableByteView buffer_of(CryptoPP::SecByteBlock &block) {
+  return MutableByteView{block.BytePtr(), block.size()};
+}
+
+MutableByteView buffer_of(std::string &s) {
+  return MutableByteView{(unsigned char *)&s[0], s.size()};
+}
+
 // ================================================
 // MESSAGES
 // ================================================
 
 /**
- * Serialize DHParams_Message.
+ * Serialize PublicValue_Message. Layout: type, version, preferred cipher
+ * suite, preferred Kyber parameter set (which the public value belongs to),
+ * then the Kyber and X25519 public values, the sender and recipient key IDs,
+ * the authenticated key exchange message and the ticket, each behind a
+ * little-endian u32 length.
  */
-void DHParams_Message::serialize(std::vector<unsigned char> &data) {
-  // Add message type.
-  data.push_back((char)MessageType::DHParams_Message);
+void PublicValue_Message::serialize(std::vector<unsigned char> &data) {
+  // Add message type and version.
+  data.push_back((char)MessageType::PublicValue);
+  data.push_back(WIRE_FORMAT_VERSION);
 
   // Add fields.
-  put_integer(this->p, data);
-  put_integer(this->q, data);
-  put_integer(this->g, data);
+  data.push_back((char)this->cipher_suite);
+  data.push_back((char)this->kem_params);
+  put_bytes(this->public_value.BytePtr(), this->public_value.size(), data);
+  put_bytes(this->dh_public_value.BytePtr(), this->dh_public_value.size(),
+            data);
+  put_bytes(this->sender_key_id.BytePtr(), this->sender_key_id.size(), data);
+  put_bytes(this->recipient_key_id.BytePtr(), this->recipient_key_id.size(),
+            data);
+  put_bytes(this->ake_message.BytePtr(), this->ake_message.size(), data);
+  put_bytes(this->ticket.BytePtr(), this->ticket.size(), data);
 }
 
 /**
- * Deserialize DHParams_Message.
+ * Deserialize PublicValue_Message.
  */
-int DHParams_Message::deserialize(std::vector<unsigned char> &data) {
-  // Check correct message type.
-  assert(get_message_type(data) == MessageType::DHParams_Message);
+int PublicValue_Message::deserialize(std::vector<unsigned char> &data) {
+  // Check correct message type and version.
+  if (data.size() < 4 || get_message_type(data) != MessageType::PublicValue)
+    throw std::runtime_error("Not a PublicValue message.");
+  if (data[1] != WIRE_FORMAT_VERSION)
+    throw std::runtime_error("Unsupported wire format version.");
+  if (data[3] < KEMParams::KYBER512 || data[3] > KEMParams::KYBER1024_90S)
+    throw std::runtime_error("Unknown Kyber parameter set.");
 
   // Get fields.
-  int n = 1;
-  n += get_integer(&this->p, data, n);
-  n += get_integer(&this->q, data, n);
-  n += get_integer(&this->g, data, n);
+  this->cipher_suite = (CipherSuite::T)data[2];
+  this->kem_params = (KEMParams::T)data[3];
+  ByteView public_value;
+  int n = 4;
+  n += get_bytes(&public_value, data.data(), data.size(), n);
+  this->public_value.Assign(public_value.data, public_value.size);
+  ByteView dh_public_value;
+  n += get_bytes(&dh_public_value, data.data(), data.size(), n);
+  this->dh_public_value.Assign(dh_public_value.data, dh_public_value.size);
+  ByteView sender_key_id, recipient_key_id, ake_message;
+  n += get_bytes(&sender_key_id, data.data(), data.size(), n);
+  n += get_bytes(&recipient_key_id, data.data(), data.size(), n);
+  n += get_bytes(&ake_message, data.data(), data.size(), n);
+  this->sender_key_id.Assign(sender_key_id.data, sender_key_id.size);
+  this->recipient_key_id.Assign(recipient_key_id.data, recipient_key_id.size);
+  this->ake_message.Assign(ake_message.data, ake_message.size);
+  ByteView ticket;
+  n += get_bytes(&ticket, data.data(), data.size(), n);
+  this->ticket.Assign(ticket.data, ticket.size);
   return n;
 }
 
 /**
- * Serialize Message.
+ * Serialize Resume_Message. Layout: type, version, then the ticket and nonce
+ * behind little-endian u32 lengths.
  */
-void PublicValue_Message::serialize(std::vector<unsigned char> &data) {
-  // Add message type.
-  data.push_back((char)MessageType::PublicValue);
+void Resume_Message::serialize(std::vector<unsigned char> &data) {
+  // Add message type and version.
+  data.push_back((char)MessageType::Resume);
+  data.push_back(WIRE_FORMAT_VERSION);
 
   // Add fields.
-  std::string public_integer = byteblock_to_string(this->public_value);
-  put_string(public_integer, data);
+  put_bytes(this->ticket.BytePtr(), this->ticket.size(), data);
+  put_bytes(this->nonce.BytePtr(), this->nonce.size(), data);
 }
 
 /**
- * Deserialize Message.
+ * Deserialize Resume_Message.
  */
-int PublicValue_Message::deserialize(std::vector<unsigned char> &data) {
-  // Check correct message type.
-  assert(get_message_type(data) == MessageType::PublicValue);
+int Resume_Message::deserialize(std::vector<unsigned char> &data) {
+  // Check correct message type and version.
+  if (data.size() < 2 || get_message_type(data) != MessageType::Resume)
+    throw std::runtime_error("Not a Resume message.");
+  if (data[1] != WIRE_FORMAT_VERSION)
+    throw std::runtime_error("Unsupported wire format version.");
 
   // Get fields.
-  std::string public_integer;
-  int n = 1;
-  n += get_string(&public_integer, data, n);
-  this->public_value = string_to_byteblock(public_integer);
+  ByteView ticket, nonce;
+  int n = 2;
+  n += get_bytes(&ticket, data.data(), data.size(), n);
+  n += get_bytes(&nonce, data.data(), data.size(), n);
+  this->ticket.Assign(ticket.data, ticket.size);
+  this->nonce.Assign(nonce.data, nonce.size);
   return n;
 }
 
 /**
- * Serialize Message.
+ * Serialize SessionTicket. Layout: type, version, cipher suite, Kyber
+ * parameter set, then the ticket, resumption secret and peer key ID behind
+ * little-endian u32 lengths.
+ */
+void SessionTicket::serialize(std::vector<unsigned char> &data) {
+  // Add message type and version.
+  data.push_back((char)MessageType::SessionTicket);
+  data.push_back(WIRE_FORMAT_VERSION);
+
+  // Add fields.
+  data.push_back((char)this->cipher_suite);
+  data.push_back((char)this->kem_params);
+  put_bytes(this->ticket.BytePtr(), this->ticket.size(), data);
+  put_bytes(this->resumption_secret.BytePtr(), this->resumption_secret.size(),
+            data);
+  put_bytes(this->peer_key_id.BytePtr(), this->peer_key_id.size(), data);
+}
+
+/**
+ * Deserialize SessionTicket.
+ */
+int SessionTicket::deserialize(std::vector<unsigned char> &data) {
+  // Check correct message type and version.
+  if (data.size() < 4 || get_message_type(data) != MessageType::SessionTicket)
+    throw std::runtime_error("Not a SessionTicket.");
+  if (data[1] != WIRE_FORMAT_VERSION)
+    throw std::runtime_error("Unsupported wire format version.");
+  if (data[3] < KEMParams::KYBER512 || data[3] > KEMParams::KYBER1024_90S)
+    throw std::runtime_error("Unknown Kyber parameter set.");
+
+  // Get fields.
+  this->cipher_suite = (CipherSuite::T)data[2];
+  this->kem_params = (KEMParams::T)data[3];
+  ByteView ticket, resumption_secret, peer_key_id;
+  int n = 4;
+  n += get_bytes(&ticket, data.data(), data.size(), n);
+  n += get_bytes(&resumption_secret, data.data(), data.size(), n);
+  n += get_bytes(&peer_key_id, data.data(), data.size(), n);
+  this->ticket.Assign(ticket.data, ticket.size);
+  this->resumption_secret.Assign(resumption_secret.data,
+                                 resumption_secret.size);
+  this->peer_key_id.Assign(peer_key_id.data, peer_key_id.size);
+  return n;
+}
+
+/**
+ * Serialize Message. Layout: type, version, u32 epoch, u32 counter,
+ * KEY_ID_SIZE bytes of key ID, then iv, public_value, ciphertext, mac and ct,
+ * each behind a little-endian u32 length.
  */
 void Message_Message::serialize(std::vector<unsigned char> &data) {
-  // Add message type.
+  Message_Frame frame = this->serialize_frame(
+      this->iv.size(), this->ciphertext.size(), this->mac.size(), data);
+  if (frame.iv.size > 0)
+    std::memcpy(frame.iv.data, this->iv.BytePtr(), frame.iv.size);
+  if (frame.ciphertext.size > 0)
+    std::memcpy(frame.ciphertext.data, this->ciphertext.data(),
+                frame.ciphertext.size);
+  if (frame.mac.size > 0)
+    std::memcpy(frame.mac.data, this->mac.data(), frame.mac.size);
+}
+
+/**
+ * Leaves a field of the given size, behind its u32 length, to be filled in
+ * later.
+ * @return Offset of the field in data.
+ */
+static size_t put_room(size_t size, std::vector<unsigned char> &data) {
+  if (size > UINT32_MAX)
+    throw std::runtime_error("Field too large to serialize.");
+  size_t idx = data.size();
+  data.resize(idx + sizeof(uint32_t) + size);
+  put_u32(size, &data[idx]);
+  return idx + sizeof(uint32_t);
+}
+
+/**
+ * Serialize Message in the same layout as serialize, with room for iv,
+ * ciphertext and mac instead of their contents. The frame is sized once, so
+ * a sender can seal straight into it.
+ * @return Views of the room for iv, ciphertext and mac.
+ */
+Message_Frame
+Message_Message::serialize_frame(size_t iv_size, size_t ciphertext_size,
+                                 size_t mac_size,
+                                 std::vector<unsigned char> &data) {
+  if (this->key_id.size() != KEY_ID_SIZE)
+    throw std::runtime_error("Message has no key ID.");
+
+  // Size the buffer once.
+  data.reserve(data.size() + 2 + 7 * sizeof(uint32_t) + KEY_ID_SIZE +
+               iv_size + this->public_value.size() + ciphertext_size +
+               mac_size + this->ct.size());
+
+  // Add message type and version.
   data.push_back((char)MessageType::Message);
+  data.push_back(WIRE_FORMAT_VERSION);
 
-  // Add fields.
-  std::string iv = byteblock_to_string(this->iv);
-  put_string(iv, data);
-  std::string public_integer = byteblock_to_string(this->public_value);
-  put_string(public_integer, data);
-  put_string(this->ciphertext, data);
-  put_string(this->mac, data);
-  std::string ct = byteblock_to_string(this->ct);
-  put_string(ct, data);
+  // Add epoch header.
+  size_t idx = data.size();
+  data.resize(idx + 2 * sizeof(uint32_t) + KEY_ID_SIZE);
+  put_u32(this->epoch, &data[idx]);
+  put_u32(this->counter, &data[idx + sizeof(uint32_t)]);
+  std::memcpy(&data[idx + 2 * sizeof(uint32_t)], this->key_id.BytePtr(),
+              KEY_ID_SIZE);
+
+  // Add fields, leaving room for the sealed ones.
+  size_t iv_idx = put_room(iv_size, data);
+  put_bytes(this->public_value.BytePtr(), this->public_value.size(), data);
+  size_t ciphertext_idx = put_room(ciphertext_size, data);
+  size_t mac_idx = put_room(mac_size, data);
+  put_bytes(this->ct.BytePtr(), this->ct.size(), data);
+
+  Message_Frame frame;
+  frame.iv = MutableByteView{data.data() + iv_idx, iv_size};
+  frame.ciphertext =
+      MutableByteView{data.data() + ciphertext_idx, ciphertext_size};
+  frame.mac = MutableByteView{data.data() + mac_idx, mac_size};
+  return frame;
 }
 
 /**
  * Deserialize Message.
  */
 int Message_Message::deserialize(std::vector<unsigned char> &data) {
-  // Check correct message type.
-  assert(get_message_type(data) == MessageType::Message);
+  Message_View view;
+  int n = view.parse(data.data(), data.size());
+
+  // Copy fields out of the buffer.
+  this->epoch = view.epoch;
+  this->counter = view.counter;
+  this->key_id.Assign(view.key_id.data, view.key_id.size);
+  this->iv.Assign(view.iv.data, view.iv.size);
+  this->public_value.Assign(view.public_value.data, view.public_value.size);
+  this->ciphertext.assign((const char *)view.ciphertext.data,
+                          view.ciphertext.size);
+  this->mac.assign((const char *)view.mac.data, view.mac.size);
+  this->ct.Assign(view.ct.data, view.ct.size);
+  return n;
+}
+
+/**
+ * View of a Message's own fields, for code that works on parsed frames.
+ * Valid while the message is alive and unchanged.
+ */
+Message_View Message_Message::view() const {
+  Message_View view;
+  view.epoch = this->epoch;
+  view.counter = this->counter;
+  view.key_id = bytes_of(this->key_id);
+  view.iv = bytes_of(this->iv);
+  view.public_value = bytes_of(this->public_value);
+  view.ciphertext = bytes_of(this->ciphertext);
+  view.mac = bytes_of(this->mac);
+  view.ct = bytes_of(this->ct);
+  return view;
+}
+
+/**
+ * Parse a serialized Message without copying any field.
+ * @throws std::runtime_error on a truncated message or unknown version.
+ */
+int Message_View::parse(const unsigned char *data, size_t size) {
+  // Check correct message type and version.
+  if (size < 2 || data[0] != MessageType::Message)
+    throw std::runtime_error("Not a Message.");
+  if (data[1] != WIRE_FORMAT_VERSION)
+    throw std::runtime_error("Unsupported wire format version.");
+
+  // Get epoch header.
+  size_t n = 2;
+  if (size - n < 2 * sizeof(uint32_t) + KEY_ID_SIZE)
+    throw std::runtime_error("Truncated message.");
+  this->epoch = get_u32(data + n);
+  n += sizeof(uint32_t);
+  this->counter = get_u32(data + n);
+  n += sizeof(uint32_t);
+  this->key_id.data = data + n;
+  this->key_id.size = KEY_ID_SIZE;
+  n += KEY_ID_SIZE;
 
   // Get fields.
-  int n = 1;
-  std::string iv;
-  n += get_string(&iv, data, n);
-  this->iv = string_to_byteblock(iv);
-  std::string public_integer;
-  n += get_string(&public_integer, data, n);
-  this->public_value = string_to_byteblock(public_integer);
-  n += get_string(&this->ciphertext, data, n);
-  n += get_string(&this->mac, data, n);
-  std::string ct;
-  n += get_string(&ct, data, n);
-  this->ct = string_to_byteblock(ct);
+  n += get_bytes(&this->iv, data, size, n);
+  n += get_bytes(&this->public_value, data, size, n);
+  n += get_bytes(&this->ciphertext, data, size, n);
+  n += get_bytes(&this->mac, data, size, n);
+  n += get_bytes(&this->ct, data, size, n);
+  return n;
+}
+
+// ================================================
+// ONION CIRCUITS
+// ================================================
+
+/**
+ * Write a whole cell: header, payload and zero padding.
+ * @param cell CELL_SIZE bytes to write to.
+ * @throws std::runtime_error if the payload does not fit.
+ */
+void put_cell(uint32_t circuit_id, MessageType::T command,
+              const unsigned char *payload, size_t size, unsigned char *cell) {
+  if (size > CELL_PAYLOAD_SIZE)
+    throw std::runtime_error("Payload does not fit in a cell.");
+  put_u32(circuit_id, cell);
+  cell[sizeof(uint32_t)] = (char)command;
+  put_u16(size, cell + sizeof(uint32_t) + 1);
+  if (size > 0)
+    std::memcpy(cell + CELL_HEADER_SIZE, payload, size);
+  std::memset(cell + CELL_HEADER_SIZE + size, 0, CELL_PAYLOAD_SIZE - size);
+}
+
+/**
+ * Write a relay cell with a zero recognized field and digest, ready for
+ * OnionLayer::seal. Its payload length always covers the whole cell so the
+ * padding is layered too.
+ * @param cell CELL_SIZE bytes to write to.
+ * @throws std::runtime_error if the data does not fit.
+ */
+void put_relay_cell(uint32_t circuit_id, RelayCommand::T command,
+                    const unsigned char *data, size_t size,
+                    unsigned char *cell) {
+  if (size > RELAY_DATA_SIZE)
+    throw std::runtime_error("Data does not fit in a relay cell.");
+  put_u32(circuit_id, cell);
+  cell[sizeof(uint32_t)] = (char)MessageType::Onion_Relay;
+  put_u16(CELL_PAYLOAD_SIZE, cell + sizeof(uint32_t) + 1);
+  unsigned char *payload = cell + CELL_HEADER_SIZE;
+  std::memset(payload, 0, RELAY_HEADER_SIZE);
+  payload[RELAY_DIGEST_OFFSET + RELAY_DIGEST_SIZE] = (char)command;
+  put_u16(size, payload + RELAY_HEADER_SIZE - sizeof(uint16_t));
+  if (size > 0)
+    std::memcpy(payload + RELAY_HEADER_SIZE, data, size);
+  std::memset(payload + RELAY_HEADER_SIZE + size, 0, RELAY_DATA_SIZE - size);
+}
+
+/**
+ * Parse a cell in place.
+ * @param cell CELL_SIZE bytes.
+ * @throws std::runtime_error on an unknown command or bad length.
+ */
+void Cell_View::parse(unsigned char *cell) {
+  unsigned char command = cell[sizeof(uint32_t)];
+  if (command < MessageType::Onion_Create ||
+      command > MessageType::Onion_Destroy)
+    throw std::runtime_error("Not an onion cell.");
+  this->circuit_id = get_u32(cell);
+  this->command = (MessageType::T)command;
+  this->payload = cell + CELL_HEADER_SIZE;
+  this->size = get_u16(cell + sizeof(uint32_t) + 1);
+  if (this->size > CELL_PAYLOAD_SIZE)
+    throw std::runtime_error("Truncated message.");
+}
+
+/**
+ * Parse a relay payload that OnionLayer::open has recognized.
+ */
+void Relay_View::parse(const unsigned char *payload, size_t size) {
+  if (size < RELAY_HEADER_SIZE)
+    throw std::runtime_error("Truncated message.");
+  this->command =
+      (RelayCommand::T)payload[RELAY_DIGEST_OFFSET + RELAY_DIGEST_SIZE];
+  this->data.data = payload + RELAY_HEADER_SIZE;
+  this->data.size = get_u16(payload + RELAY_HEADER_SIZE - sizeof(uint16_t));
+  if (this->data.size > size - RELAY_HEADER_SIZE)
+    throw std::runtime_error("Truncated message.");
+}
+
+/**
+ * Serialize Relay_Message into a relay cell.
+ */
+void Relay_Message::serialize_cell(uint32_t circuit_id, unsigned char *cell) {
+  put_relay_cell(circuit_id, this->command, this->data.data(),
+                 this->data.size(), cell);
+}
+
+/**
+ * Deserialize Relay_Message. Only call on a payload OnionLayer::open has
+ * recognized.
+ */
+void Relay_Message::deserialize(const unsigned char *payload, size_t size) {
+  Relay_View view;
+  view.parse(payload, size);
+  this->command = view.command;
+  this->data.assign(view.data.data, view.data.data + view.data.size);
+}
+
+/**
+ * Serialize RelayTarget: address, u32 port, public value.
+ */
+void RelayTarget::serialize(std::vector<unsigned char> &out) {
+  put_bytes((const unsigned char *)this->address.data(), this->address.size(),
+            out);
+  size_t idx = out.size();
+  out.resize(idx + sizeof(uint32_t));
+  put_u32(this->port, &out[idx]);
+  put_bytes(this->public_value.BytePtr(), this->public_value.size(), out);
+}
+
+/**
+ * Deserialize RelayTarget.
+ */
+int RelayTarget::deserialize(const unsigned char *in, size_t size) {
+  ByteView address, public_value;
+  size_t n = get_bytes(&address, in, size, 0);
+  if (size - n < sizeof(uint32_t))
+    throw std::runtime_error("Truncated message.");
+  this->port = get_u32(in + n);
+  n += sizeof(uint32_t);
+  n += get_bytes(&public_value, in, size, n);
+  this->address.assign((const char *)address.data, address.size);
+  this->public_value.Assign(public_value.data, public_value.size);
   return n;
 }
@@ -79,3 +79,23 @@ std::string concat_msg_fields(CryptoPP::SecByteBlock iv,
   return std::string((const char *)concated.data(), concated.size()) +
          ciphertext;
 }
+
+/**
+ * Serializes the epoch header of a message for tagging. The key ID already
+ * commits to the epoch's public value and KEM ciphertext, so those do not
+ * need to be tagged again on every message.
+ */
+CryptoPP::SecByteBlock epoch_header(uint32_t epoch, uint32_t counter,
+                                    const CryptoPP::SecByteBlock &key_id) {
+  CryptoPP::SecByteBlock header(8 + key_id.size());
+  header[0] = epoch & 0xff;
+  header[1] = (epoch >> 8) & 0xff;
+  header[2] = (epoch >> 16) & 0xff;
+  header[3] = (epoch >> 24) & 0xff;
+  header[4] = counter & 0xff;
+  header[5] = (counter >> 8) & 0xff;
+  header[6] = (counter >> 16) & 0xff;
+  header[7] = (counter >> 24) & 0xff;
+  std::memcpy(header.BytePtr() + 8, key_id.BytePtr(), key_id.size());
+  return header;
+}
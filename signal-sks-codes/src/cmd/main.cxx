@@ -1,36 +1,255 @@
+#include <algorithm>
+#include <cerrno>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <string>
 
+#include "../../include-shared/util.hpp"
+#include "../../include/drivers/async_network_driver.hpp"
 #include "../../include/drivers/crypto_driver.hpp"
+#include "../../include/drivers/key_store.hpp"
+#include "../../include/drivers/keypair_pool.hpp"
 #include "../../include/drivers/network_driver.hpp"
+#include "../../include/drivers/onion_network_driver.hpp"
+#include "../../include/drivers/session_tickets.hpp"
 #include "../../include/pkg/client.hpp"
+#include "../../include/pkg/client_session.hpp"
+#include "../../include/pkg/relay.hpp"
+
+/**
+ * Parses a comma-separated list of host:port relays.
+ */
+static std::vector<std::pair<std::string, int>>
+parse_relays(const std::string &list) {
+  std::vector<std::pair<std::string, int>> relays;
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos)
+      end = list.size();
+    std::string relay = list.substr(start, end - start);
+    size_t colon = relay.rfind(':');
+    if (colon == std::string::npos)
+      throw std::runtime_error("Relays must be given as host:port.");
+    relays.push_back(std::make_pair(relay.substr(0, colon),
+                                    atoi(relay.substr(colon + 1).c_str())));
+    start = end + 1;
+  }
+  return relays;
+}
+
+/**
+ * The Kyber parameter set to ask peers for: $SIGNAL_KEM (e.g. "kyber768" or
+ * "kyber512-90s") if set, Kyber512 otherwise.
+ */
+static KEMParams::T preferred_kem_params() {
+  const char *name = std::getenv("SIGNAL_KEM");
+  return name ? kem_params_from_name(name) : KEMParams::KYBER512;
+}
+
+/**
+ * The cipher suite to ask peers for: $SIGNAL_CIPHER (e.g. "chacha20-poly1305"
+ * or the legacy "aes-cbc-hmac-sha256") if set, otherwise the fastest one
+ * this CPU runs.
+ */
+static std::shared_ptr<CryptoDriver> open_crypto_driver() {
+  const char *name = std::getenv("SIGNAL_CIPHER");
+  return name ? std::make_shared<CryptoDriver>(cipher_suite_from_name(name))
+              : std::make_shared<CryptoDriver>();
+}
+
+/**
+ * When to run the KEM ratchet step: after $SIGNAL_KEM_MESSAGES messages in an
+ * epoch or once it is $SIGNAL_KEM_SECONDS old, whichever comes first, with
+ * RatchetPolicy's defaults for either one that is unset.
+ */
+static RatchetPolicy ratchet_policy() {
+  RatchetPolicy policy;
+  if (const char *messages = std::getenv("SIGNAL_KEM_MESSAGES"))
+    policy.messages = std::strtoul(messages, nullptr, 10);
+  if (const char *seconds = std::getenv("SIGNAL_KEM_SECONDS"))
+    policy.seconds = std::strtoul(seconds, nullptr, 10);
+  return policy;
+}
+
+/**
+ * Largest frame a peer may send: $SIGNAL_MAX_FRAME bytes if set, brought
+ * within MIN_FRAME_SIZE and MAX_FRAME_SIZE, and MAX_FRAME_SIZE otherwise.
+ */
+static size_t max_frame_size() {
+  const char *value = std::getenv("SIGNAL_MAX_FRAME");
+  if (!value)
+    return MAX_FRAME_SIZE;
+  char *end;
+  errno = 0;
+  unsigned long long size = std::strtoull(value, &end, 10);
+  // strtoull would take "-1" as the largest value there is.
+  if (end == value || *end != '\0' || std::strchr(value, '-'))
+    throw std::runtime_error("SIGNAL_MAX_FRAME must be a number of bytes.");
+  if (errno == ERANGE || size > MAX_FRAME_SIZE)
+    return MAX_FRAME_SIZE;
+  return std::max<size_t>(size, MIN_FRAME_SIZE);
+}
+
+/**
+ * Our long-term identity for authenticated handshakes, if $SIGNAL_KEYS names
+ * a key store (created on first use); nullptr otherwise. Our public key is
+ * written next to the store as <store>.pub to hand to peers, and the .pub
+ * files listed in $SIGNAL_PEERS, comma-separated, become trusted peers.
+ * @param peer_key_id set to the first listed peer's key ID
+ */
+static std::shared_ptr<KeyStore> open_identity(SecByteBlock &peer_key_id) {
+  const char *path = std::getenv("SIGNAL_KEYS");
+  if (!path)
+    return nullptr;
+  std::shared_ptr<KeyStore> key_store = std::make_shared<KeyStore>(path);
+  SecByteBlock identity = key_store->long_term_key_id(
+      []() { return KEMDriver().generate_keypair(); });
+  SecByteBlock public_key = key_store->get(identity).first;
+  std::ofstream(std::string(path) + ".pub", std::ios::binary)
+      .write((const char *)public_key.BytePtr(), public_key.size());
+  std::cout << "Identity key ID: ";
+  print_key_as_hex(identity);
+
+  const char *peers = std::getenv("SIGNAL_PEERS");
+  std::string list = peers ? peers : "";
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos)
+      end = list.size();
+    std::ifstream file(list.substr(start, end - start), std::ios::binary);
+    if (!file)
+      throw std::runtime_error("Could not read peer key " +
+                               list.substr(start, end - start) + ".");
+    std::string bytes((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+    SecByteBlock peer_key((const unsigned char *)bytes.data(), bytes.size());
+    SecByteBlock id = KeyStore::key_id(peer_key);
+    if (key_store->kind(id) != KeyKind::PEER)
+      key_store->add(std::make_pair(peer_key, SecByteBlock()), KeyKind::PEER);
+    if (peer_key_id.empty())
+      peer_key_id = id;
+    start = end + 1;
+  }
+  return key_store;
+}
+
+/**
+ * Seals session tickets for the listening side. With a key store the ticket
+ * key is derived from our long-term private key, so tickets survive a
+ * restart; otherwise it is random and they last as long as the process.
+ */
+static std::shared_ptr<SessionTickets>
+open_tickets(std::shared_ptr<CryptoDriver> crypto_driver,
+             std::shared_ptr<KeyStore> key_store) {
+  SecByteBlock key;
+  if (key_store)
+    key = crypto_driver->ticket_key(
+        key_store->get(key_store->key_ids(KeyKind::LONG_TERM).front()).second);
+  return std::make_shared<SessionTickets>(crypto_driver, key);
+}
 
 /*
- * Usage: ./signal <accept|connect> [address] [port]
- * Ex: ./signal accept localhost 3000
+ * Usage: ./signal <listen|connect|serve|relay> [address] [port] [relays]
+ * Ex: ./signal listen localhost 3000
  *     ./signal connect localhost 3000
+ *     ./signal serve localhost 3000
+ *     ./signal relay localhost 4000
+ *     ./signal connect localhost 3000 localhost:4000,localhost:4001
  */
 int main(int argc, char *argv[]) {
   // Input checking.
-  if (argc != 4) {
-    std::cout << "Usage: " << argv[0] << " <listen|connect> [address] [port]"
-              << std::endl;
+  std::string usage = std::string("Usage: ") + argv[0] +
+                      " <listen|connect|serve|relay> [address] [port]" +
+                      " [relays]";
+  if (argc != 4 && argc != 5) {
+    std::cout << usage << std::endl;
     return 1;
   }
   std::string command = argv[1];
   std::string address = argv[2];
   int port = atoi(argv[3]);
-  if (command != "listen" && command != "connect") {
-    std::cout << "Usage: " << argv[0] << " <listen|connect> [address] [port]"
+  if (command != "listen" && command != "connect" && command != "serve" &&
+      command != "relay") {
+    std::cout << usage << std::endl;
+    return 1;
+  }
+  if (argc == 5 && command != "connect") {
+    std::cout << usage << std::endl;
+    return 1;
+  }
+
+  std::shared_ptr<CryptoDriver> crypto_driver = open_crypto_driver();
+  SecByteBlock peer_key_id;
+  std::shared_ptr<KeyStore> key_store;
+  if (command != "relay")
+    key_store = open_identity(peer_key_id);
+  if (key_store && command == "connect" && peer_key_id.empty()) {
+    std::cout << "Set SIGNAL_PEERS to the peer's public key to connect with "
+                 "SIGNAL_KEYS."
               << std::endl;
     return 1;
   }
 
-  // Connect to network driver.
-  std::shared_ptr<NetworkDriver> network_driver =
-      std::make_shared<NetworkDriverImpl>();
+  // Serve many peers from one process, one session per connection.
+  if (command == "serve") {
+    std::shared_ptr<CLIDriver> cli_driver = std::make_shared<CLIDriver>();
+    cli_driver->init();
+    // One keypair pool for every session, deep enough to absorb bursts.
+    std::shared_ptr<KeypairPool> keypair_pool = std::make_shared<KeypairPool>(
+        std::make_shared<KEMDriver>(preferred_kem_params()), 64, 16);
+    std::shared_ptr<SessionTickets> tickets =
+        open_tickets(crypto_driver, key_store);
+    RatchetPolicy policy = ratchet_policy();
+    std::shared_ptr<SessionRegistry> sessions =
+        std::make_shared<SessionRegistry>();
+    AsyncNetworkDriver network_driver(0, max_frame_size());
+    network_driver.listen(port, [crypto_driver, cli_driver, keypair_pool,
+                                 key_store, tickets, policy, sessions]() {
+      std::shared_ptr<ClientSession> session = std::make_shared<ClientSession>(
+          crypto_driver, cli_driver, keypair_pool, key_store, tickets, policy);
+      sessions->add(session);
+      return session;
+    });
+    boost::thread server([&network_driver]() { network_driver.run(); });
+    // Every line typed at the server goes to each peer whose key exchange is
+    // done. Without a terminal, the server just keeps serving.
+    std::string plaintext;
+    while (std::getline(std::cin, plaintext)) {
+      if (plaintext.empty())
+        continue;
+      sessions->broadcast(bytes_of(plaintext));
+      cli_driver->print_right(plaintext);
+    }
+    server.join();
+    return 0;
+  }
+
+  // Relay circuits for other peers.
+  if (command == "relay") {
+    Relay relay(0, std::make_shared<KeyStore>("relay_" + std::to_string(port) +
+                                              ".keys"));
+    std::cout << "Relay identity key ID: ";
+    print_key_as_hex(relay.identity_key_id());
+    relay.listen(port);
+    relay.run();
+    return 0;
+  }
+
+  // Connect to network driver, through a circuit if relays were given.
+  std::shared_ptr<NetworkDriver> network_driver;
+  if (argc == 5)
+    network_driver = std::make_shared<OnionNetworkDriver>(
+        parse_relays(argv[4]), crypto_driver, std::make_shared<KEMDriver>(),
+        max_frame_size());
+  else
+    network_driver =
+        std::make_shared<NetworkDriverImpl>(true, max_frame_size());
   if (command == "listen") {
     network_driver->listen(port);
   } else if (command == "connect") {
@@ -38,11 +257,20 @@ int main(int argc, char *argv[]) {
   } else {
     throw std::runtime_error("Error: got invalid client command.");
   }
-  std::shared_ptr<CryptoDriver> crypto_driver =
-      std::make_shared<CryptoDriver>();
 
   // Create client then run network, crypto, and cli.
-  Client client = Client(network_driver, crypto_driver);
+  // The connecting side initiates the handshake, resuming the last session
+  // with this destination if its key store holds a ticket; the listening
+  // side issues tickets.
+  Client client = Client(
+      network_driver, crypto_driver,
+      std::make_shared<KeypairPool>(
+          std::make_shared<KEMDriver>(preferred_kem_params())),
+      key_store, command == "connect" ? peer_key_id : SecByteBlock(),
+      command == "listen" ? open_tickets(crypto_driver, key_store) : nullptr);
+  client.set_ratchet_policy(ratchet_policy());
+  if (key_store && command == "connect")
+    client.resume_from(address + ":" + std::to_string(port));
   client.run(command);
   return 0;
 }
@@ -0,0 +1,509 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "../../include/drivers/async_network_driver.hpp"
+
+using namespace boost::asio;
+using ip::tcp;
+
+// ================================================
+// CONNECTION
+// ================================================
+
+// How much a cell-mode connection reads per call; rounded down to whole
+// cells.
+static const size_t READ_BATCH_SIZE = 64 * 1024;
+
+// A cell-mode connection writes up to WRITE_BATCH_SIZE per call, taking up
+// to WRITE_TURN_SIZE (at least one cell) from each active queue in turn. The
+// turn bounds how long a cell queued behind a busy circuit waits.
+static const size_t WRITE_BATCH_SIZE = 64 * 1024;
+static const size_t WRITE_TURN_SIZE = 4 * 1024;
+
+/**
+ * Constructor. Takes ownership of an open socket.
+ * @param max_frame_size Largest frame the peer may send.
+ */
+AsyncConnection::AsyncConnection(tcp::socket socket,
+                                 std::shared_ptr<SessionHandler> handler,
+                                 size_t max_frame_size)
+    : socket(std::move(socket)), handler(handler), closed(false),
+      max_frame_size(max_frame_size), read_length(0), write_length(0),
+      write_queued(0), read_filled(0), reading_paused(false),
+      read_stalled(false), cell_writing(false), cells_closed(false) {
+  this->cell_size = this->handler->cell_size();
+  this->queue_limit = this->handler->queue_limit();
+  if (this->cell_size > 0)
+    this->read_buffer.resize(this->cell_size *
+                             std::max<size_t>(1, READ_BATCH_SIZE /
+                                                     this->cell_size));
+  boost::system::error_code error;
+  tcp::endpoint remote = this->socket.remote_endpoint(error);
+  if (!error)
+    this->remote_info =
+        remote.address().to_string() + ":" + std::to_string(remote.port());
+}
+
+/**
+ * Notify the handler and start the read loop.
+ */
+void AsyncConnection::start() {
+  auto self = shared_from_this();
+  post(this->socket.get_executor(), [this, self]() {
+    this->handler->on_open(self);
+    if (this->cell_size > 0)
+      this->read_cells();
+    else
+      this->read_header();
+  });
+}
+
+/**
+ * Queue a frame for sending. Safe to call from any thread. A peer that lets
+ * more than the handler's queue limit pile up is disconnected.
+ * @param data Bytes of data to send.
+ */
+void AsyncConnection::send(std::vector<unsigned char> data) {
+  auto self = shared_from_this();
+  post(this->socket.get_executor(), [this, self, data = std::move(data)]() {
+    if (this->closed)
+      return;
+    if (this->queue_limit > 0 &&
+        this->write_queued + data.size() > this->queue_limit) {
+      this->close();
+      return;
+    }
+    bool idle = this->write_queue.empty();
+    this->write_queued += data.size();
+    this->write_queue.push_back(std::move(data));
+    if (idle)
+      this->write_next();
+  });
+}
+
+/**
+ * Queue whole cells for sending. Cells in one queue go out in order; queues
+ * take turns. Safe to call from any thread. Cells that would take the queue
+ * past the handler's queue limit are dropped with everything still queued
+ * behind them, and the handler's on_overflow runs on the connection's
+ * thread.
+ * @param cells count * cell_size bytes.
+ * @param count Number of cells.
+ * @param queue Queue to add them to, e.g. the circuit they belong to.
+ */
+void AsyncConnection::send_cells(const unsigned char *cells, size_t count,
+                                 uint32_t queue) {
+  auto self = shared_from_this();
+  bool idle;
+  {
+    std::lock_guard<std::mutex> lock(this->cell_mtx);
+    if (this->cells_closed)
+      return;
+    CellQueue &cell_queue = this->cell_queues[queue];
+    size_t queued = cell_queue.bytes.size() - cell_queue.head;
+    if (this->queue_limit > 0 &&
+        queued + count * this->cell_size > this->queue_limit) {
+      if (queued > 0)
+        this->active_queues.erase(std::find(this->active_queues.begin(),
+                                            this->active_queues.end(),
+                                            queue));
+      this->cell_queues.erase(queue);
+      post(this->socket.get_executor(), [this, self, queue]() {
+        if (!this->closed)
+          this->handler->on_overflow(self, queue);
+      });
+      return;
+    }
+    if (queued == 0)
+      this->active_queues.push_back(queue);
+    cell_queue.bytes.insert(cell_queue.bytes.end(), cells,
+                            cells + count * this->cell_size);
+    idle = !this->cell_writing;
+    this->cell_writing = true;
+  }
+  if (idle)
+    post(this->socket.get_executor(), [this, self]() { this->write_cells(); });
+}
+
+/**
+ * Bytes still waiting to be written from one queue in cell mode. Safe to
+ * call from any thread.
+ * @param queue Queue to measure.
+ */
+size_t AsyncConnection::queued_bytes(uint32_t queue) {
+  std::lock_guard<std::mutex> lock(this->cell_mtx);
+  auto it = this->cell_queues.find(queue);
+  if (it == this->cell_queues.end())
+    return 0;
+  return it->second.bytes.size() - it->second.head;
+}
+
+/**
+ * Pause or resume reading in cell mode, e.g. to push back on a sender while
+ * the data has nowhere to go. Safe to call from any thread; called from one
+ * of this connection's callbacks, it takes effect before the next read.
+ * @param reading false to stop reading after the read in progress.
+ */
+void AsyncConnection::set_reading(bool reading) {
+  auto self = shared_from_this();
+  dispatch(this->socket.get_executor(), [this, self, reading]() {
+    this->reading_paused = !reading;
+    if (reading && this->read_stalled && !this->closed) {
+      this->read_stalled = false;
+      this->read_cells();
+    }
+  });
+}
+
+/**
+ * Disconnect gracefully. Safe to call from any thread.
+ */
+void AsyncConnection::disconnect() {
+  auto self = shared_from_this();
+  post(this->socket.get_executor(), [this, self]() { this->close(); });
+}
+
+/**
+ * Get socket info as string.
+ */
+std::string AsyncConnection::get_remote_info() { return this->remote_info; }
+
+/**
+ * Read the 4-byte length prefix of the next frame. The length comes from the
+ * peer, so a frame over the maximum frame size closes the connection before
+ * anything is allocated for it.
+ */
+void AsyncConnection::read_header() {
+  auto self = shared_from_this();
+  async_read(this->socket, buffer(&this->read_length, sizeof(uint32_t)),
+             [this, self](boost::system::error_code error, size_t) {
+               if (error) {
+                 this->close();
+                 return;
+               }
+               this->read_length = ntohl(this->read_length);
+               if (this->read_length > this->max_frame_size) {
+                 this->close();
+                 return;
+               }
+               this->read_body();
+             });
+}
+
+/**
+ * Read the payload of the current frame and hand it to the handler.
+ */
+void AsyncConnection::read_body() {
+  auto self = shared_from_this();
+  this->read_buffer.resize(this->read_length);
+  async_read(this->socket, buffer(this->read_buffer),
+             [this, self](boost::system::error_code error, size_t) {
+               if (error) {
+                 this->close();
+                 return;
+               }
+               this->handler->on_frame(self, this->read_buffer);
+               if (!this->closed)
+                 this->read_header();
+             });
+}
+
+/**
+ * Read as many cells as are available, up to a batch, and hand every whole
+ * one to the handler. A partial cell is kept at the front of the buffer.
+ */
+void AsyncConnection::read_cells() {
+  auto self = shared_from_this();
+  this->socket.async_read_some(
+      buffer(this->read_buffer.data() + this->read_filled,
+             this->read_buffer.size() - this->read_filled),
+      [this, self](boost::system::error_code error, size_t length) {
+        if (error) {
+          this->close();
+          return;
+        }
+        this->read_filled += length;
+        size_t count = this->read_filled / this->cell_size;
+        if (count > 0)
+          this->handler->on_cells(self, this->read_buffer.data(), count);
+        size_t used = count * this->cell_size;
+        std::memmove(this->read_buffer.data(), this->read_buffer.data() + used,
+                     this->read_filled - used);
+        this->read_filled -= used;
+        if (this->closed)
+          return;
+        if (this->reading_paused)
+          this->read_stalled = true;
+        else
+          this->read_cells();
+      });
+}
+
+/**
+ * Write the next batch of queued cells, taking a turn's worth from each
+ * active queue in rotation.
+ */
+void AsyncConnection::write_cells() {
+  {
+    std::lock_guard<std::mutex> lock(this->cell_mtx);
+    this->cell_batch.clear();
+    size_t turn = this->cell_size *
+                  std::max<size_t>(1, WRITE_TURN_SIZE / this->cell_size);
+    while (this->cell_batch.size() < WRITE_BATCH_SIZE &&
+           !this->active_queues.empty()) {
+      uint32_t queue = this->active_queues.front();
+      this->active_queues.pop_front();
+      CellQueue &cell_queue = this->cell_queues[queue];
+      size_t size = std::min(turn, cell_queue.bytes.size() - cell_queue.head);
+      const unsigned char *cells = &cell_queue.bytes[cell_queue.head];
+      this->cell_batch.insert(this->cell_batch.end(), cells, cells + size);
+      cell_queue.head += size;
+      if (cell_queue.head < cell_queue.bytes.size()) {
+        this->active_queues.push_back(queue);
+        // Reclaim the sent prefix once it is most of the buffer.
+        if (cell_queue.head > cell_queue.bytes.size() / 2) {
+          cell_queue.bytes.erase(cell_queue.bytes.begin(),
+                                 cell_queue.bytes.begin() + cell_queue.head);
+          cell_queue.head = 0;
+        }
+      } else {
+        this->cell_queues.erase(queue);
+      }
+    }
+    if (this->cell_batch.empty()) {
+      this->cell_writing = false;
+      return;
+    }
+  }
+  auto self = shared_from_this();
+  async_write(this->socket, buffer(this->cell_batch),
+              [this, self](boost::system::error_code error, size_t) {
+                if (error || this->closed) {
+                  this->close();
+                  return;
+                }
+                this->write_cells();
+                this->handler->on_written(self);
+              });
+}
+
+/**
+ * Write the frame at the head of the queue; length and payload go out in a
+ * single gathered write.
+ */
+void AsyncConnection::write_next() {
+  auto self = shared_from_this();
+  std::vector<unsigned char> &data = this->write_queue.front();
+  this->write_length = htonl(data.size());
+  std::array<const_buffer, 2> buffers = {
+      buffer(&this->write_length, sizeof(uint32_t)), buffer(data)};
+  async_write(this->socket, buffers,
+              [this, self](boost::system::error_code error, size_t) {
+                // close() may have emptied the queue while this write was
+                // completing.
+                if (error || this->closed) {
+                  this->close();
+                  return;
+                }
+                this->write_queued -= this->write_queue.front().size();
+                this->write_queue.pop_front();
+                if (!this->write_queue.empty())
+                  this->write_next();
+              });
+}
+
+/**
+ * Close the socket once and notify the handler. Runs on the connection's
+ * thread.
+ */
+void AsyncConnection::close() {
+  if (this->closed)
+    return;
+  this->closed = true;
+  this->write_queue.clear();
+  this->write_queued = 0;
+  {
+    std::lock_guard<std::mutex> lock(this->cell_mtx);
+    this->cells_closed = true;
+    this->cell_queues.clear();
+    this->active_queues.clear();
+  }
+  boost::system::error_code error;
+  this->socket.shutdown(tcp::socket::shutdown_both, error);
+  this->socket.close(error);
+  this->handler->on_close(shared_from_this());
+}
+
+// ================================================
+// DRIVER
+// ================================================
+
+// How long to wait before accepting again when the process is out of file
+// descriptors or memory; retrying at once would spin until some free up.
+static const std::chrono::milliseconds ACCEPT_BACKOFF(100);
+
+/**
+ * Whether an accept failed for lack of resources rather than because of the
+ * connection being accepted.
+ */
+static bool out_of_resources(const boost::system::error_code &error) {
+  return error == boost::asio::error::no_descriptors ||
+         error == boost::system::errc::too_many_files_open_in_system ||
+         error == boost::asio::error::no_buffer_space ||
+         error == boost::asio::error::no_memory;
+}
+
+/**
+ * Constructor. Creates one io_context per thread.
+ * @param num_threads Size of the pool; 0 means one per core.
+ * @param max_frame_size Largest frame a peer may send on any connection.
+ */
+AsyncNetworkDriver::AsyncNetworkDriver(int num_threads, size_t max_frame_size)
+    : next_context(0), max_frame_size(max_frame_size) {
+  if (num_threads <= 0)
+    num_threads = std::max(1u, boost::thread::hardware_concurrency());
+  for (int i = 0; i < num_threads; i++) {
+    auto io_context = std::make_shared<boost::asio::io_context>(1);
+    this->work_guards.push_back(make_work_guard(*io_context));
+    this->io_contexts.push_back(io_context);
+  }
+}
+
+/**
+ * Listen on the given port and create a session for every connection.
+ * @param port Port to listen on.
+ * @param factory Creates the per-connection handler.
+ */
+void AsyncNetworkDriver::listen(int port, SessionFactory factory) {
+  this->factory = factory;
+  this->acceptor = std::make_unique<tcp::acceptor>(
+      *this->io_contexts[0], tcp::endpoint(tcp::v4(), port));
+  this->accept_timer =
+      std::make_unique<boost::asio::steady_timer>(*this->io_contexts[0]);
+  this->accept();
+}
+
+/**
+ * Connect to the given address and port and run the handler on the new
+ * connection.
+ * @param address Address to connect to.
+ * @param port Port to conect to.
+ * @param handler Handler for the connection.
+ * @return The started connection.
+ */
+std::shared_ptr<AsyncConnection>
+AsyncNetworkDriver::connect(std::string address, int port,
+                            std::shared_ptr<SessionHandler> handler) {
+  if (address == "localhost")
+    address = "127.0.0.1";
+  tcp::socket socket(this->next_io_context());
+  socket.connect(
+      tcp::endpoint(boost::asio::ip::address::from_string(address), port));
+  auto conn = std::make_shared<AsyncConnection>(std::move(socket), handler,
+                                                this->max_frame_size);
+  conn->start();
+  return conn;
+}
+
+/**
+ * Connect to the given address and port without blocking, e.g. from inside
+ * another connection's callback. on_connect runs on the new connection's
+ * thread once the dial completes, before the connection starts reading, so
+ * whatever it sends goes out before anything the handler answers. It gets
+ * nullptr if the dial fails.
+ * @param address Address to connect to.
+ * @param port Port to conect to.
+ * @param handler Handler for the connection.
+ * @param on_connect Called with the connection, or nullptr.
+ */
+void AsyncNetworkDriver::async_connect(std::string address, int port,
+                                       std::shared_ptr<SessionHandler> handler,
+                                       ConnectHandler on_connect) {
+  if (address == "localhost")
+    address = "127.0.0.1";
+  boost::asio::io_context &io_context = this->next_io_context();
+  boost::system::error_code error;
+  boost::asio::ip::address ip =
+      boost::asio::ip::address::from_string(address, error);
+  if (error) {
+    post(io_context, [on_connect]() { on_connect(nullptr); });
+    return;
+  }
+  auto socket = std::make_shared<tcp::socket>(io_context);
+  size_t max_frame_size = this->max_frame_size;
+  socket->async_connect(
+      tcp::endpoint(ip, port),
+      [socket, handler, on_connect,
+       max_frame_size](boost::system::error_code error) {
+        if (error) {
+          on_connect(nullptr);
+          return;
+        }
+        auto conn = std::make_shared<AsyncConnection>(std::move(*socket),
+                                                      handler, max_frame_size);
+        on_connect(conn);
+        conn->start();
+      });
+}
+
+/**
+ * Run every io_context on its own thread until stop() is called.
+ */
+void AsyncNetworkDriver::run() {
+  for (auto &io_context : this->io_contexts)
+    this->threads.create_thread([io_context]() { io_context->run(); });
+  this->threads.join_all();
+}
+
+/**
+ * Stop accepting and let all threads return.
+ */
+void AsyncNetworkDriver::stop() {
+  if (this->acceptor) {
+    boost::system::error_code error;
+    this->acceptor->close(error);
+  }
+  for (auto &work_guard : this->work_guards)
+    work_guard.reset();
+  for (auto &io_context : this->io_contexts)
+    io_context->stop();
+}
+
+/**
+ * Accept the next connection onto the next io_context in the pool. Out of
+ * resources, wait ACCEPT_BACKOFF before trying again.
+ */
+void AsyncNetworkDriver::accept() {
+  this->acceptor->async_accept(
+      this->next_io_context(),
+      [this](boost::system::error_code error, tcp::socket socket) {
+        if (!this->acceptor->is_open())
+          return;
+        if (out_of_resources(error)) {
+          this->accept_timer->expires_after(ACCEPT_BACKOFF);
+          this->accept_timer->async_wait(
+              [this](boost::system::error_code error) {
+                if (!error && this->acceptor->is_open())
+                  this->accept();
+              });
+          return;
+        }
+        if (!error) {
+          auto conn = std::make_shared<AsyncConnection>(
+              std::move(socket), this->factory(), this->max_frame_size);
+          conn->start();
+        }
+        this->accept();
+      });
+}
+
+/**
+ * Round-robin over the pool.
+ */
+boost::asio::io_context &AsyncNetworkDriver::next_io_context() {
+  return *this->io_contexts[this->next_context++ % this->io_contexts.size()];
+}
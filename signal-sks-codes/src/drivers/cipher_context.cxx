@@ -0,0 +1,45 @@
+#include "../../include/drivers/cipher_context.hpp"
+
+using namespace CryptoPP;
+
+// Legacy suite key material: AES key, then HMAC key.
+static const size_t CBC_KEY_SIZE = AES::DEFAULT_KEYLENGTH;
+static const size_t HMAC_KEY_SIZE = SHA256::BLOCKSIZE;
+
+/**
+ * Bytes of HKDF output the suite needs.
+ */
+size_t CipherContext::key_material_size(CipherSuite::T suite) {
+  switch (suite) {
+  case CipherSuite::AES_CBC_HMAC_SHA256:
+    return CBC_KEY_SIZE + HMAC_KEY_SIZE;
+  case CipherSuite::AES_GCM:
+    return AES::DEFAULT_KEYLENGTH;
+  default:
+    return 32;
+  }
+}
+
+/**
+ * Sizes of a message's sealed fields under the suite: the IV, the ciphertext
+ * (padded for CBC, tag appended for AEAD suites) and the separate MAC, which
+ * AEAD suites leave empty.
+ */
+size_t CipherContext::iv_size(CipherSuite::T suite) {
+  if (suite == CipherSuite::AES_CBC_HMAC_SHA256)
+    return AES::BLOCKSIZE;
+  return AEAD_IV_SIZE;
+}
+
+size_t CipherContext::ciphertext_size(CipherSuite::T suite,
+                                      size_t plaintext_size) {
+  if (suite == CipherSuite::AES_CBC_HMAC_SHA256)
+    return plaintext_size - plaintext_size % AES::BLOCKSIZE + AES::BLOCKSIZE;
+  return plaintext_size + AEAD_TAG_SIZE;
+}
+
+size_t CipherContext::mac_size(CipherSuite::T suite) {
+  if (suite == CipherSuite::AES_CBC_HMAC_SHA256)
+    return SHA256::DIGESTSIZE;
+  return 0;
+}
@@ -1,3 +1,4 @@
+#include <cstring>
 #include <stdexcept>
 
 #include "../../include-shared/util.hpp"
@@ -6,67 +7,223 @@
 using namespace CryptoPP;
 
 /**
- * @brief Returns (p, q, g) DH parameters. This function should:
- * 1) Initialize a `CryptoPP::AutoSeededRandomPool` object
- *    and a `CryptoPP::PrimeAndGenerator` object.
- * 2) Generate a prime p, sub-prime q, and generator g
- *    using `CryptoPP::PrimeAndGenerator::Generate(...)`
- *    with a `delta` of 1, a `pbits` of 512, and a `qbits` of 511.
- * 3) Store and return the parameters in a `DHParams_Message` object.
- * @return `DHParams_Message` object that stores Diffie-Hellman parameters
+ * Fills output from the calling thread's DRBG.
  */
-DHParams_Message CryptoDriver::DH_generate_params() {
-  // TODO: implement me!
-  CryptoPP::AutoSeededRandomPool prg;
-  CryptoPP::PrimeAndGenerator pg;
-  CryptoPP::Integer p, q, g; 
-  pg.Generate(1, prg, 512, 511);
-  p = pg.Prime();
-  q = pg.SubPrime();
-  g = pg.Generator();
-  DHParams_Message params;
-  params.p = p;
-  params.q = q;
-  params.g = g;
-  return params;
-}
-
-/**
- * @brief Generate DH keypair. This function should
- * 1) Create a DH object and `SecByteBlock`s for the private and public keys.
- * Use `DH_obj.PrivateKeyLength()` and `PublicKeyLength()` to get key sizes.
- * 2) Generate a DH keypair using the `GenerateKeyPair(...)` method.
- * @param DH_params Diffie-Hellman parameters
- * @return Tuple containing DH object, private value, public value.
- */
-std::tuple<DH, SecByteBlock, SecByteBlock>
-CryptoDriver::DH_initialize(const DHParams_Message &DH_params) {
-  AutoSeededRandomPool prng;
-  DH dh(DH_params.p, DH_params.q, DH_params.g);
-  SecByteBlock t1(dh.PrivateKeyLength()), t2(dh.PublicKeyLength());
-  dh.GenerateKeyPair(prng, t1, t2);
-  std::tuple<DH, SecByteBlock, SecByteBlock> keys(dh, t1, t2);
-  return keys;
+void DRBGRandomPool::GenerateBlock(byte *output, size_t size) {
+  DRBG::generate(output, size);
 }
 
 /**
- * @brief Generates a shared secret. This function should
- * 1) Allocate space in a `SecByteBlock` of size `DH_obj.AgreedValueLength()`.
- * 2) Run `DH_obj.Agree(...)` to store the shared key in the allocated space.
- * 3) Throw an `std::runtime_error` if failed to agree.
- * @param DH_obj Diffie-Hellman object
- * @param DH_private_value user's private value for Diffie-Hellman
- * @param DH_other_public_value other user's public value for Diffie-Hellman
- * @return Diffie-Hellman shared key
+ * Parses a cipher suite name: "aes-gcm", "chacha20-poly1305" or the legacy
+ * "aes-cbc-hmac-sha256".
  */
-SecByteBlock CryptoDriver::DH_generate_shared_key(
-    const DH &DH_obj, const SecByteBlock &DH_private_value,
-    const SecByteBlock &DH_other_public_value) {
-  // TODO: implement me!
-  SecByteBlock sharedSec(DH_obj.AgreedValueLength());
-  if(!DH_obj.Agree(sharedSec, DH_private_value, DH_other_public_value))
+CipherSuite::T cipher_suite_from_name(const std::string &name) {
+  if (name == "aes-cbc-hmac-sha256")
+    return CipherSuite::AES_CBC_HMAC_SHA256;
+  if (name == "aes-gcm")
+    return CipherSuite::AES_GCM;
+  if (name == "chacha20-poly1305")
+    return CipherSuite::CHACHA20_POLY1305;
+  throw std::runtime_error("Unknown cipher suite " + name + ".");
+}
+
+/**
+ * Constructor. Prefers AES-GCM when the CPU has AES-NI and carry-less
+ * multiply, ChaCha20-Poly1305 otherwise.
+ */
+CryptoDriver::CryptoDriver() {
+  this->preferred_suite = CipherSuite::CHACHA20_POLY1305;
+#if CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X32 || CRYPTOPP_BOOL_X64
+  if (HasAESNI() && HasCLMUL())
+    this->preferred_suite = CipherSuite::AES_GCM;
+#endif
+}
+
+/**
+ * Constructor.
+ * @param preferred_suite cipher suite to advertise in the key exchange
+ */
+CryptoDriver::CryptoDriver(CipherSuite::T preferred_suite)
+    : preferred_suite(preferred_suite) {}
+
+/**
+ * @brief Generates an X25519 keypair for the classical half of the hybrid
+ * key exchange.
+ * @return Pair of public value, private value.
+ */
+std::pair<SecByteBlock, SecByteBlock> CryptoDriver::X25519_generate_keypair() {
+  DRBGRandomPool rng;
+  x25519 ecdh;
+  SecByteBlock public_value(x25519::PUBLIC_KEYLENGTH);
+  SecByteBlock private_value(x25519::SECRET_KEYLENGTH);
+  ecdh.GenerateKeyPair(rng, private_value, public_value);
+  return std::make_pair(public_value, private_value);
+}
+
+/**
+ * @brief Agrees on an X25519 shared key. Throws an `std::runtime_error` if
+ * the other public value has the wrong size or is a small-order point, which
+ * would force an all-zero result.
+ * @param private_value our X25519 private value
+ * @param other_public_value the other party's X25519 public value
+ * @return X25519 shared key
+ */
+SecByteBlock
+CryptoDriver::X25519_generate_shared_key(const SecByteBlock &private_value,
+                                         const SecByteBlock &other_public_value) {
+  if (other_public_value.size() != x25519::PUBLIC_KEYLENGTH)
+    throw std::runtime_error("Got an X25519 public value of the wrong size.");
+  x25519 ecdh;
+  SecByteBlock shared_key(x25519::SHARED_KEYLENGTH);
+  if (!ecdh.Agree(shared_key, private_value, other_public_value))
     throw std::runtime_error("Failed to reach shared secret");
-  return sharedSec;
+  return shared_key;
+}
+
+/**
+ * @brief Combines a classical and a post-quantum shared secret with HKDF, so
+ * the result stays secret as long as either one does.
+ * @param X25519_shared_key shared key from the X25519 exchange
+ * @param KEM_shared_secret shared secret from a Kyber encapsulation
+ * @return combined shared key
+ */
+SecByteBlock
+CryptoDriver::hybrid_shared_key(const SecByteBlock &X25519_shared_key,
+                                const SecByteBlock &KEM_shared_secret) {
+  std::string hybrid_salt_str("salt0005");
+  SecByteBlock hybrid_salt((const unsigned char *)(hybrid_salt_str.data()),
+                           hybrid_salt_str.size());
+  SecByteBlock input = KEM_shared_secret + X25519_shared_key;
+  SecByteBlock key(SHA256::DIGESTSIZE);
+  HKDF<SHA256> hkdf;
+  hkdf.DeriveKey(key, key.size(), input, input.size(), hybrid_salt,
+                 hybrid_salt.size(), NULL, 0);
+  return key;
+}
+
+/**
+ * @brief Derives the secret a session can later be resumed from. Kept apart
+ * from the handshake key itself, which only ever keys this session's chains.
+ * @param handshake_key the session's handshake key
+ * @return resumption secret
+ */
+SecByteBlock
+CryptoDriver::resumption_secret(const SecByteBlock &handshake_key) {
+  std::string resumption_salt_str("salt0006");
+  SecByteBlock resumption_salt(
+      (const unsigned char *)(resumption_salt_str.data()),
+      resumption_salt_str.size());
+  SecByteBlock secret(SHA256::DIGESTSIZE);
+  HKDF<SHA256> hkdf;
+  hkdf.DeriveKey(secret, secret.size(), handshake_key, handshake_key.size(),
+                 resumption_salt, resumption_salt.size(), NULL, 0);
+  return secret;
+}
+
+/**
+ * @brief Derives the handshake key of a resumed session: one HKDF step over
+ * the resumption secret, bound to both sides' fresh nonces so no two
+ * resumptions share keys.
+ * @param resumption_secret secret from the session being resumed
+ * @param nonces the client's nonce followed by the server's
+ * @return handshake key
+ */
+SecByteBlock
+CryptoDriver::resumed_handshake_key(const SecByteBlock &resumption_secret,
+                                    const SecByteBlock &nonces) {
+  std::string resumed_salt_str("salt0007");
+  SecByteBlock resumed_salt((const unsigned char *)(resumed_salt_str.data()),
+                            resumed_salt_str.size());
+  SecByteBlock key(SHA256::DIGESTSIZE);
+  HKDF<SHA256> hkdf;
+  hkdf.DeriveKey(key, key.size(), resumption_secret, resumption_secret.size(),
+                 resumed_salt, resumed_salt.size(), nonces, nonces.size());
+  return key;
+}
+
+/**
+ * @brief Binds the handshake key to what both sides offered in the key
+ * exchange. Offers are sent in the clear, so an attacker could rewrite them
+ * to push both sides onto a weaker suite; with them mixed in, sides that saw
+ * different offers derive different keys and the first message fails to
+ * open.
+ * @param handshake_key key agreed on in the key exchange
+ * @param offers both sides' offers, in an order both sides agree on
+ * @return bound handshake key
+ */
+SecByteBlock CryptoDriver::bind_offers(const SecByteBlock &handshake_key,
+                                       const SecByteBlock &offers) {
+  std::string offers_salt_str("salt0010");
+  SecByteBlock offers_salt((const unsigned char *)(offers_salt_str.data()),
+                           offers_salt_str.size());
+  SecByteBlock key(SHA256::DIGESTSIZE);
+  HKDF<SHA256> hkdf;
+  hkdf.DeriveKey(key, key.size(), handshake_key, handshake_key.size(),
+                 offers_salt, offers_salt.size(), offers, offers.size());
+  return key;
+}
+
+/**
+ * @brief Derives the key session tickets are sealed under from our long-term
+ * private key, so tickets survive a restart. HKDF under its own salt and
+ * label keeps it independent of every other use of that key.
+ * @param long_term_private_key our long-term private key
+ * @return ticket key
+ */
+SecByteBlock
+CryptoDriver::ticket_key(const SecByteBlock &long_term_private_key) {
+  std::string ticket_salt_str("salt0009");
+  SecByteBlock ticket_salt((const unsigned char *)(ticket_salt_str.data()),
+                           ticket_salt_str.size());
+  std::string ticket_info_str("ticket key");
+  SecByteBlock key(SHA256::DIGESTSIZE);
+  HKDF<SHA256> hkdf;
+  hkdf.DeriveKey(key, key.size(), long_term_private_key,
+                 long_term_private_key.size(), ticket_salt, ticket_salt.size(),
+                 (const unsigned char *)ticket_info_str.data(),
+                 ticket_info_str.size());
+  return key;
+}
+
+/**
+ * @brief One step of a symmetric ratchet chain: derives the key for the
+ * message at the chain's current position and the chain key for the next
+ * one. Once the old chain key is dropped, a later compromise cannot recover
+ * this message's key.
+ * @param chain_key current chain key
+ * @return next chain key and message key
+ */
+std::pair<SecByteBlock, SecByteBlock>
+CryptoDriver::chain_step(const SecByteBlock &chain_key) {
+  std::pair<SecByteBlock, SecByteBlock> keys(SecByteBlock(SHA256::DIGESTSIZE),
+                                             SecByteBlock(SHA256::DIGESTSIZE));
+  this->chain_step(bytes_of(chain_key), buffer_of(keys.first),
+                   buffer_of(keys.second));
+  return keys;
+}
+
+/**
+ * @brief Span form of chain_step. Both keys come out of one HKDF call into a
+ * buffer on the stack, so next_chain_key may be chain_key itself and the
+ * chain steps in place.
+ * @param chain_key current chain key
+ * @param next_chain_key 32 bytes for the next chain key
+ * @param message_key 32 bytes for the message key
+ */
+void CryptoDriver::chain_step(ByteView chain_key,
+                              MutableByteView next_chain_key,
+                              MutableByteView message_key) {
+  if (next_chain_key.size != SHA256::DIGESTSIZE ||
+      message_key.size != SHA256::DIGESTSIZE)
+    throw std::runtime_error("CryptoDriver chain step got a key buffer of the "
+                             "wrong size.");
+  static const std::string chain_salt("salt0008");
+  FixedSizeSecBlock<byte, 2 * SHA256::DIGESTSIZE> keys;
+  HKDF<SHA256> hkdf;
+  hkdf.DeriveKey(keys, keys.size(), chain_key.data, chain_key.size,
+                 (const byte *)chain_salt.data(), chain_salt.size(), NULL, 0);
+  std::memcpy(next_chain_key.data, keys, SHA256::DIGESTSIZE);
+  std::memcpy(message_key.data, keys + SHA256::DIGESTSIZE, SHA256::DIGESTSIZE);
 }
 
 /**
@@ -93,40 +250,64 @@ SecByteBlock CryptoDriver::AES_generate_key(const SecByteBlock &DH_shared_key) {
 }
 
 /**
- * @brief Encrypts the given plaintext. This function should:
- * 1) Initialize `CBC_Mode<AES>::Encryption` using GetNextIV and SetKeyWithIV.
- * 1.5) IV should be of size `AES::BLOCKSIZE`
- * 2) Run the plaintext through a `StreamTransformationFilter` using
- * the AES encryptor.
- * 3) Return ciphertext and iv used in encryption or throw an
- * `std::runtime_error`.
- * 4) Important tip: use .size() on a SecByteBlock instead of sizeof()
+ * Bytes of CBC ciphertext for a plaintext of the given size: PKCS #7 always
+ * adds between one byte and a whole block of padding.
+ */
+size_t CryptoDriver::AES_ciphertext_size(size_t plaintext_size) {
+  return plaintext_size - plaintext_size % AES::BLOCKSIZE + AES::BLOCKSIZE;
+}
+
+/**
+ * @brief Encrypts the given plaintext with AES-CBC under a fresh IV.
  * @param key AES key
  * @param plaintext text to encrypt
  * @return Pair of ciphertext and iv
  */
 std::pair<std::string, SecByteBlock>
-CryptoDriver::AES_encrypt(SecByteBlock key, std::string plaintext) {
+CryptoDriver::AES_encrypt(const SecByteBlock &key,
+                          const std::string &plaintext) {
+  SecByteBlock iv(AES::BLOCKSIZE);
+  std::string ciphertext(AES_ciphertext_size(plaintext.size()), '\0');
+  this->AES_encrypt(bytes_of(key), bytes_of(plaintext), buffer_of(iv),
+                    buffer_of(ciphertext));
+  return std::make_pair(ciphertext, iv);
+}
+
+/**
+ * @brief Span form of AES_encrypt. Pads by hand and runs whole blocks through
+ * ProcessData, straight into the caller's buffer, which may start at the
+ * plaintext to encrypt in place. Throws an
+ * `std::runtime_error` if a buffer has the wrong size or the key is invalid.
+ * @param key AES key
+ * @param plaintext text to encrypt
+ * @param iv AES::BLOCKSIZE bytes, filled with a fresh IV
+ * @param ciphertext at least AES_ciphertext_size(plaintext.size) bytes
+ * @return Bytes of ciphertext written
+ */
+size_t CryptoDriver::AES_encrypt(ByteView key, ByteView plaintext,
+                                 MutableByteView iv,
+                                 MutableByteView ciphertext) {
+  size_t size = AES_ciphertext_size(plaintext.size);
+  if (iv.size != AES::BLOCKSIZE || ciphertext.size < size)
+    throw std::runtime_error("CryptoDriver AES encryption got a buffer of the "
+                             "wrong size.");
   try {
-    // TODO: implement me!
-    //Step 1
+    DRBGRandomPool prng;
+    prng.GenerateBlock(iv.data, iv.size);
     CBC_Mode<AES>::Encryption enc;
-    SecByteBlock iv(AES::BLOCKSIZE);
-
-    AutoSeededRandomPool prng;
-    enc.GetNextIV(prng, iv);
-
-    enc.SetKeyWithIV(key, key.size(), iv);
-
-    //Step 2
-    std::string ciphertext;
-    StringSource s(plaintext, true, 
-        new StreamTransformationFilter(enc,
-            new StringSink(ciphertext)
-        )
-    );
-    return std::make_pair(ciphertext, iv);
+    enc.SetKeyWithIV(key.data, key.size, iv.data);
 
+    // PKCS #7 padding on a copy of the last, partial block.
+    size_t full = size - AES::BLOCKSIZE;
+    size_t pad = AES::BLOCKSIZE - plaintext.size % AES::BLOCKSIZE;
+    FixedSizeSecBlock<byte, AES::BLOCKSIZE> last;
+    if (pad < AES::BLOCKSIZE)
+      std::memcpy(last, plaintext.data + full, AES::BLOCKSIZE - pad);
+    std::memset(last + AES::BLOCKSIZE - pad, pad, pad);
+    if (full > 0)
+      enc.ProcessData(ciphertext.data, plaintext.data, full);
+    enc.ProcessData(ciphertext.data + full, last, AES::BLOCKSIZE);
+    return size;
   } catch (CryptoPP::Exception &e) {
     std::cerr << e.what() << std::endl;
     std::cerr << "This function was likely called with an incorrect shared key."
@@ -136,36 +317,57 @@ CryptoDriver::AES_encrypt(SecByteBlock key, std::string plaintext) {
 }
 
 /**
- * @brief Decrypts the given ciphertext, encoded as a hex string. This function
- * should:
- * 1) Initialize `CBC_Mode<AES>::Decryption` using `SetKeyWithIV` on the key and
- * iv. 2) Run the decoded ciphertext through a `StreamTransformationFilter`
- * using the AES decryptor.
- * 3) Return the plaintext or throw an `std::runtime_error`.
- * 4) Important tip: use .size() on a SecByteBlock instead of sizeof()
+ * @brief Decrypts the given AES-CBC ciphertext. Throws an
+ * `std::runtime_error` if it is malformed or its padding is invalid.
  * @param key AES key
  * @param iv iv used in encryption
  * @param ciphertext text to decrypt
  * @return decrypted message
  */
-std::string CryptoDriver::AES_decrypt(SecByteBlock key, SecByteBlock iv,
-                                      std::string ciphertext) {
+std::string CryptoDriver::AES_decrypt(const SecByteBlock &key,
+                                      const SecByteBlock &iv,
+                                      const std::string &ciphertext) {
+  std::string plaintext(ciphertext.size(), '\0');
+  plaintext.resize(this->AES_decrypt(bytes_of(key), bytes_of(iv),
+                                     bytes_of(ciphertext),
+                                     buffer_of(plaintext)));
+  return plaintext;
+}
+
+/**
+ * @brief Span form of AES_decrypt. Decrypts with ProcessData into the
+ * caller's buffer, which may be the ciphertext itself, then checks and strips
+ * the padding.
+ * @param key AES key
+ * @param iv iv used in encryption
+ * @param ciphertext text to decrypt, a whole number of blocks
+ * @param plaintext at least ciphertext.size bytes
+ * @return Bytes of plaintext, padding removed
+ */
+size_t CryptoDriver::AES_decrypt(ByteView key, ByteView iv,
+                                 ByteView ciphertext,
+                                 MutableByteView plaintext) {
+  if (iv.size != AES::BLOCKSIZE || ciphertext.size == 0 ||
+      ciphertext.size % AES::BLOCKSIZE != 0 ||
+      plaintext.size < ciphertext.size)
+    throw std::runtime_error("CryptoDriver AES decryption failed.");
   try {
-    CBC_Mode< AES >::Decryption d;
-    d.SetKeyWithIV(key, key.size(), iv);
-    std::string plaintext;
-    StringSource s(ciphertext, true, 
-        new StreamTransformationFilter(d,
-            new StringSink(plaintext)
-        ) // StreamTransformationFilter
-    ); // StringSource
-    return plaintext;
+    CBC_Mode<AES>::Decryption dec;
+    dec.SetKeyWithIV(key.data, key.size, iv.data);
+    dec.ProcessData(plaintext.data, ciphertext.data, ciphertext.size);
   } catch (CryptoPP::Exception &e) {
     std::cerr << e.what() << std::endl;
     std::cerr << "This function was likely called with an incorrect shared key."
               << std::endl;
     throw std::runtime_error("CryptoDriver AES decryption failed.");
   }
+  size_t pad = plaintext.data[ciphertext.size - 1];
+  bool valid = pad > 0 && pad <= AES::BLOCKSIZE;
+  for (size_t i = 1; valid && i < pad; i++)
+    valid = plaintext.data[ciphertext.size - 1 - i] == pad;
+  if (!valid)
+    throw std::runtime_error("CryptoDriver AES decryption failed.");
+  return ciphertext.size - pad;
 }
 
 /**
@@ -192,25 +394,37 @@ CryptoDriver::HMAC_generate_key(const SecByteBlock &DH_shared_key) {
 }
 
 /**
- * @brief Given a ciphertext, generates an HMAC. This function should
- * 1) Initialize an HMAC<SHA256> with the provided key.
- * 2) Run the ciphertext through a `HashFilter` to generate an HMAC.
- * 3) Throw `std::runtime_error` upon failure.
+ * @brief Given a ciphertext, generates an HMAC-SHA256 tag.
  * @param key HMAC key
  * @param ciphertext message to tag
  * @return HMAC (Hashed Message Authentication Code)
  */
-std::string CryptoDriver::HMAC_generate(SecByteBlock key,
-                                        std::string ciphertext) {
+std::string CryptoDriver::HMAC_generate(const SecByteBlock &key,
+                                        const std::string &ciphertext) {
+  std::string mac(SHA256::DIGESTSIZE, '\0');
+  this->HMAC_generate(bytes_of(key), {bytes_of(ciphertext)}, buffer_of(mac));
+  return mac;
+}
+
+/**
+ * @brief Span form of HMAC_generate. The message may come in parts, which are
+ * fed to Update in order, so the caller never concatenates them. Throws an
+ * `std::runtime_error` upon failure.
+ * @param key HMAC key
+ * @param message parts of the message to tag
+ * @param mac SHA256::DIGESTSIZE bytes for the tag
+ */
+void CryptoDriver::HMAC_generate(ByteView key,
+                                 std::initializer_list<ByteView> message,
+                                 MutableByteView mac) {
+  if (mac.size != SHA256::DIGESTSIZE)
+    throw std::runtime_error("CryptoDriver HMAC generation got a buffer of the "
+                             "wrong size.");
   try {
-     HMAC<SHA256> hmac(key, key.size());
-     std::string result;
-     StringSource ss2(ciphertext, true, 
-        new HashFilter(hmac,
-            new StringSink(result)
-        )
-    );
-    return result;
+    HMAC<SHA256> hmac(key.data, key.size);
+    for (const ByteView &part : message)
+      hmac.Update(part.data, part.size);
+    hmac.Final(mac.data);
   } catch (const CryptoPP::Exception &e) {
     std::cerr << e.what() << std::endl;
     throw std::runtime_error("CryptoDriver HMAC generation failed.");
@@ -218,41 +432,274 @@ std::string CryptoDriver::HMAC_generate(SecByteBlock key,
 }
 
 /**
- * @brief Given a message and MAC, checks if the MAC is valid. This function
- * should 1) Initialize an `HMAC<SHA256>` with the provided key. 2) Run the
- * message through a `HashVerificationFilter` to verify the HMAC. 3) Return
- * false upon failure.
+ * @brief Given a message and MAC, checks if the MAC is valid.
  * @param key HMAC key
  * @param ciphertext message to verify
  * @param mac associated MAC
  * @return true if MAC is valid, else false
  */
-bool CryptoDriver::HMAC_verify(SecByteBlock key, std::string ciphertext,
-                               std::string mac) {
-  const int flags = HashVerificationFilter::THROW_EXCEPTION |
-                    HashVerificationFilter::HASH_AT_END;
-  // TODO: implement me!
-  HMAC<SHA256> hmac(key, key.size());
-  try{
-    StringSource(ciphertext + mac, true, 
-          new HashVerificationFilter(hmac, NULL, flags)
-    ); // StringSource
-    return true;
+bool CryptoDriver::HMAC_verify(const SecByteBlock &key,
+                               const std::string &ciphertext,
+                               const std::string &mac) {
+  return this->HMAC_verify(bytes_of(key), {bytes_of(ciphertext)},
+                           bytes_of(mac));
+}
+
+/**
+ * @brief Span form of HMAC_verify. Compares in constant time.
+ * @param key HMAC key
+ * @param message parts of the message to verify, in order
+ * @param mac associated MAC
+ * @return true if MAC is valid, else false
+ */
+bool CryptoDriver::HMAC_verify(ByteView key,
+                               std::initializer_list<ByteView> message,
+                               ByteView mac) {
+  if (mac.size != SHA256::DIGESTSIZE)
+    return false;
+  try {
+    HMAC<SHA256> hmac(key.data, key.size);
+    for (const ByteView &part : message)
+      hmac.Update(part.data, part.size);
+    return hmac.Verify(mac.data);
+  } catch (const CryptoPP::Exception &e) {
+    return false;
   }
-  catch(const CryptoPP::Exception& e){
+}
+
+/**
+ * @brief The cipher suite to advertise in the key exchange.
+ * @return preferred cipher suite
+ */
+CipherSuite::T CryptoDriver::AEAD_preferred_suite() {
+  return this->preferred_suite;
+}
+
+/**
+ * @brief Agrees on a cipher suite from both parties' preferences. Both sides
+ * run this with the same inputs, so they reach the same answer. The legacy
+ * suite is only used if both sides ask for it.
+ * @param ours suite we advertised
+ * @param theirs suite the other party advertised
+ * @return cipher suite to use
+ */
+CipherSuite::T CryptoDriver::AEAD_negotiate_suite(CipherSuite::T ours,
+                                                  CipherSuite::T theirs) {
+  if (ours == theirs)
+    return ours;
+  // One side lacks AES-NI; ChaCha20-Poly1305 is fast in software everywhere.
+  return CipherSuite::CHACHA20_POLY1305;
+}
+
+/**
+ * @brief Generates an AEAD key using HKDF with a salt.
+ * @param DH_shared_key shared key from the key exchange
+ * @param suite AES_GCM (16-byte key) or CHACHA20_POLY1305 (32-byte key)
+ * @return AEAD key
+ */
+SecByteBlock CryptoDriver::AEAD_generate_key(const SecByteBlock &DH_shared_key,
+                                             CipherSuite::T suite) {
+  std::string aead_salt_str("salt0002");
+  SecByteBlock aead_salt((const unsigned char *)(aead_salt_str.data()),
+                         aead_salt_str.size());
+  SecByteBlock key(suite == CipherSuite::AES_GCM ? AES::DEFAULT_KEYLENGTH
+                                                 : 32);
+  HKDF<SHA256> hkdf;
+  hkdf.DeriveKey(key, key.size(), DH_shared_key, DH_shared_key.size(),
+                 aead_salt, aead_salt.size(), NULL, 0);
+  return key;
+}
+
+/**
+ * @brief Encrypts and authenticates the plaintext in one pass. The nonce is
+ * authenticated by the AEAD itself; associated_data covers the rest of the
+ * message header.
+ * @param suite AES_GCM or CHACHA20_POLY1305
+ * @param key AEAD key
+ * @param plaintext text to encrypt
+ * @param associated_data header bytes to authenticate but not encrypt
+ * @return Pair of ciphertext (with the 16-byte tag appended) and nonce
+ */
+std::pair<std::string, SecByteBlock>
+CryptoDriver::AEAD_encrypt(CipherSuite::T suite, const SecByteBlock &key,
+                           const std::string &plaintext,
+                           const std::string &associated_data) {
+  SecByteBlock iv(AEAD_IV_SIZE);
+  std::string ciphertext(plaintext.size() + AEAD_TAG_SIZE, '\0');
+  this->AEAD_encrypt(suite, bytes_of(key), bytes_of(plaintext),
+                     bytes_of(associated_data), buffer_of(iv),
+                     buffer_of(ciphertext));
+  return std::make_pair(ciphertext, iv);
+}
+
+/**
+ * @brief Span form of AEAD_encrypt, straight into the caller's buffers. The
+ * ciphertext may start at the plaintext to encrypt in place.
+ * @param suite AES_GCM or CHACHA20_POLY1305
+ * @param key AEAD key
+ * @param plaintext text to encrypt
+ * @param associated_data header bytes to authenticate but not encrypt
+ * @param iv AEAD_IV_SIZE bytes, filled with a fresh nonce
+ * @param ciphertext plaintext.size + AEAD_TAG_SIZE bytes, for the ciphertext
+ * and then the tag
+ */
+void CryptoDriver::AEAD_encrypt(CipherSuite::T suite, ByteView key,
+                                ByteView plaintext, ByteView associated_data,
+                                MutableByteView iv,
+                                MutableByteView ciphertext) {
+  if (iv.size != AEAD_IV_SIZE ||
+      ciphertext.size != plaintext.size + AEAD_TAG_SIZE)
+    throw std::runtime_error("CryptoDriver AEAD encryption got a buffer of the "
+                             "wrong size.");
+  try {
+    DRBGRandomPool prng;
+    prng.GenerateBlock(iv.data, iv.size);
+    byte *tag = ciphertext.data + plaintext.size;
+    if (suite == CipherSuite::AES_GCM) {
+      GCM<AES>::Encryption enc;
+      enc.SetKeyWithIV(key.data, key.size, iv.data, iv.size);
+      enc.EncryptAndAuthenticate(ciphertext.data, tag, AEAD_TAG_SIZE, iv.data,
+                                 iv.size, associated_data.data,
+                                 associated_data.size, plaintext.data,
+                                 plaintext.size);
+    } else {
+      ChaCha20Poly1305::Encryption enc;
+      enc.SetKeyWithIV(key.data, key.size, iv.data, iv.size);
+      enc.EncryptAndAuthenticate(ciphertext.data, tag, AEAD_TAG_SIZE, iv.data,
+                                 iv.size, associated_data.data,
+                                 associated_data.size, plaintext.data,
+                                 plaintext.size);
+    }
+  } catch (CryptoPP::Exception &e) {
+    std::cerr << e.what() << std::endl;
+    throw std::runtime_error("CryptoDriver AEAD encryption failed.");
+  }
+}
+
+/**
+ * @brief Decrypts and verifies the ciphertext in one pass.
+ * @param suite AES_GCM or CHACHA20_POLY1305
+ * @param key AEAD key
+ * @param iv nonce used in encryption
+ * @param ciphertext ciphertext with the tag appended
+ * @param associated_data header bytes that were authenticated
+ * @return Pair of plaintext and whether the tag was valid
+ */
+std::pair<std::string, bool>
+CryptoDriver::AEAD_decrypt(CipherSuite::T suite, const SecByteBlock &key,
+                           const SecByteBlock &iv,
+                           const std::string &ciphertext,
+                           const std::string &associated_data) {
+  if (ciphertext.size() < AEAD_TAG_SIZE)
+    return std::make_pair(std::string(), false);
+  std::string plaintext(ciphertext.size() - AEAD_TAG_SIZE, '\0');
+  if (!this->AEAD_decrypt(suite, bytes_of(key), bytes_of(iv),
+                          bytes_of(ciphertext), bytes_of(associated_data),
+                          buffer_of(plaintext)))
+    return std::make_pair(std::string(), false);
+  return std::make_pair(plaintext, true);
+}
+
+/**
+ * @brief Span form of AEAD_decrypt, straight into the caller's buffer, which
+ * may start at the ciphertext to decrypt in place. Its contents are
+ * unspecified unless the tag verified.
+ * @param suite AES_GCM or CHACHA20_POLY1305
+ * @param key AEAD key
+ * @param iv nonce used in encryption
+ * @param ciphertext ciphertext with the tag appended
+ * @param associated_data header bytes that were authenticated
+ * @param plaintext ciphertext.size - AEAD_TAG_SIZE bytes
+ * @return whether the tag was valid
+ */
+bool CryptoDriver::AEAD_decrypt(CipherSuite::T suite, ByteView key,
+                                ByteView iv, ByteView ciphertext,
+                                ByteView associated_data,
+                                MutableByteView plaintext) {
+  if (iv.size != AEAD_IV_SIZE || ciphertext.size < AEAD_TAG_SIZE ||
+      plaintext.size != ciphertext.size - AEAD_TAG_SIZE)
+    return false;
+  try {
+    const byte *tag = ciphertext.data + plaintext.size;
+    if (suite == CipherSuite::AES_GCM) {
+      GCM<AES>::Decryption dec;
+      dec.SetKeyWithIV(key.data, key.size, iv.data, iv.size);
+      return dec.DecryptAndVerify(plaintext.data, tag, AEAD_TAG_SIZE, iv.data,
+                                  iv.size, associated_data.data,
+                                  associated_data.size, ciphertext.data,
+                                  plaintext.size);
+    }
+    ChaCha20Poly1305::Decryption dec;
+    dec.SetKeyWithIV(key.data, key.size, iv.data, iv.size);
+    return dec.DecryptAndVerify(plaintext.data, tag, AEAD_TAG_SIZE, iv.data,
+                                iv.size, associated_data.data,
+                                associated_data.size, ciphertext.data,
+                                plaintext.size);
+  } catch (CryptoPP::Exception &e) {
     return false;
   }
 }
 
+/**
+ * @brief Derives the keys to seal one message with, into the caller's
+ * buffer.
+ * @param DH_shared_key message key from the ratchet chain
+ * @param key_material CipherContext::key_material_size(suite) bytes
+ */
+void CryptoDriver::CipherContext_derive_keys(ByteView DH_shared_key,
+                                             MutableByteView key_material) {
+  static const std::string context_salt("salt0003");
+  HKDF<SHA256> hkdf;
+  hkdf.DeriveKey(key_material.data, key_material.size, DH_shared_key.data,
+                 DH_shared_key.size, (const byte *)context_salt.data(),
+                 context_salt.size(), NULL, 0);
+}
+
+/**
+ * @brief Derives the keys one relay shares with a circuit's origin.
+ * @param shared_secret KEM shared secret from the CREATE/EXTEND handshake
+ * @return Keyed onion layer
+ */
+std::shared_ptr<OnionLayer>
+CryptoDriver::OnionLayer_generate(const SecByteBlock &shared_secret) {
+  std::string onion_salt_str("salt0004");
+  SecByteBlock onion_salt((const unsigned char *)(onion_salt_str.data()),
+                          onion_salt_str.size());
+  SecByteBlock key_material(OnionLayer::KEY_MATERIAL_SIZE);
+  HKDF<SHA256> hkdf;
+  hkdf.DeriveKey(key_material, key_material.size(), shared_secret,
+                 shared_secret.size(), onion_salt, onion_salt.size(), NULL, 0);
+  try {
+    return std::make_shared<OnionLayer>(key_material);
+  } catch (CryptoPP::Exception &e) {
+    std::cerr << e.what() << std::endl;
+    throw std::runtime_error("CryptoDriver could not key an onion layer.");
+  }
+}
+
 /**
  * @brief Generates a SHA-256 hash of msg.
  */
-CryptoPP::SecByteBlock CryptoDriver::hash(CryptoPP::SecByteBlock msg) {
-  SHA256 hash;
-  std::string encodedHex;
-  HexEncoder encoder(new StringSink(encodedHex));
+CryptoPP::SecByteBlock CryptoDriver::hash(const CryptoPP::SecByteBlock &msg) {
+  SecByteBlock digest(SHA256::DIGESTSIZE);
+  this->hash({bytes_of(msg)}, buffer_of(digest));
+  return digest;
+}
 
-  // Compute hash
-  StringSource(byteblock_to_string(msg), true, new HashFilter(hash, new StringSink(encodedHex)));
-  return string_to_byteblock(encodedHex);
+/**
+ * @brief Span form of hash. The message may come in parts, hashed in order
+ * without concatenating them. A digest buffer shorter than
+ * SHA256::DIGESTSIZE gets the digest truncated to its size.
+ * @param msg parts of the message
+ * @param digest at most SHA256::DIGESTSIZE bytes
+ */
+void CryptoDriver::hash(std::initializer_list<ByteView> msg,
+                        MutableByteView digest) {
+  if (digest.size > SHA256::DIGESTSIZE)
+    throw std::runtime_error("CryptoDriver hash got a digest buffer that is "
+                             "too large.");
+  SHA256 hash;
+  for (const ByteView &part : msg)
+    hash.Update(part.data, part.size);
+  hash.TruncatedFinal(digest.data, digest.size);
 }
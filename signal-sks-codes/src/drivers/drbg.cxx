@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "../../include/drivers/drbg.hpp"
+
+extern "C" {
+#include "../../kyber/ref/fips202.h"
+#include "../../kyber/ref/randombytes.h"
+}
+
+// Output buffered per refill; the first SEED_SIZE bytes become the next key.
+static const size_t BUFFER_BLOCKS = 16;
+
+struct DRBGState {
+  keccak_state state;
+  uint8_t buffer[BUFFER_BLOCKS * SHAKE256_RATE];
+  size_t pos = sizeof(buffer);
+  size_t since_reseed = 0;
+  uint64_t generation = 0;
+  bool seeded = false;
+  ~DRBGState();
+};
+
+static thread_local DRBGState local;
+
+// Bumped in the child after fork(); a thread whose state carries an older
+// value reseeds before producing output, so parent and child never share a
+// stream.
+static std::atomic<uint64_t> fork_generation(1);
+static std::once_flag atfork_once;
+
+/**
+ * Zeroes memory in a way the compiler cannot drop as a dead store.
+ */
+static void wipe(void *p, size_t len) {
+  volatile uint8_t *v = (volatile uint8_t *)p;
+  while (len--)
+    *v++ = 0;
+}
+
+DRBGState::~DRBGState() {
+  wipe(&this->state, sizeof(this->state));
+  wipe(this->buffer, sizeof(this->buffer));
+}
+
+static void on_fork_child() {
+  fork_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Reads seed material from the OS. Aborts on failure, like the randombytes()
+ * it replaces, since callers include C code that cannot take exceptions.
+ */
+static void os_entropy(uint8_t *out, size_t outlen) {
+#if defined(__linux__) && defined(SYS_getrandom)
+  while (outlen > 0) {
+    ssize_t ret = syscall(SYS_getrandom, out, outlen, 0);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    else if (ret == -1)
+      abort();
+    out += ret;
+    outlen -= ret;
+  }
+#else
+  int fd;
+  while ((fd = open("/dev/urandom", O_RDONLY)) == -1)
+    if (errno != EINTR)
+      abort();
+  while (outlen > 0) {
+    ssize_t ret = read(fd, out, outlen);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    else if (ret == -1)
+      abort();
+    out += ret;
+    outlen -= ret;
+  }
+  close(fd);
+#endif
+}
+
+/**
+ * Replaces the sponge state with SHAKE256 absorbing key.
+ */
+static void rekey(DRBGState &s, const uint8_t *key, size_t keylen) {
+  shake256_init(&s.state);
+  shake256_absorb(&s.state, key, keylen);
+  shake256_finalize(&s.state);
+}
+
+/**
+ * Mixes fresh OS entropy with the current state and drops buffered output.
+ */
+static void seed(DRBGState &s) {
+  std::call_once(atfork_once,
+                 []() { pthread_atfork(NULL, NULL, on_fork_child); });
+  uint8_t material[2 * DRBG::SEED_SIZE];
+  os_entropy(material, DRBG::SEED_SIZE);
+  size_t length = DRBG::SEED_SIZE;
+  if (s.seeded) {
+    shake256_squeeze(material + DRBG::SEED_SIZE, DRBG::SEED_SIZE, &s.state);
+    length += DRBG::SEED_SIZE;
+  }
+  rekey(s, material, length);
+  wipe(material, sizeof(material));
+  wipe(s.buffer, sizeof(s.buffer));
+  s.pos = sizeof(s.buffer);
+  s.since_reseed = 0;
+  s.generation = fork_generation.load(std::memory_order_relaxed);
+  s.seeded = true;
+}
+
+/**
+ * Squeezes a full buffer and immediately re-keys from its head, so the state
+ * left behind cannot regenerate anything already handed out.
+ */
+static void refill(DRBGState &s) {
+  shake256_squeezeblocks(s.buffer, BUFFER_BLOCKS, &s.state);
+  rekey(s, s.buffer, DRBG::SEED_SIZE);
+  wipe(s.buffer, DRBG::SEED_SIZE);
+  s.pos = DRBG::SEED_SIZE;
+}
+
+/**
+ * @brief Fills out with random bytes from the calling thread's generator.
+ * @param out destination
+ * @param outlen number of bytes
+ */
+void DRBG::generate(uint8_t *out, size_t outlen) {
+  DRBGState &s = local;
+  if (s.generation != fork_generation.load(std::memory_order_relaxed) ||
+      s.since_reseed >= RESEED_INTERVAL)
+    seed(s);
+  s.since_reseed += outlen;
+  while (outlen > 0) {
+    if (s.pos == sizeof(s.buffer))
+      refill(s);
+    size_t n = std::min(outlen, sizeof(s.buffer) - s.pos);
+    std::memcpy(out, s.buffer + s.pos, n);
+    wipe(s.buffer + s.pos, n);
+    s.pos += n;
+    out += n;
+    outlen -= n;
+  }
+}
+
+/**
+ * Forces the calling thread's generator to reseed from the OS.
+ */
+void DRBG::reseed() { seed(local); }
+
+/**
+ * The randombytes() that the Kyber backends call, served from the DRBG.
+ */
+extern "C" void randombytes(uint8_t *out, size_t outlen) {
+  DRBG::generate(out, outlen);
+}
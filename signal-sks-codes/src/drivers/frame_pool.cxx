@@ -0,0 +1,131 @@
+#include <stdexcept>
+#include <utility>
+
+#include "../../include/drivers/frame_pool.hpp"
+
+/**
+ * Wraps a vector that came from no pool.
+ */
+FrameBuffer::FrameBuffer(std::vector<unsigned char> bytes)
+    : buffer(std::move(bytes)) {
+  this->length = this->buffer.size();
+}
+
+FrameBuffer::FrameBuffer(FrameBuffer &&other) noexcept
+    : pool(std::move(other.pool)), slab(other.slab),
+      buffer(std::move(other.buffer)), length(other.length) {
+  other.length = 0;
+}
+
+FrameBuffer &FrameBuffer::operator=(FrameBuffer &&other) noexcept {
+  if (this != &other) {
+    this->release();
+    this->pool = std::move(other.pool);
+    this->slab = other.slab;
+    this->buffer = std::move(other.buffer);
+    this->length = other.length;
+    other.length = 0;
+  }
+  return *this;
+}
+
+FrameBuffer::~FrameBuffer() { this->release(); }
+
+/**
+ * The frame's bytes; the buffer behind them may be larger.
+ */
+unsigned char *FrameBuffer::data() { return this->buffer.data(); }
+
+size_t FrameBuffer::size() const { return this->length; }
+
+MutableByteView FrameBuffer::view() {
+  return MutableByteView{this->buffer.data(), this->length};
+}
+
+/**
+ * Hands the buffer back to its pool, if it has one.
+ */
+void FrameBuffer::release() {
+  if (this->pool)
+    this->pool->give_back(this->slab, this->buffer);
+  this->pool.reset();
+  this->buffer = std::vector<unsigned char>();
+  this->length = 0;
+}
+
+/**
+ * Constructor. Buffers are allocated as frames need them, not up front; only
+ * the spare lists are sized here, so giving a buffer back never allocates.
+ * @param max_frame_size largest frame take() accepts
+ * @param spares_per_class buffers kept for reuse in each slab class
+ */
+FramePool::FramePool(size_t max_frame_size, size_t spares_per_class)
+    : max_size(max_frame_size), spares_per_class(spares_per_class) {
+  this->slabs.resize(this->slab_of(max_frame_size) + 1);
+  for (std::vector<std::vector<unsigned char>> &slab : this->slabs)
+    slab.reserve(spares_per_class);
+}
+
+/**
+ * @brief Lends out a buffer for a frame of the given size, reusing a spare
+ * one from its slab class if there is one.
+ * @param size bytes in the frame, as announced by the peer
+ * @return Frame of that size; its contents are whatever the buffer last held.
+ * @throws std::runtime_error if size is over the maximum frame size.
+ */
+FrameBuffer FramePool::take(size_t size) {
+  if (size > this->max_size)
+    throw std::runtime_error("Frame exceeds the maximum frame size.");
+  FrameBuffer frame;
+  frame.slab = this->slab_of(size);
+  {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    std::vector<std::vector<unsigned char>> &spare = this->slabs[frame.slab];
+    if (!spare.empty()) {
+      frame.buffer = std::move(spare.back());
+      spare.pop_back();
+    }
+  }
+  if (frame.buffer.empty())
+    frame.buffer.resize(MIN_SLAB_SIZE << frame.slab);
+  frame.length = size;
+  frame.pool = shared_from_this();
+  return frame;
+}
+
+/**
+ * The largest frame take() accepts.
+ */
+size_t FramePool::max_frame_size() const { return this->max_size; }
+
+/**
+ * Buffers waiting for reuse, across all classes.
+ */
+size_t FramePool::spares() {
+  std::lock_guard<std::mutex> lock(this->mtx);
+  size_t count = 0;
+  for (const std::vector<std::vector<unsigned char>> &slab : this->slabs)
+    count += slab.size();
+  return count;
+}
+
+/**
+ * The smallest slab class a frame of this size fits in.
+ */
+size_t FramePool::slab_of(size_t size) const {
+  size_t slab = 0;
+  while ((MIN_SLAB_SIZE << slab) < size)
+    slab++;
+  return slab;
+}
+
+/**
+ * Keeps a released buffer for reuse, or frees it if its class has all the
+ * spares it may keep.
+ */
+void FramePool::give_back(size_t slab, std::vector<unsigned char> &buffer) {
+  std::lock_guard<std::mutex> lock(this->mtx);
+  std::vector<std::vector<unsigned char>> &spare = this->slabs[slab];
+  if (spare.size() < this->spares_per_class)
+    spare.push_back(std::move(buffer));
+}
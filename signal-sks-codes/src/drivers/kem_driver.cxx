@@ -0,0 +1,372 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "../../include/drivers/kem_driver.hpp"
+
+extern "C" {
+#include "../../kyber/ref/api.h"
+#ifdef KYBER_AVX2
+// Both backends ship an api.h behind the same include guard.
+#undef API_H
+#include "../../kyber/avx2/api.h"
+#endif
+}
+
+// Sizes depend only on the parameter set, not on the symmetric primitives.
+#define KYBER_SIZES(sizes)                                                     \
+  pqcrystals_##sizes##_PUBLICKEYBYTES, pqcrystals_##sizes##_SECRETKEYBYTES,    \
+      pqcrystals_##sizes##_CIPHERTEXTBYTES, pqcrystals_##sizes##_BYTES
+
+#define KYBER_FUNCTIONS(impl, set)                                             \
+  pqcrystals_##set##_##impl##_keypair, pqcrystals_##set##_##impl##_enc,        \
+      pqcrystals_##set##_##impl##_dec,                                         \
+      pqcrystals_##set##_##impl##_kex_ake_initA,                               \
+      pqcrystals_##set##_##impl##_kex_ake_sharedB,                             \
+      pqcrystals_##set##_##impl##_kex_ake_sharedA
+
+#define KYBER_BACKEND(impl, set, sizes, algorithm)                             \
+  {                                                                            \
+    #impl, algorithm, KYBER_SIZES(sizes), KYBER_FUNCTIONS(impl, set), nullptr, \
+        nullptr, nullptr                                                       \
+  }
+
+#define KYBER_BACKEND_X4(impl, set, sizes, algorithm)                          \
+  {                                                                            \
+    #impl, algorithm, KYBER_SIZES(sizes), KYBER_FUNCTIONS(impl, set),          \
+        pqcrystals_##set##_##impl##_keypair_x4,                                \
+        pqcrystals_##set##_##impl##_enc_x4, pqcrystals_##set##_##impl##_dec_x4 \
+  }
+
+// Indexed by KEMParams::T - 1.
+static const KEMBackend ref_backends[] = {
+    KYBER_BACKEND(ref, kyber512, kyber512, "Kyber512"),
+    KYBER_BACKEND(ref, kyber768, kyber768, "Kyber768"),
+    KYBER_BACKEND(ref, kyber1024, kyber1024, "Kyber1024"),
+    KYBER_BACKEND(ref, kyber512_90s, kyber512, "Kyber512-90s"),
+    KYBER_BACKEND(ref, kyber768_90s, kyber768, "Kyber768-90s"),
+    KYBER_BACKEND(ref, kyber1024_90s, kyber1024, "Kyber1024-90s"),
+};
+
+#ifdef KYBER_AVX2
+static const KEMBackend avx2_backends[] = {
+    KYBER_BACKEND_X4(avx2, kyber512, kyber512, "Kyber512"),
+    KYBER_BACKEND_X4(avx2, kyber768, kyber768, "Kyber768"),
+    KYBER_BACKEND_X4(avx2, kyber1024, kyber1024, "Kyber1024"),
+    KYBER_BACKEND(avx2, kyber512_90s, kyber512, "Kyber512-90s"),
+    KYBER_BACKEND(avx2, kyber768_90s, kyber768, "Kyber768-90s"),
+    KYBER_BACKEND(avx2, kyber1024_90s, kyber1024, "Kyber1024-90s"),
+};
+
+/**
+ * True if the CPU (and OS, for the YMM state) supports everything the AVX2
+ * backend was compiled with. The 90s variants also need AES-NI.
+ */
+static bool cpu_has_avx2(bool nineties) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2") &&
+         __builtin_cpu_supports("popcnt") &&
+         (!nineties || __builtin_cpu_supports("aes"));
+}
+#endif
+
+static const size_t KEM_PARAMS_COUNT =
+    sizeof(ref_backends) / sizeof(ref_backends[0]);
+
+static bool kem_params_nineties(KEMParams::T params) {
+  return params >= KEMParams::KYBER512_90S;
+}
+
+/**
+ * True if `params` names a parameter set, e.g. one read off the wire.
+ */
+bool kem_params_valid(int params) {
+  return params >= 1 && params <= (int)KEM_PARAMS_COUNT;
+}
+
+/**
+ * Parses a parameter set name such as "kyber768" or "kyber512-90s".
+ */
+KEMParams::T kem_params_from_name(const std::string &name) {
+  for (size_t i = 0; i < KEM_PARAMS_COUNT; i++) {
+    std::string algorithm = ref_backends[i].algorithm;
+    std::transform(algorithm.begin(), algorithm.end(), algorithm.begin(),
+                   ::tolower);
+    if (algorithm == name)
+      return (KEMParams::T)(i + 1);
+  }
+  throw std::runtime_error("Unknown Kyber parameter set " + name + ".");
+}
+
+/**
+ * Settles on one parameter set from both sides' preferences: the stronger of
+ * the two security levels, with the 90s primitives only if both sides asked
+ * for them (the other side may lack AES-NI). Symmetric, so both sides agree
+ * without another round trip.
+ */
+KEMParams::T kem_negotiate_params(KEMParams::T ours, KEMParams::T theirs) {
+  int level = std::max((ours - 1) % 3, (theirs - 1) % 3);
+  bool nineties = kem_params_nineties(ours) && kem_params_nineties(theirs);
+  return (KEMParams::T)(1 + level + (nineties ? 3 : 0));
+}
+
+/**
+ * Picks the fastest backend this CPU can run for a parameter set. The check
+ * runs once; every KEMDriver shares the result.
+ */
+const KEMBackend &select_kem_backend(KEMParams::T params) {
+  static const std::vector<const KEMBackend *> backends = []() {
+    std::vector<const KEMBackend *> backends;
+    for (size_t i = 0; i < KEM_PARAMS_COUNT; i++) {
+      backends.push_back(&ref_backends[i]);
+#ifdef KYBER_AVX2
+      if (cpu_has_avx2(kem_params_nineties((KEMParams::T)(i + 1))))
+        backends.back() = &avx2_backends[i];
+#endif
+    }
+    return backends;
+  }();
+  if (!kem_params_valid(params))
+    throw std::runtime_error("Unknown Kyber parameter set.");
+  return *backends[params - 1];
+}
+
+/**
+ * The portable backend for a parameter set, whatever the CPU supports; e.g.
+ * to check a faster backend against.
+ */
+const KEMBackend &ref_kem_backend(KEMParams::T params) {
+  if (!kem_params_valid(params))
+    throw std::runtime_error("Unknown Kyber parameter set.");
+  return ref_backends[params - 1];
+}
+
+/**
+ * Constructor. Binds to the backend chosen at startup for the given
+ * parameter set.
+ */
+KEMDriver::KEMDriver(KEMParams::T params)
+    : kem_params(params), backend(&select_kem_backend(params)) {}
+
+/**
+ * Name of the backend in use ("avx2" or "ref").
+ */
+std::string KEMDriver::backend_name() { return this->backend->name; }
+
+/**
+ * Parameter set this driver runs.
+ */
+KEMParams::T KEMDriver::params() { return this->kem_params; }
+
+/**
+ * Size of a public key for this parameter set.
+ */
+size_t KEMDriver::public_key_size() { return this->backend->public_key_bytes; }
+
+/**
+ * @brief Generates a fresh Kyber keypair.
+ * @return Pair of public key, private key.
+ */
+std::pair<SecByteBlock, SecByteBlock> KEMDriver::generate_keypair() {
+  SecByteBlock public_key(this->backend->public_key_bytes);
+  SecByteBlock private_key(this->backend->secret_key_bytes);
+  this->backend->keypair(public_key.BytePtr(), private_key.BytePtr());
+  return std::make_pair(public_key, private_key);
+}
+
+/**
+ * @brief Encapsulates a fresh shared secret to the given public key.
+ * @param public_key other party's Kyber public key
+ * @return Pair of KEM ciphertext, shared secret.
+ */
+std::pair<SecByteBlock, SecByteBlock>
+KEMDriver::encapsulate(const SecByteBlock &public_key) {
+  if (public_key.size() != this->backend->public_key_bytes)
+    throw std::runtime_error("KEMDriver got a public key of the wrong size.");
+  SecByteBlock ciphertext(this->backend->ciphertext_bytes);
+  SecByteBlock shared_secret(this->backend->shared_secret_bytes);
+  this->backend->enc(ciphertext.BytePtr(), shared_secret.BytePtr(),
+                     public_key.BytePtr());
+  return std::make_pair(ciphertext, shared_secret);
+}
+
+/**
+ * @brief Recovers the shared secret from a KEM ciphertext.
+ * @param ciphertext KEM ciphertext
+ * @param private_key our Kyber private key
+ * @return shared secret
+ */
+SecByteBlock KEMDriver::decapsulate(const SecByteBlock &ciphertext,
+                                    const SecByteBlock &private_key) {
+  if (ciphertext.size() != this->backend->ciphertext_bytes ||
+      private_key.size() != this->backend->secret_key_bytes)
+    throw std::runtime_error("KEMDriver got a ciphertext or key of the "
+                             "wrong size.");
+  SecByteBlock shared_secret(this->backend->shared_secret_bytes);
+  this->backend->dec(shared_secret.BytePtr(), ciphertext.BytePtr(),
+                     private_key.BytePtr());
+  return shared_secret;
+}
+
+/**
+ * @brief Generates `count` fresh Kyber keypairs.
+ * @return Pairs of public key, private key.
+ */
+std::vector<std::pair<SecByteBlock, SecByteBlock>>
+KEMDriver::generate_keypairs(size_t count) {
+  std::vector<std::pair<SecByteBlock, SecByteBlock>> keypairs(count);
+  size_t i = 0;
+  for (; this->backend->keypair_x4 && i + 4 <= count; i += 4) {
+    uint8_t *pk[4], *sk[4];
+    for (size_t j = 0; j < 4; j++) {
+      keypairs[i + j].first.New(this->backend->public_key_bytes);
+      keypairs[i + j].second.New(this->backend->secret_key_bytes);
+      pk[j] = keypairs[i + j].first.BytePtr();
+      sk[j] = keypairs[i + j].second.BytePtr();
+    }
+    this->backend->keypair_x4(pk, sk);
+  }
+  for (; i < count; i++)
+    keypairs[i] = this->generate_keypair();
+  return keypairs;
+}
+
+/**
+ * @brief Encapsulates a fresh shared secret to each of the given public keys.
+ * @param public_keys Kyber public keys, e.g. from several circuits' CREATEs
+ * @return Pairs of KEM ciphertext, shared secret.
+ */
+std::vector<std::pair<SecByteBlock, SecByteBlock>>
+KEMDriver::encapsulate(const std::vector<SecByteBlock> &public_keys) {
+  for (const SecByteBlock &public_key : public_keys)
+    if (public_key.size() != this->backend->public_key_bytes)
+      throw std::runtime_error("KEMDriver got a public key of the wrong size.");
+  size_t count = public_keys.size();
+  std::vector<std::pair<SecByteBlock, SecByteBlock>> ct_ss(count);
+  size_t i = 0;
+  for (; this->backend->enc_x4 && i + 4 <= count; i += 4) {
+    uint8_t *ct[4], *ss[4];
+    const uint8_t *pk[4];
+    for (size_t j = 0; j < 4; j++) {
+      ct_ss[i + j].first.New(this->backend->ciphertext_bytes);
+      ct_ss[i + j].second.New(this->backend->shared_secret_bytes);
+      ct[j] = ct_ss[i + j].first.BytePtr();
+      ss[j] = ct_ss[i + j].second.BytePtr();
+      pk[j] = public_keys[i + j].BytePtr();
+    }
+    this->backend->enc_x4(ct, ss, pk);
+  }
+  for (; i < count; i++)
+    ct_ss[i] = this->encapsulate(public_keys[i]);
+  return ct_ss;
+}
+
+/**
+ * @brief Recovers the shared secret from each KEM ciphertext.
+ * @param ciphertexts KEM ciphertexts
+ * @param private_keys our Kyber private key for each ciphertext
+ * @return shared secrets
+ */
+std::vector<SecByteBlock>
+KEMDriver::decapsulate(const std::vector<SecByteBlock> &ciphertexts,
+                       const std::vector<SecByteBlock> &private_keys) {
+  if (ciphertexts.size() != private_keys.size())
+    throw std::runtime_error("KEMDriver needs one private key per "
+                             "ciphertext.");
+  for (size_t i = 0; i < ciphertexts.size(); i++)
+    if (ciphertexts[i].size() != this->backend->ciphertext_bytes ||
+        private_keys[i].size() != this->backend->secret_key_bytes)
+      throw std::runtime_error("KEMDriver got a ciphertext or key of the "
+                               "wrong size.");
+  size_t count = ciphertexts.size();
+  std::vector<SecByteBlock> shared_secrets(count);
+  size_t i = 0;
+  for (; this->backend->dec_x4 && i + 4 <= count; i += 4) {
+    uint8_t *ss[4];
+    const uint8_t *ct[4], *sk[4];
+    for (size_t j = 0; j < 4; j++) {
+      shared_secrets[i + j].New(this->backend->shared_secret_bytes);
+      ss[j] = shared_secrets[i + j].BytePtr();
+      ct[j] = ciphertexts[i + j].BytePtr();
+      sk[j] = private_keys[i + j].BytePtr();
+    }
+    this->backend->dec_x4(ss, ct, sk);
+  }
+  for (; i < count; i++)
+    shared_secrets[i] = this->decapsulate(ciphertexts[i], private_keys[i]);
+  return shared_secrets;
+}
+
+/**
+ * @brief First step of the authenticated key exchange, run by the initiator:
+ * an ephemeral keypair plus an encapsulation to the responder's long-term
+ * key.
+ * @param responder_public_key the responder's long-term public key
+ * @return Pair of the message to send, and state to keep for ake_finish.
+ */
+std::pair<SecByteBlock, SecByteBlock>
+KEMDriver::ake_init(const SecByteBlock &responder_public_key) {
+  if (responder_public_key.size() != this->backend->public_key_bytes)
+    throw std::runtime_error("KEMDriver got a public key of the wrong size.");
+  SecByteBlock message(this->backend->public_key_bytes +
+                       this->backend->ciphertext_bytes);
+  // State: the encapsulated secret, then the ephemeral private key.
+  SecByteBlock state(this->backend->shared_secret_bytes +
+                     this->backend->secret_key_bytes);
+  this->backend->ake_init_a(
+      message.BytePtr(), state.BytePtr(),
+      state.BytePtr() + this->backend->shared_secret_bytes,
+      responder_public_key.BytePtr());
+  return std::make_pair(message, state);
+}
+
+/**
+ * @brief Responder's step of the authenticated key exchange. Only the holder
+ * of the responder's long-term private key can answer, and only the holder
+ * of the initiator's can use the answer.
+ * @param message what the initiator sent from ake_init
+ * @param responder_private_key our long-term private key
+ * @param initiator_public_key the initiator's long-term public key
+ * @return Pair of the reply to send, and the shared key.
+ */
+std::pair<SecByteBlock, SecByteBlock>
+KEMDriver::ake_respond(const SecByteBlock &message,
+                       const SecByteBlock &responder_private_key,
+                       const SecByteBlock &initiator_public_key) {
+  if (message.size() !=
+          this->backend->public_key_bytes + this->backend->ciphertext_bytes ||
+      responder_private_key.size() != this->backend->secret_key_bytes ||
+      initiator_public_key.size() != this->backend->public_key_bytes)
+    throw std::runtime_error("KEMDriver got a handshake message or key of the "
+                             "wrong size.");
+  SecByteBlock reply(2 * this->backend->ciphertext_bytes);
+  SecByteBlock key(this->backend->shared_secret_bytes);
+  this->backend->ake_shared_b(reply.BytePtr(), key.BytePtr(),
+                              message.BytePtr(),
+                              responder_private_key.BytePtr(),
+                              initiator_public_key.BytePtr());
+  return std::make_pair(reply, key);
+}
+
+/**
+ * @brief Initiator's last step of the authenticated key exchange.
+ * @param reply what the responder sent from ake_respond
+ * @param state what ake_init returned
+ * @param initiator_private_key our long-term private key
+ * @return The shared key.
+ */
+SecByteBlock KEMDriver::ake_finish(const SecByteBlock &reply,
+                                   const SecByteBlock &state,
+                                   const SecByteBlock &initiator_private_key) {
+  if (reply.size() != 2 * this->backend->ciphertext_bytes ||
+      state.size() != this->backend->shared_secret_bytes +
+                          this->backend->secret_key_bytes ||
+      initiator_private_key.size() != this->backend->secret_key_bytes)
+    throw std::runtime_error("KEMDriver got a handshake message or key of the "
+                             "wrong size.");
+  SecByteBlock key(this->backend->shared_secret_bytes);
+  this->backend->ake_shared_a(
+      key.BytePtr(), reply.BytePtr(), state.BytePtr(),
+      state.BytePtr() + this->backend->shared_secret_bytes,
+      initiator_private_key.BytePtr());
+  return key;
+}
@@ -0,0 +1,436 @@
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <crypto++/crc.h>
+#include <crypto++/sha.h>
+
+#include "../../include-shared/messages.hpp"
+#include "../../include/drivers/key_store.hpp"
+
+// File header: magic, format version, reserved.
+static const unsigned char KEY_STORE_MAGIC[4] = {'Q', 'K', 'S', 'T'};
+static const uint32_t KEY_STORE_VERSION = 1;
+static const size_t KEY_STORE_HEADER_SIZE = 16;
+
+// Record: u32 length (including padding and CRC), u8 kind, 3 reserved bytes,
+// key ID, u32 public key length, u32 private key length, both keys, zero
+// padding to a multiple of 8, then the CRC-32 of everything before it.
+static const size_t RECORD_HEADER_SIZE = 16 + KEY_ID_SIZE;
+static const size_t RECORD_CRC_SIZE = 4;
+static const size_t RECORD_ALIGN = 8;
+
+// The mapping grows in steps of at least this much, so appends rarely remap.
+static const size_t MAP_CHUNK_SIZE = 1 << 20;
+
+// The file is rewritten without its dead records once they take up more
+// than this and more than the live ones, so rewrites stay amortized O(1) per
+// append however often tickets and prekeys are replaced.
+static const size_t COMPACT_MIN_DEAD_SIZE = 64 << 10;
+
+static uint64_t index_key(const unsigned char *key_id) {
+  uint64_t key;
+  std::memcpy(&key, key_id, sizeof(key));
+  return key;
+}
+
+static uint32_t record_crc(const unsigned char *record, size_t size) {
+  uint32_t crc;
+  CRC32().CalculateDigest(reinterpret_cast<CryptoPP::byte *>(&crc), record,
+                          size);
+  return crc;
+}
+
+/**
+ * Opens the store at the given path, creating an empty one if needed.
+ * @param path file to keep the keys in; created readable by the owner only
+ * @throws std::runtime_error if another process has the store open.
+ */
+KeyStore::KeyStore(std::string path)
+    : path(path), fd(-1), mapping(nullptr), mapped_length(0), file_length(0),
+      live_length(0) {
+  static_assert(KEY_ID_SIZE == sizeof(uint64_t),
+                "KeyStore indexes key IDs as 64-bit integers.");
+  this->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (this->fd < 0)
+    throw std::runtime_error("Could not open key store " + path + ".");
+  if (::flock(this->fd, LOCK_EX | LOCK_NB) != 0) {
+    ::close(this->fd);
+    throw std::runtime_error("Key store " + path +
+                             " is in use by another process.");
+  }
+  try {
+    this->load();
+  } catch (...) {
+    if (this->mapping)
+      ::munmap(this->mapping, this->mapped_length);
+    ::close(this->fd);
+    throw;
+  }
+}
+
+/**
+ * Destructor. Unmaps and closes the file; everything added is already on
+ * disk.
+ */
+KeyStore::~KeyStore() {
+  if (this->mapping)
+    ::munmap(this->mapping, this->mapped_length);
+  ::close(this->fd);
+}
+
+/**
+ * The ID a public key is stored under.
+ */
+SecByteBlock KeyStore::key_id(const SecByteBlock &public_key) {
+  SecByteBlock digest(SHA256::DIGESTSIZE);
+  SHA256().CalculateDigest(digest, public_key, public_key.size());
+  return SecByteBlock(digest.BytePtr(), KEY_ID_SIZE);
+}
+
+/**
+ * Writes the header of a new store, or checks the header of an existing one,
+ * then maps the file and indexes every intact record. A torn record at the
+ * tail, left by a crash mid-append, is cut off.
+ */
+void KeyStore::load() {
+  struct stat st;
+  if (::fstat(this->fd, &st) != 0)
+    throw std::runtime_error("Could not stat key store " + this->path + ".");
+  size_t size = st.st_size;
+
+  if (size == 0) {
+    unsigned char header[KEY_STORE_HEADER_SIZE] = {};
+    std::memcpy(header, KEY_STORE_MAGIC, sizeof(KEY_STORE_MAGIC));
+    put_u32(KEY_STORE_VERSION, header + 4);
+    if (::pwrite(this->fd, header, sizeof(header), 0) !=
+            (ssize_t)sizeof(header) ||
+        ::fsync(this->fd) != 0)
+      throw std::runtime_error("Could not initialize key store " + this->path +
+                               ".");
+    size = sizeof(header);
+  }
+  if (size < KEY_STORE_HEADER_SIZE)
+    throw std::runtime_error(this->path + " is not a key store.");
+  this->map(size);
+
+  if (std::memcmp(this->mapping, KEY_STORE_MAGIC, sizeof(KEY_STORE_MAGIC)) !=
+          0)
+    throw std::runtime_error(this->path + " is not a key store.");
+  if (get_u32(this->mapping + 4) != KEY_STORE_VERSION)
+    throw std::runtime_error("Key store " + this->path +
+                             " has an unsupported version.");
+
+  size_t offset = KEY_STORE_HEADER_SIZE;
+  while (offset + RECORD_HEADER_SIZE + RECORD_CRC_SIZE <= size) {
+    const unsigned char *record = this->mapping + offset;
+    uint32_t length = get_u32(record);
+    uint32_t public_size = get_u32(record + 8 + KEY_ID_SIZE);
+    uint32_t private_size = get_u32(record + 12 + KEY_ID_SIZE);
+    if (length % RECORD_ALIGN != 0 || length > size - offset ||
+        (uint64_t)RECORD_HEADER_SIZE + public_size + private_size +
+                RECORD_CRC_SIZE >
+            length ||
+        get_u32(record + length - RECORD_CRC_SIZE) !=
+            record_crc(record, length - RECORD_CRC_SIZE))
+      break;
+    this->publish(offset, (KeyKind::T)record[4], index_key(record + 8));
+    offset += length;
+  }
+
+  if (offset != size &&
+      (::ftruncate(this->fd, offset) != 0 || ::fsync(this->fd) != 0))
+    throw std::runtime_error("Could not repair key store " + this->path + ".");
+  this->file_length = offset;
+}
+
+/**
+ * Indexes the record at `offset`, or drops its key if it is a revocation,
+ * and keeps count of the bytes live records take up. Callers hold mtx
+ * exclusively, or are still constructing the store.
+ */
+void KeyStore::publish(size_t offset, KeyKind::T kind, uint64_t key) {
+  auto it = this->index.find(key);
+  if (it != this->index.end()) {
+    this->live_length -= get_u32(this->mapping + it->second.offset);
+    this->index.erase(it);
+  }
+  if (kind == KeyKind::REVOKED)
+    return;
+  this->index[key] = Entry{offset, kind};
+  this->live_length += get_u32(this->mapping + offset);
+}
+
+/**
+ * (Re)maps the file with room for at least `length` bytes. Pages past the
+ * end of the file are never touched, so the mapping may run ahead of it.
+ * Callers hold mtx exclusively, or are still constructing the store.
+ */
+void KeyStore::map(size_t length) {
+  size_t mapped_length =
+      this->mapped_length ? this->mapped_length : MAP_CHUNK_SIZE;
+  while (mapped_length < length)
+    mapped_length *= 2;
+  if (this->mapping && mapped_length == this->mapped_length)
+    return;
+  void *mapping = ::mmap(nullptr, mapped_length, PROT_READ, MAP_SHARED,
+                         this->fd, 0);
+  if (mapping == MAP_FAILED)
+    throw std::runtime_error("Could not map key store " + this->path + ".");
+  if (this->mapping)
+    ::munmap(this->mapping, this->mapped_length);
+  this->mapping = (unsigned char *)mapping;
+  this->mapped_length = mapped_length;
+}
+
+/**
+ * Writes one record at the end of the file and syncs it, then indexes it.
+ * Lookups keep running while the record is written.
+ */
+void KeyStore::append(KeyKind::T kind, const SecByteBlock &key_id,
+                      const SecByteBlock &public_key,
+                      const SecByteBlock &private_key) {
+  size_t length = RECORD_HEADER_SIZE + public_key.size() +
+                  private_key.size() + RECORD_CRC_SIZE;
+  length = (length + RECORD_ALIGN - 1) / RECORD_ALIGN * RECORD_ALIGN;
+  SecByteBlock record(length);
+  std::memset(record, 0, length);
+  put_u32(length, record);
+  record[4] = kind;
+  std::memcpy(record + 8, key_id, KEY_ID_SIZE);
+  put_u32(public_key.size(), record + 8 + KEY_ID_SIZE);
+  put_u32(private_key.size(), record + 12 + KEY_ID_SIZE);
+  // Revocations carry no keys, and peer keys no private key.
+  if (public_key.size() > 0)
+    std::memcpy(record + RECORD_HEADER_SIZE, public_key, public_key.size());
+  if (private_key.size() > 0)
+    std::memcpy(record + RECORD_HEADER_SIZE + public_key.size(), private_key,
+                private_key.size());
+  put_u32(record_crc(record, length - RECORD_CRC_SIZE),
+          record + length - RECORD_CRC_SIZE);
+
+  size_t offset = this->file_length;
+  size_t written = 0;
+  while (written < length) {
+    ssize_t n = ::pwrite(this->fd, record + written, length - written,
+                         offset + written);
+    // file_length stays put, so the next record overwrites whatever made it
+    // out.
+    if (n <= 0)
+      throw std::runtime_error("Could not write to key store " + this->path +
+                               ".");
+    written += n;
+  }
+  if (::fdatasync(this->fd) != 0)
+    throw std::runtime_error("Could not sync key store " + this->path + ".");
+  this->file_length = offset + length;
+
+  {
+    std::unique_lock<std::shared_mutex> lock(this->mtx);
+    this->map(this->file_length);
+    this->publish(offset, kind, index_key(key_id));
+  }
+
+  size_t dead = this->file_length - KEY_STORE_HEADER_SIZE - this->live_length;
+  if (dead > COMPACT_MIN_DEAD_SIZE && dead > this->live_length) {
+    // The record is safely stored either way; a failed rewrite leaves the
+    // old file in place, and the next append tries again.
+    try {
+      this->compact();
+    } catch (std::runtime_error &_) {
+    }
+  }
+}
+
+/**
+ * Rewrites the store with only its live records, into a new file that then
+ * atomically replaces the old one, so a crash leaves one or the other whole.
+ * Callers hold append_mtx, which keeps the mapping and index still while
+ * they are copied; lookups keep running until the new file is swapped in.
+ */
+void KeyStore::compact() {
+  std::string compact_path = this->path + ".compact";
+  SecByteBlock contents(KEY_STORE_HEADER_SIZE + this->live_length);
+  std::memcpy(contents, this->mapping, KEY_STORE_HEADER_SIZE);
+  std::unordered_map<uint64_t, Entry> index;
+  size_t offset = KEY_STORE_HEADER_SIZE;
+  for (const auto &entry : this->index) {
+    const unsigned char *record = this->mapping + entry.second.offset;
+    uint32_t length = get_u32(record);
+    std::memcpy(contents + offset, record, length);
+    index[entry.first] = Entry{offset, entry.second.kind};
+    offset += length;
+  }
+
+  // The new file is locked before it takes the old one's name, so no other
+  // process can open it in between.
+  int fd = ::open(compact_path.c_str(),
+                  O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd >= 0 && ::flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    ::close(fd);
+    ::unlink(compact_path.c_str());
+    fd = -1;
+  }
+  if (fd < 0)
+    throw std::runtime_error("Could not compact key store " + this->path +
+                             ".");
+  size_t written = 0;
+  while (written < contents.size()) {
+    ssize_t n = ::pwrite(fd, contents + written, contents.size() - written,
+                         written);
+    if (n <= 0)
+      break;
+    written += n;
+  }
+  size_t mapped_length = MAP_CHUNK_SIZE;
+  while (mapped_length < contents.size())
+    mapped_length *= 2;
+  void *mapping = MAP_FAILED;
+  if (written == contents.size() && ::fsync(fd) == 0)
+    mapping = ::mmap(nullptr, mapped_length, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED ||
+      ::rename(compact_path.c_str(), this->path.c_str()) != 0) {
+    if (mapping != MAP_FAILED)
+      ::munmap(mapping, mapped_length);
+    ::close(fd);
+    ::unlink(compact_path.c_str());
+    throw std::runtime_error("Could not compact key store " + this->path +
+                             ".");
+  }
+  // Make the rename itself durable, or a crash could bring back the old
+  // file without the records appended to the new one.
+  size_t slash = this->path.rfind('/');
+  std::string directory =
+      slash == std::string::npos ? "." : this->path.substr(0, slash + 1);
+  int directory_fd = ::open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+  if (directory_fd >= 0) {
+    ::fsync(directory_fd);
+    ::close(directory_fd);
+  }
+
+  std::unique_lock<std::shared_mutex> lock(this->mtx);
+  ::munmap(this->mapping, this->mapped_length);
+  ::close(this->fd);
+  this->fd = fd;
+  this->mapping = (unsigned char *)mapping;
+  this->mapped_length = mapped_length;
+  this->index.swap(index);
+  this->file_length = contents.size();
+}
+
+/**
+ * @brief Stores a keypair durably.
+ * @param keypair public key, private key (empty for PEER keys)
+ * @param kind LONG_TERM, PREKEY or PEER
+ * @return the key ID to look the keypair up by
+ */
+SecByteBlock
+KeyStore::add(const std::pair<SecByteBlock, SecByteBlock> &keypair,
+              KeyKind::T kind) {
+  if (kind == KeyKind::REVOKED)
+    throw std::runtime_error("Use KeyStore::revoke to retire a key.");
+  SecByteBlock id = KeyStore::key_id(keypair.first);
+  std::lock_guard<std::mutex> lock(this->append_mtx);
+  this->append(kind, id, keypair.first, keypair.second);
+  return id;
+}
+
+/**
+ * @brief ID of our long-term keypair, generating and storing one on first
+ * use. Only one is ever created, however many threads ask at once.
+ * @param generate makes a fresh keypair
+ */
+SecByteBlock KeyStore::long_term_key_id(
+    const std::function<std::pair<SecByteBlock, SecByteBlock>()> &generate) {
+  std::lock_guard<std::mutex> lock(this->append_mtx);
+  std::vector<SecByteBlock> ids = this->key_ids(KeyKind::LONG_TERM);
+  if (!ids.empty())
+    return ids.front();
+  std::pair<SecByteBlock, SecByteBlock> keypair = generate();
+  SecByteBlock id = KeyStore::key_id(keypair.first);
+  this->append(KeyKind::LONG_TERM, id, keypair.first, keypair.second);
+  return id;
+}
+
+/**
+ * @brief Retires a key, e.g. a prekey that has been used. Its bytes stay in
+ * the file until the next compaction, but it is no longer found, now or
+ * after a restart.
+ * @return false if no such key was stored
+ */
+bool KeyStore::revoke(const SecByteBlock &key_id) {
+  if (key_id.size() != KEY_ID_SIZE)
+    return false;
+  std::lock_guard<std::mutex> lock(this->append_mtx);
+  if (!this->contains(key_id))
+    return false;
+  this->append(KeyKind::REVOKED, key_id, SecByteBlock(), SecByteBlock());
+  return true;
+}
+
+/**
+ * True if a live key with this ID is stored.
+ */
+bool KeyStore::contains(const SecByteBlock &key_id) {
+  if (key_id.size() != KEY_ID_SIZE)
+    return false;
+  std::shared_lock<std::shared_mutex> lock(this->mtx);
+  return this->index.count(index_key(key_id)) > 0;
+}
+
+/**
+ * What the key with this ID is for; REVOKED if no live key has it.
+ */
+KeyKind::T KeyStore::kind(const SecByteBlock &key_id) {
+  if (key_id.size() != KEY_ID_SIZE)
+    return KeyKind::REVOKED;
+  std::shared_lock<std::shared_mutex> lock(this->mtx);
+  auto it = this->index.find(index_key(key_id));
+  return it == this->index.end() ? KeyKind::REVOKED : it->second.kind;
+}
+
+/**
+ * @brief Looks up a keypair by key ID.
+ * @return Pair of public key, private key.
+ */
+std::pair<SecByteBlock, SecByteBlock>
+KeyStore::get(const SecByteBlock &key_id) {
+  if (key_id.size() != KEY_ID_SIZE)
+    throw std::runtime_error("KeyStore got a key ID of the wrong size.");
+  std::shared_lock<std::shared_mutex> lock(this->mtx);
+  auto it = this->index.find(index_key(key_id));
+  if (it == this->index.end())
+    throw std::runtime_error("No such key in key store " + this->path + ".");
+  const unsigned char *record = this->mapping + it->second.offset;
+  uint32_t public_size = get_u32(record + 8 + KEY_ID_SIZE);
+  uint32_t private_size = get_u32(record + 12 + KEY_ID_SIZE);
+  const unsigned char *keys = record + RECORD_HEADER_SIZE;
+  return std::make_pair(SecByteBlock(keys, public_size),
+                        SecByteBlock(keys + public_size, private_size));
+}
+
+/**
+ * IDs of every live key of the given kind, in no particular order.
+ */
+std::vector<SecByteBlock> KeyStore::key_ids(KeyKind::T kind) {
+  std::vector<SecByteBlock> ids;
+  std::shared_lock<std::shared_mutex> lock(this->mtx);
+  for (const auto &entry : this->index)
+    if (entry.second.kind == kind)
+      ids.push_back(SecByteBlock(this->mapping + entry.second.offset + 8,
+                                 KEY_ID_SIZE));
+  return ids;
+}
+
+/**
+ * Number of live keys.
+ */
+size_t KeyStore::size() {
+  std::shared_lock<std::shared_mutex> lock(this->mtx);
+  return this->index.size();
+}
@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "../../include/drivers/keypair_pool.hpp"
+
+/**
+ * Constructor. Starts the worker, which fills the pool right away.
+ * @param kem_driver driver used to generate keypairs
+ * @param depth number of keypairs to keep ready
+ * @param watermark refill once this many or fewer are left
+ */
+KeypairPool::KeypairPool(std::shared_ptr<KEMDriver> kem_driver, size_t depth,
+                         size_t watermark)
+    : kem_driver(kem_driver), depth(depth), watermark(watermark),
+      stopping(false) {
+  if (depth == 0 || watermark >= depth)
+    throw std::runtime_error(
+        "KeypairPool needs depth > 0 and watermark < depth.");
+  this->worker = boost::thread(&KeypairPool::refill, this);
+}
+
+/**
+ * Destructor. Stops the worker; keypairs left in the pool are wiped with it.
+ */
+KeypairPool::~KeypairPool() {
+  {
+    std::unique_lock<std::mutex> lck(this->mtx);
+    this->stopping = true;
+  }
+  this->wake.notify_all();
+  this->worker.join();
+}
+
+/**
+ * @brief Takes a ready keypair, or generates one inline if the pool is empty.
+ * @return Pair of public key, private key.
+ */
+std::pair<SecByteBlock, SecByteBlock> KeypairPool::pop() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  if (this->keypairs.empty()) {
+    lck.unlock();
+    this->wake.notify_one();
+    return this->kem_driver->generate_keypair();
+  }
+  std::pair<SecByteBlock, SecByteBlock> keys =
+      std::move(this->keypairs.front());
+  this->keypairs.pop_front();
+  bool low = this->keypairs.size() <= this->watermark;
+  lck.unlock();
+  if (low)
+    this->wake.notify_one();
+  return keys;
+}
+
+/**
+ * Parameter set of the keypairs this pool hands out.
+ */
+KEMParams::T KeypairPool::params() { return this->kem_driver->params(); }
+
+/**
+ * @brief The pool handing out keypairs in the given parameter set: this one
+ * if it matches, and otherwise a sibling with the default depth, started the
+ * first time the set is asked for and shared with every later caller.
+ * @param params Kyber parameter set
+ * @return Pool for that set.
+ */
+std::shared_ptr<KeypairPool> KeypairPool::for_params(KEMParams::T params) {
+  if (params == this->params())
+    return shared_from_this();
+  if (std::shared_ptr<KeypairPool> origin = this->origin.lock())
+    return origin->for_params(params);
+  std::lock_guard<std::mutex> lck(this->siblings_mtx);
+  std::shared_ptr<KeypairPool> &sibling = this->siblings[params];
+  if (!sibling) {
+    sibling =
+        std::make_shared<KeypairPool>(std::make_shared<KEMDriver>(params));
+    sibling->origin = shared_from_this();
+  }
+  return sibling;
+}
+
+/**
+ * Number of keypairs ready right now.
+ */
+size_t KeypairPool::size() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  return this->keypairs.size();
+}
+
+/**
+ * Worker loop. Sleeps until the pool drops to the watermark, then generates
+ * keypairs outside the lock, a batch of up to KEYPAIR_BATCH_SIZE at a time,
+ * until it is full again. Only the worker adds keypairs, so a batch sized to
+ * the room left never overfills the pool.
+ */
+void KeypairPool::refill() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  while (true) {
+    this->wake.wait(lck, [this]() {
+      return this->stopping || this->keypairs.size() <= this->watermark;
+    });
+    while (!this->stopping && this->keypairs.size() < this->depth) {
+      size_t count = std::min(KEYPAIR_BATCH_SIZE,
+                              this->depth - this->keypairs.size());
+      lck.unlock();
+      std::vector<std::pair<SecByteBlock, SecByteBlock>> batch =
+          this->kem_driver->generate_keypairs(count);
+      lck.lock();
+      for (auto &keys : batch)
+        this->keypairs.push_back(std::move(keys));
+    }
+    if (this->stopping)
+      return;
+  }
+}
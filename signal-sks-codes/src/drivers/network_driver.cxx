@@ -1,3 +1,4 @@
+#include <array>
 #include <stdexcept>
 #include <vector>
 
@@ -6,11 +7,21 @@
 using namespace boost::asio;
 using ip::tcp;
 
+/**
+ * Receives one frame. Drivers without a buffer pool just wrap read().
+ * @return FrameBuffer data read.
+ */
+FrameBuffer NetworkDriver::read_frame() { return FrameBuffer(this->read()); }
+
 /**
  * Constructor. Sets up IO context and socket.
+ * @param nodelay Disable Nagle's algorithm once connected.
+ * @param max_frame_size Largest frame the peer may send.
  */
-NetworkDriverImpl::NetworkDriverImpl() : io_context() {
+NetworkDriverImpl::NetworkDriverImpl(bool nodelay, size_t max_frame_size)
+    : nodelay(nodelay), io_context() {
   this->socket = std::make_shared<tcp::socket>(io_context);
+  this->frame_pool = std::make_shared<FramePool>(max_frame_size);
 }
 
 /**
@@ -20,6 +31,7 @@ NetworkDriverImpl::NetworkDriverImpl() : io_context() {
 void NetworkDriverImpl::listen(int port) {
   tcp::acceptor acceptor(this->io_context, tcp::endpoint(tcp::v4(), port));
   acceptor.accept(*this->socket);
+  this->apply_socket_options();
 }
 
 /**
@@ -32,6 +44,7 @@ void NetworkDriverImpl::connect(std::string address, int port) {
     address = "127.0.0.1";
   this->socket->connect(
       tcp::endpoint(boost::asio::ip::address::from_string(address), port));
+  this->apply_socket_options();
 }
 
 /**
@@ -47,37 +60,127 @@ void NetworkDriverImpl::disconnect() {
  * Sends a fixed amount of data by sending length first.
  * @param data Bytes of data to send.
  */
-void NetworkDriverImpl::send(std::vector<unsigned char> data) {
-  int length = htonl(data.size());
-  boost::asio::write(*this->socket, boost::asio::buffer(&length, sizeof(int)));
-  boost::asio::write(*this->socket, boost::asio::buffer(data));
+void NetworkDriverImpl::send(const std::vector<unsigned char> &data) {
+  this->send(ByteView{data.data(), data.size()});
+}
+
+/**
+ * Sends a fixed amount of data by sending length first. Length and payload
+ * go out in a single gathered write.
+ * @param data Bytes of data to send.
+ */
+void NetworkDriverImpl::send(ByteView data) {
+  uint32_t length = htonl(data.size);
+  std::array<boost::asio::const_buffer, 2> buffers = {
+      boost::asio::buffer(&length, sizeof(uint32_t)),
+      boost::asio::buffer(data.data, data.size)};
+  boost::asio::write(*this->socket, buffers);
+}
+
+/**
+ * Sends several buffers as one frame, e.g. a header and a body that live in
+ * different places, without first copying them together.
+ * @param parts Buffers to concatenate on the wire.
+ */
+void NetworkDriverImpl::send(const std::vector<ByteView> &parts) {
+  size_t total = 0;
+  std::vector<boost::asio::const_buffer> buffers;
+  buffers.reserve(parts.size() + 1);
+  uint32_t length;
+  buffers.push_back(boost::asio::buffer(&length, sizeof(uint32_t)));
+  for (const ByteView &part : parts) {
+    buffers.push_back(boost::asio::buffer(part.data, part.size));
+    total += part.size;
+  }
+  length = htonl(total);
+  boost::asio::write(*this->socket, buffers);
 }
 
 /**
  * Receives a fixed amount of data by receiving length first.
  * @return std::vector<unsigned char> data read.
- * @throws error when eof.
+ * @throws error when eof, or when the frame is over the maximum frame size.
  */
 std::vector<unsigned char> NetworkDriverImpl::read() {
-  // read length
-  int length;
-  boost::system::error_code error;
-  boost::asio::read(*this->socket, boost::asio::buffer(&length, sizeof(int)),
-                    boost::asio::transfer_exactly(sizeof(int)), error);
-  if (error) {
-    throw std::runtime_error("Received EOF.");
-  }
-  length = ntohl(length);
+  size_t length = this->read_length();
 
   // read message
   std::vector<unsigned char> data;
   data.resize(length);
-  boost::asio::read(*this->socket, boost::asio::buffer(data),
-                    boost::asio::transfer_exactly(length), error);
+  this->read_bytes(data.data(), length);
+  return data;
+}
+
+/**
+ * Receives a fixed amount of data by receiving length first, into a buffer
+ * from this connection's pool. Release the frame by dropping it; in steady
+ * state, receiving this way allocates nothing.
+ * @return FrameBuffer data read.
+ * @throws error when eof, or when the frame is over the maximum frame size.
+ */
+FrameBuffer NetworkDriverImpl::read_frame() {
+  size_t length = this->read_length();
+  FrameBuffer frame = this->frame_pool->take(length);
+  this->read_bytes(frame.data(), length);
+  return frame;
+}
+
+/**
+ * Reads a frame's length prefix. The length comes from the peer, so it is
+ * checked against the maximum frame size before anything is allocated for it.
+ * @return size_t length of the frame that follows.
+ * @throws error when eof, or when the frame is over the maximum frame size.
+ */
+size_t NetworkDriverImpl::read_length() {
+  uint32_t length;
+  this->read_bytes((unsigned char *)&length, sizeof(uint32_t));
+  length = ntohl(length);
+  if (length > this->frame_pool->max_frame_size()) {
+    throw std::runtime_error("Frame exceeds the maximum frame size.");
+  }
+  return length;
+}
+
+/**
+ * Sends bytes as they are, without a length prefix, for protocols that frame
+ * themselves (e.g. fixed-size onion cells).
+ * @param data Bytes of data to send.
+ */
+void NetworkDriverImpl::send_bytes(ByteView data) {
+  boost::asio::write(*this->socket, boost::asio::buffer(data.data, data.size));
+}
+
+/**
+ * Receives exactly size bytes, without a length prefix.
+ * @param data Buffer to fill.
+ * @param size Number of bytes to read.
+ * @throws error when eof.
+ */
+void NetworkDriverImpl::read_bytes(unsigned char *data, size_t size) {
+  boost::system::error_code error;
+  boost::asio::read(*this->socket, boost::asio::buffer(data, size),
+                    boost::asio::transfer_exactly(size), error);
   if (error) {
     throw std::runtime_error("Received EOF.");
   }
-  return data;
+}
+
+/**
+ * Enable or disable TCP_NODELAY. Interactive traffic wants it on so small
+ * frames are not held back waiting for an ACK.
+ * @param nodelay true to disable Nagle's algorithm.
+ */
+void NetworkDriverImpl::set_nodelay(bool nodelay) {
+  this->nodelay = nodelay;
+  if (this->socket->is_open())
+    this->apply_socket_options();
+}
+
+/**
+ * Apply socket options to a connected socket.
+ */
+void NetworkDriverImpl::apply_socket_options() {
+  this->socket->set_option(tcp::no_delay(this->nodelay));
 }
 
 /**
@@ -0,0 +1,77 @@
+#include <cstring>
+#include <stdexcept>
+
+#include "../../include-shared/messages.hpp"
+#include "../../include/drivers/onion_layer.hpp"
+
+/**
+ * Constructor. Splits the key material into forward and backward keystream
+ * keys, then forward and backward digest seeds.
+ * @param key_material KEY_MATERIAL_SIZE bytes from
+ * CryptoDriver::OnionLayer_generate.
+ */
+OnionLayer::OnionLayer(const SecByteBlock &key_material) {
+  if (key_material.size() != KEY_MATERIAL_SIZE)
+    throw std::runtime_error("Wrong onion layer key material size.");
+  SecByteBlock iv(AES::BLOCKSIZE);
+  std::memset(iv.BytePtr(), 0, iv.size());
+  for (int direction = 0; direction < 2; direction++) {
+    const unsigned char *key = key_material.BytePtr() + direction * KEY_SIZE;
+    const unsigned char *seed = key + 2 * KEY_SIZE;
+    this->keystream[direction].SetKeyWithIV(key, KEY_SIZE, iv.BytePtr(),
+                                            iv.size());
+    this->digest[direction].Update(seed, KEY_SIZE);
+  }
+}
+
+/**
+ * Adds or removes this layer in place.
+ */
+void OnionLayer::crypt(OnionDirection::T direction, unsigned char *payload,
+                       size_t size) {
+  this->keystream[direction].ProcessData(payload, payload, size);
+}
+
+/**
+ * Stamps a plaintext relay payload with the running digest for this hop, then
+ * adds this layer.
+ */
+void OnionLayer::seal(OnionDirection::T direction, unsigned char *payload,
+                      size_t size) {
+  if (size < RELAY_HEADER_SIZE)
+    throw std::runtime_error("Truncated message.");
+  unsigned char *digest = payload + RELAY_DIGEST_OFFSET;
+  payload[0] = payload[1] = 0;
+  std::memset(digest, 0, RELAY_DIGEST_SIZE);
+  this->digest[direction].Update(payload, size);
+  SHA256 running = this->digest[direction];
+  running.TruncatedFinal(digest, RELAY_DIGEST_SIZE);
+  this->crypt(direction, payload, size);
+}
+
+/**
+ * Removes this layer and checks whether the cell was sealed for this hop. The
+ * running digest only advances on a match, and an unrecognized payload is
+ * left exactly as decrypted so it can be passed along.
+ * @return true if the payload is now plaintext meant for this hop.
+ */
+bool OnionLayer::open(OnionDirection::T direction, unsigned char *payload,
+                      size_t size) {
+  this->crypt(direction, payload, size);
+  if (size < RELAY_HEADER_SIZE || payload[0] != 0 || payload[1] != 0)
+    return false;
+
+  unsigned char *digest = payload + RELAY_DIGEST_OFFSET;
+  unsigned char received[RELAY_DIGEST_SIZE];
+  std::memcpy(received, digest, RELAY_DIGEST_SIZE);
+  std::memset(digest, 0, RELAY_DIGEST_SIZE);
+  SHA256 trial = this->digest[direction];
+  trial.Update(payload, size);
+  SHA256 running = trial;
+  if (!running.TruncatedVerify(received, RELAY_DIGEST_SIZE)) {
+    std::memcpy(digest, received, RELAY_DIGEST_SIZE);
+    return false;
+  }
+  this->digest[direction] = trial;
+  return true;
+}
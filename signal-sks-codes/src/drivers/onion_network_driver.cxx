@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "../../include/drivers/drbg.hpp"
+#include "../../include/drivers/onion_network_driver.hpp"
+
+/**
+ * Constructor.
+ * @param relays Circuit path as (address, port), first hop first.
+ * @param crypto_driver Derives each hop's layer keys.
+ * @param kem_driver Runs the per-hop handshakes.
+ * @param max_frame_size Largest frame the destination may send.
+ */
+OnionNetworkDriver::OnionNetworkDriver(
+    std::vector<std::pair<std::string, int>> relays,
+    std::shared_ptr<CryptoDriver> crypto_driver,
+    std::shared_ptr<KEMDriver> kem_driver, size_t max_frame_size)
+    : relays(relays), crypto_driver(crypto_driver), kem_driver(kem_driver),
+      max_frame_size(max_frame_size), circuit_id(0),
+      package_window(CIRCUIT_WINDOW_START), window_closed(false),
+      deliver_window(CIRCUIT_WINDOW_START), read_cell(CELL_SIZE) {
+  if (this->relays.empty())
+    throw std::runtime_error("An onion circuit needs at least one relay.");
+  this->guard = std::make_shared<NetworkDriverImpl>();
+}
+
+/**
+ * Circuits only go outwards; the destination listens with a plain driver.
+ */
+void OnionNetworkDriver::listen(int) {
+  throw std::runtime_error("Cannot listen through an onion circuit.");
+}
+
+/**
+ * Build a circuit through every relay, then open a stream from the last one
+ * to the given address and port.
+ * @param address Address to connect to.
+ * @param port Port to conect to.
+ */
+void OnionNetworkDriver::connect(std::string address, int port) {
+  this->guard->connect(this->relays[0].first, this->relays[0].second);
+  do {
+    DRBG::generate((uint8_t *)&this->circuit_id, sizeof(uint32_t));
+  } while (this->circuit_id == 0);
+
+  for (auto &relay : this->relays)
+    this->extend(relay.first, relay.second);
+
+  RelayTarget target;
+  target.address = address;
+  target.port = port;
+  std::vector<unsigned char> begin;
+  target.serialize(begin);
+  this->send_relay(this->layers.size() - 1, RelayCommand::BEGIN, begin.data(),
+                   begin.size());
+  size_t hop;
+  if (this->read_relay(&hop).command != RelayCommand::CONNECTED)
+    throw std::runtime_error("Exit relay could not reach destination.");
+  this->remote_info = address + ":" + std::to_string(port);
+}
+
+/**
+ * Tear down the circuit and disconnect from the first hop.
+ */
+void OnionNetworkDriver::disconnect() {
+  this->close_window();
+  unsigned char cell[CELL_SIZE];
+  put_cell(this->circuit_id, MessageType::Onion_Destroy, nullptr, 0, cell);
+  try {
+    std::lock_guard<std::mutex> lock(this->send_mtx);
+    this->guard->send_bytes(ByteView{cell, CELL_SIZE});
+  } catch (std::exception &) {
+  }
+  this->guard->disconnect();
+}
+
+/**
+ * Sends a frame to the destination.
+ * @param data Bytes of data to send.
+ */
+void OnionNetworkDriver::send(const std::vector<unsigned char> &data) {
+  this->send_stream({ByteView{data.data(), data.size()}});
+}
+
+/**
+ * Sends a frame to the destination.
+ * @param data Bytes of data to send.
+ */
+void OnionNetworkDriver::send(ByteView data) { this->send_stream({data}); }
+
+/**
+ * Sends several buffers as one frame.
+ * @param parts Buffers to concatenate.
+ */
+void OnionNetworkDriver::send(const std::vector<ByteView> &parts) {
+  this->send_stream(parts);
+}
+
+/**
+ * Receives the next frame from the destination, reassembling it from as
+ * many RELAY_DATA cells as it spans.
+ * @return std::vector<unsigned char> data read.
+ * @throws error when the stream or circuit closes, or when the frame is over
+ * the maximum frame size.
+ */
+std::vector<unsigned char> OnionNetworkDriver::read() {
+  std::vector<unsigned char> &stream = this->read_stream_buffer;
+  while (true) {
+    if (stream.size() >= sizeof(uint32_t)) {
+      size_t length = ((size_t)stream[0] << 24) | ((size_t)stream[1] << 16) |
+                      ((size_t)stream[2] << 8) | (size_t)stream[3];
+      if (length > this->max_frame_size)
+        throw std::runtime_error("Frame exceeds the maximum frame size.");
+      if (stream.size() - sizeof(uint32_t) >= length) {
+        std::vector<unsigned char> data(stream.begin() + sizeof(uint32_t),
+                                        stream.begin() + sizeof(uint32_t) +
+                                            length);
+        stream.erase(stream.begin(),
+                     stream.begin() + sizeof(uint32_t) + length);
+        return data;
+      }
+    }
+    size_t hop;
+    Relay_View msg;
+    try {
+      msg = this->read_relay(&hop);
+    } catch (std::runtime_error &) {
+      this->close_window();
+      throw;
+    }
+    if (hop != this->layers.size() - 1)
+      continue;
+    if (msg.command == RelayCommand::DATA) {
+      if (--this->deliver_window < 0)
+        throw std::runtime_error("Exit sent past its window.");
+      stream.insert(stream.end(), msg.data.data,
+                    msg.data.data + msg.data.size);
+      if (this->deliver_window <=
+          CIRCUIT_WINDOW_START - CIRCUIT_WINDOW_INCREMENT) {
+        this->deliver_window += CIRCUIT_WINDOW_INCREMENT;
+        this->send_relay(hop, RelayCommand::SENDME, nullptr, 0);
+      }
+    } else if (msg.command == RelayCommand::SENDME) {
+      std::lock_guard<std::mutex> lock(this->window_mtx);
+      this->package_window += CIRCUIT_WINDOW_INCREMENT;
+      this->window_cv.notify_all();
+    } else if (msg.command == RelayCommand::END) {
+      this->close_window();
+      throw std::runtime_error("Received EOF.");
+    }
+  }
+}
+
+/**
+ * Get the destination as a string.
+ */
+std::string OnionNetworkDriver::get_remote_info() { return this->remote_info; }
+
+/**
+ * Applies to the link to the first hop.
+ */
+void OnionNetworkDriver::set_nodelay(bool nodelay) {
+  this->guard->set_nodelay(nodelay);
+}
+
+/**
+ * Adds one hop: CREATE to the first relay, EXTEND through the last hop for
+ * every later one. Each hop gets a fresh ephemeral keypair.
+ */
+void OnionNetworkDriver::extend(const std::string &address, int port) {
+  std::pair<SecByteBlock, SecByteBlock> keypair =
+      this->kem_driver->generate_keypair();
+  SecByteBlock ct;
+  if (this->layers.empty()) {
+    unsigned char create[CELL_SIZE];
+    put_cell(this->circuit_id, MessageType::Onion_Create,
+             keypair.first.BytePtr(), keypair.first.size(), create);
+    this->guard->send_bytes(ByteView{create, CELL_SIZE});
+
+    this->guard->read_bytes(this->read_cell.data(), CELL_SIZE);
+    Cell_View created;
+    created.parse(this->read_cell.data());
+    if (created.command != MessageType::Onion_Created ||
+        created.circuit_id != this->circuit_id)
+      throw std::runtime_error("First relay refused the circuit.");
+    ct.Assign(created.payload, created.size);
+  } else {
+    RelayTarget target;
+    target.address = address;
+    target.port = port;
+    target.public_value = keypair.first;
+    std::vector<unsigned char> extend;
+    target.serialize(extend);
+    this->send_relay(this->layers.size() - 1, RelayCommand::EXTEND,
+                     extend.data(), extend.size());
+
+    size_t hop;
+    Relay_View extended = this->read_relay(&hop);
+    if (extended.command != RelayCommand::EXTENDED)
+      throw std::runtime_error("Could not extend circuit to " + address +
+                               ":" + std::to_string(port) + ".");
+    ct.Assign(extended.data.data, extended.data.size);
+  }
+  SecByteBlock shared_secret =
+      this->kem_driver->decapsulate(ct, keypair.second);
+  this->layers.push_back(
+      this->crypto_driver->OnionLayer_generate(shared_secret));
+}
+
+/**
+ * Seals a relay cell for the given hop and wraps it in every layer before
+ * it.
+ */
+void OnionNetworkDriver::wrap(size_t hop, unsigned char *cell) {
+  unsigned char *payload = cell + CELL_HEADER_SIZE;
+  this->layers[hop]->seal(OnionDirection::FORWARD, payload, CELL_PAYLOAD_SIZE);
+  for (size_t i = hop; i-- > 0;)
+    this->layers[i]->crypt(OnionDirection::FORWARD, payload,
+                           CELL_PAYLOAD_SIZE);
+}
+
+/**
+ * Sends one relay cell to the given hop.
+ */
+void OnionNetworkDriver::send_relay(size_t hop, RelayCommand::T command,
+                                    const unsigned char *data, size_t size) {
+  unsigned char cell[CELL_SIZE];
+  put_relay_cell(this->circuit_id, command, data, size, cell);
+  std::lock_guard<std::mutex> lock(this->send_mtx);
+  this->wrap(hop, cell);
+  this->guard->send_bytes(ByteView{cell, CELL_SIZE});
+}
+
+/**
+ * Length-prefixes a frame and splits it across RELAY_DATA cells for the
+ * exit, sending as many per write as the package window allows.
+ */
+void OnionNetworkDriver::send_stream(const std::vector<ByteView> &parts) {
+  std::vector<unsigned char> &stream = this->send_stream_buffer;
+  size_t length = 0;
+  for (const ByteView &part : parts)
+    length += part.size;
+  stream.resize(sizeof(uint32_t));
+  stream[0] = (length >> 24) & 0xff;
+  stream[1] = (length >> 16) & 0xff;
+  stream[2] = (length >> 8) & 0xff;
+  stream[3] = length & 0xff;
+  for (const ByteView &part : parts)
+    stream.insert(stream.end(), part.data, part.data + part.size);
+
+  size_t offset = 0;
+  while (offset < stream.size()) {
+    size_t remaining = (stream.size() - offset + RELAY_DATA_SIZE - 1) /
+                       RELAY_DATA_SIZE;
+    size_t num_cells = this->take_window(remaining);
+    std::lock_guard<std::mutex> lock(this->send_mtx);
+    this->send_cells.resize(num_cells * CELL_SIZE);
+    for (size_t i = 0; i < num_cells; i++) {
+      unsigned char *cell = &this->send_cells[i * CELL_SIZE];
+      size_t length = std::min(RELAY_DATA_SIZE, stream.size() - offset);
+      put_relay_cell(this->circuit_id, RelayCommand::DATA, &stream[offset],
+                     length, cell);
+      this->wrap(this->layers.size() - 1, cell);
+      offset += length;
+    }
+    this->guard->send_bytes(
+        ByteView{this->send_cells.data(), this->send_cells.size()});
+  }
+}
+
+/**
+ * Waits until the package window is open, then takes up to wanted cells
+ * from it.
+ * @return Number of cells that may be sent, at least one.
+ * @throws error if the circuit closes while waiting.
+ */
+size_t OnionNetworkDriver::take_window(size_t wanted) {
+  std::unique_lock<std::mutex> lock(this->window_mtx);
+  this->window_cv.wait(lock, [this]() {
+    return this->package_window > 0 || this->window_closed;
+  });
+  if (this->window_closed)
+    throw std::runtime_error("Circuit closed.");
+  size_t granted = std::min<size_t>(wanted, this->package_window);
+  this->package_window -= granted;
+  return granted;
+}
+
+/**
+ * Wakes any sender waiting for window, for good.
+ */
+void OnionNetworkDriver::close_window() {
+  std::lock_guard<std::mutex> lock(this->window_mtx);
+  this->window_closed = true;
+  this->window_cv.notify_all();
+}
+
+/**
+ * Reads the next relay cell and peels layers until one hop recognizes it.
+ * The view points into read_cell and is valid until the next read.
+ * @param hop Set to the index of the hop that sent the cell.
+ * @throws error when the circuit is destroyed or the cell is unrecognized.
+ */
+Relay_View OnionNetworkDriver::read_relay(size_t *hop) {
+  this->guard->read_bytes(this->read_cell.data(), CELL_SIZE);
+  Cell_View cell;
+  cell.parse(this->read_cell.data());
+  if (cell.circuit_id != this->circuit_id)
+    throw std::runtime_error("Cell for unknown circuit.");
+  if (cell.command == MessageType::Onion_Destroy)
+    throw std::runtime_error("Received EOF.");
+  if (cell.command != MessageType::Onion_Relay ||
+      cell.size != CELL_PAYLOAD_SIZE)
+    throw std::runtime_error("Unexpected onion cell.");
+  for (*hop = 0; *hop < this->layers.size(); (*hop)++) {
+    if (this->layers[*hop]->open(OnionDirection::BACKWARD, cell.payload,
+                                 cell.size)) {
+      Relay_View msg;
+      msg.parse(cell.payload, cell.size);
+      return msg;
+    }
+  }
+  throw std::runtime_error("Unrecognized relay cell.");
+}
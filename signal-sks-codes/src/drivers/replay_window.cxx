@@ -0,0 +1,136 @@
+#include <cstring>
+#include <stdexcept>
+
+#include "../../include/drivers/replay_window.hpp"
+
+/**
+ * True if a message at this position has not been seen and is not too old
+ * to tell.
+ */
+bool ReplayWindow::fresh(uint32_t counter) const {
+  if (counter >= this->next)
+    return true;
+  if (this->next - counter > SIZE)
+    return false;
+  uint32_t bit = counter % SIZE;
+  return !(this->bits[bit / WORD_BITS] & (1ULL << (bit % WORD_BITS)));
+}
+
+/**
+ * Records a message at this position, sliding the window forward if it is
+ * the highest yet. Positions the window slides over start out unseen.
+ */
+void ReplayWindow::mark(uint32_t counter) {
+  if (counter >= this->next) {
+    if (counter - this->next >= SIZE) {
+      std::memset(this->bits, 0, sizeof(this->bits));
+    } else {
+      for (uint64_t c = this->next; c < counter; c++) {
+        uint32_t bit = c % SIZE;
+        this->bits[bit / WORD_BITS] &= ~(1ULL << (bit % WORD_BITS));
+      }
+    }
+    this->next = (uint64_t)counter + 1;
+  } else if (this->next - counter > SIZE) {
+    return;
+  }
+  uint32_t bit = counter % SIZE;
+  this->bits[bit / WORD_BITS] |= 1ULL << (bit % WORD_BITS);
+}
+
+/**
+ * Constructor.
+ * @param capacity most keys held at once
+ */
+SkippedKeys::SkippedKeys(size_t capacity) : capacity(capacity), oldest(0) {
+  if (capacity == 0)
+    throw std::runtime_error("SkippedKeys needs room for at least one key.");
+}
+
+uint64_t SkippedKeys::slot_key(uint32_t epoch, uint32_t counter) {
+  return ((uint64_t)epoch << 32) | counter;
+}
+
+/**
+ * Wipes a slot and drops it from the index.
+ */
+void SkippedKeys::clear_slot(size_t slot) {
+  if (!this->live[slot])
+    return;
+  this->index.erase(this->ids[slot]);
+  std::memset(this->keys.BytePtr() + slot * KEY_SIZE, 0, KEY_SIZE);
+  this->live[slot] = false;
+}
+
+/**
+ * Stores the key of a skipped message, evicting the oldest key if full.
+ */
+void SkippedKeys::put(uint32_t epoch, uint32_t counter,
+                      const SecByteBlock &key) {
+  if (key.size() != KEY_SIZE)
+    throw std::runtime_error("Skipped message key has the wrong size.");
+  if (this->keys.empty()) {
+    this->keys.CleanNew(this->capacity * KEY_SIZE);
+    this->ids.assign(this->capacity, 0);
+    this->live.assign(this->capacity, false);
+    this->index.reserve(this->capacity);
+  }
+  uint64_t id = slot_key(epoch, counter);
+  auto it = this->index.find(id);
+  size_t slot;
+  if (it != this->index.end()) {
+    slot = it->second;
+  } else {
+    slot = this->oldest;
+    this->oldest = (this->oldest + 1) % this->capacity;
+    this->clear_slot(slot);
+    this->ids[slot] = id;
+    this->live[slot] = true;
+    this->index[id] = slot;
+  }
+  std::memcpy(this->keys.BytePtr() + slot * KEY_SIZE, key.BytePtr(), KEY_SIZE);
+}
+
+/**
+ * Looks up the key of a skipped message, leaving it in place until the
+ * message verifies.
+ * @return false if the key was never stored, already taken or evicted
+ */
+bool SkippedKeys::find(uint32_t epoch, uint32_t counter, SecByteBlock &key) {
+  auto it = this->index.find(slot_key(epoch, counter));
+  if (it == this->index.end())
+    return false;
+  key.Assign(this->keys.BytePtr() + it->second * KEY_SIZE, KEY_SIZE);
+  return true;
+}
+
+/**
+ * Wipes the key of a message that has been received.
+ */
+void SkippedKeys::erase(uint32_t epoch, uint32_t counter) {
+  auto it = this->index.find(slot_key(epoch, counter));
+  if (it != this->index.end())
+    this->clear_slot(it->second);
+}
+
+/**
+ * Wipes every key from epochs before this one, once no chain can use them.
+ */
+void SkippedKeys::drop_epochs_before(uint32_t epoch) {
+  for (size_t slot = 0; slot < this->live.size(); slot++)
+    if (this->live[slot] && (this->ids[slot] >> 32) < epoch)
+      this->clear_slot(slot);
+}
+
+/**
+ * Wipes every key, e.g. when a new handshake starts the epochs over.
+ */
+void SkippedKeys::clear() {
+  for (size_t slot = 0; slot < this->live.size(); slot++)
+    this->clear_slot(slot);
+}
+
+/**
+ * Number of keys held.
+ */
+size_t SkippedKeys::size() { return this->index.size(); }
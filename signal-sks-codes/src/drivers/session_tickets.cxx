@@ -0,0 +1,87 @@
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+#include "../../include/drivers/drbg.hpp"
+#include "../../include/drivers/session_tickets.hpp"
+
+// Tickets are sealed with a fixed suite so any server holding the key can
+// open them, whatever suite the session itself negotiated.
+static const CipherSuite::T TICKET_SUITE = CipherSuite::CHACHA20_POLY1305;
+static const size_t TICKET_KEY_SIZE = 32;
+
+/**
+ * Constructor.
+ * @param crypto_driver driver to seal tickets with
+ * @param key ticket key; a random one, good until the process exits, if
+ * empty. Servers that derive it from a long-term secret keep honoring their
+ * tickets across restarts.
+ * @param lifetime seconds a ticket stays redeemable
+ */
+SessionTickets::SessionTickets(std::shared_ptr<CryptoDriver> crypto_driver,
+                               const SecByteBlock &key, uint32_t lifetime)
+    : crypto_driver(crypto_driver), key(key), lifetime(lifetime) {
+  if (this->key.empty()) {
+    this->key.New(TICKET_KEY_SIZE);
+    DRBG::generate(this->key, this->key.size());
+  }
+  if (this->key.size() != TICKET_KEY_SIZE)
+    throw std::runtime_error("SessionTickets needs a 32-byte key.");
+}
+
+/**
+ * @brief Seals a session's state into a ticket for its client.
+ * @param state what to resume from; its ticket field is ignored
+ * @return Opaque ticket: IV, then ciphertext, each behind a u32 length.
+ */
+SecByteBlock SessionTickets::issue(const SessionTicket &state) {
+  SessionTicket sealed = state;
+  sealed.ticket.CleanNew(0);
+  std::vector<unsigned char> plaintext(sizeof(uint32_t));
+  put_u32((uint32_t)std::time(nullptr), plaintext.data());
+  sealed.serialize(plaintext);
+
+  std::pair<std::string, SecByteBlock> ciphertext =
+      this->crypto_driver->AEAD_encrypt(
+          TICKET_SUITE, this->key,
+          std::string(plaintext.begin(), plaintext.end()), "");
+  std::memset(plaintext.data(), 0, plaintext.size());
+  std::vector<unsigned char> ticket;
+  put_bytes(ciphertext.second.BytePtr(), ciphertext.second.size(), ticket);
+  put_bytes((const unsigned char *)ciphertext.first.data(),
+            ciphertext.first.size(), ticket);
+  return SecByteBlock(ticket.data(), ticket.size());
+}
+
+/**
+ * @brief Opens a ticket presented by a client.
+ * @param ticket as issued
+ * @param state set to the sealed state, with the ticket field left empty
+ * @return false if the ticket was not issued with our key, was tampered with,
+ * or has expired
+ */
+bool SessionTickets::redeem(const SecByteBlock &ticket, SessionTicket &state) {
+  try {
+    ByteView iv, ciphertext;
+    size_t n = get_bytes(&iv, ticket.BytePtr(), ticket.size(), 0);
+    n += get_bytes(&ciphertext, ticket.BytePtr(), ticket.size(), n);
+    if (n != ticket.size())
+      return false;
+    std::pair<std::string, bool> plaintext = this->crypto_driver->AEAD_decrypt(
+        TICKET_SUITE, this->key, SecByteBlock(iv.data, iv.size),
+        std::string((const char *)ciphertext.data, ciphertext.size), "");
+    if (!plaintext.second || plaintext.first.size() < sizeof(uint32_t))
+      return false;
+    uint32_t issued = get_u32((const unsigned char *)plaintext.first.data());
+    uint32_t now = (uint32_t)std::time(nullptr);
+    if (now < issued || now - issued > this->lifetime)
+      return false;
+    std::vector<unsigned char> data(plaintext.first.begin() + sizeof(uint32_t),
+                                    plaintext.first.end());
+    state.deserialize(data);
+    std::memset(data.data(), 0, data.size());
+    return true;
+  } catch (std::runtime_error &_) {
+    return false;
+  }
+}
@@ -6,6 +6,7 @@
 #include <boost/lexical_cast.hpp>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
 #include <string>
@@ -18,27 +19,271 @@
  * @param command One of "listen" or "connect"
  * @param address Address to listen on or connect to.
  * @param port Port to listen on or connect to.
+ * @param keypair_pool Pool to draw Kyber keypairs from; may be shared between
+ * clients. Its parameter set is the one we ask for in the key exchange. A
+ * private Kyber512 pool is created if none is given.
+ * @param key_store Holds our long-term Kyber512 keypair, created on first
+ * use, and the peers we trust. Given one, the key exchange is authenticated.
+ * @param peer_key_id Long-term key ID of the peer to authenticate to, making
+ * us the initiator. Without one, we respond to any trusted peer.
+ * @param tickets Seals session tickets; given one, we are the server side and
+ * let clients resume with a ticket instead of running the full handshake.
  */
 Client::Client(std::shared_ptr<NetworkDriver> network_driver,
-               std::shared_ptr<CryptoDriver> crypto_driver) {
+               std::shared_ptr<CryptoDriver> crypto_driver,
+               std::shared_ptr<KeypairPool> keypair_pool,
+               std::shared_ptr<KeyStore> key_store, SecByteBlock peer_key_id,
+               std::shared_ptr<SessionTickets> tickets) {
   // Make shared variables.
   this->cli_driver = std::make_shared<CLIDriver>();
+  this->keypair_pool = keypair_pool;
+  if (!this->keypair_pool)
+    this->keypair_pool =
+        std::make_shared<KeypairPool>(std::make_shared<KEMDriver>());
+  this->kem_params = this->keypair_pool->params();
+  this->kem_driver = std::make_shared<KEMDriver>(this->kem_params);
   this->crypto_driver = crypto_driver;
   this->network_driver = network_driver;
+  this->cipher_suite = CipherSuite::AES_CBC_HMAC_SHA256;
+  this->rng = std::make_shared<DRBGRandomPool>();
+  this->switched = false;
+  this->announce = false;
+  this->skipped_keys = SkippedKeys(MAX_SKIPPED_KEYS);
+  this->early_bytes = 0;
+  this->exchanged = false;
+  this->key_store = key_store;
+  this->peer_key_id = peer_key_id;
+  this->tickets = tickets;
+  this->responder = tickets || (key_store && peer_key_id.empty());
+  if (this->key_store)
+    this->identity = this->key_store->long_term_key_id(
+        []() { return KEMDriver().generate_keypair(); });
 }
 
 /**
- * Generates a new DH secret and replaces the keys. This function should:
- * 1) Call `DH_generate_shared_key`
- * 2) Use the resulting key in `AES_generate_key` and `HMAC_generate_key`
- * 3) Update private key variables
+ * Makes a fresh KEM keypair our current one, keeping the old current keypair
+ * as previous so a step the peer encapsulated to it can still be taken. The
+ * keypair is popped from keypair_pool, whose worker thread runs keygen ahead
+ * of time.
  */
 void Client::prepare_keys() {
-  uint8_t pk[pqcrystals_kyber512_PUBLICKEYBYTES];
-  uint8_t sk[pqcrystals_kyber512_SECRETKEYBYTES];
-  pqcrystals_kyber512_ref_keypair(pk, sk);
-  current_public_value = SecByteBlock(&pk[0], pqcrystals_kyber512_PUBLICKEYBYTES);
-  current_private_value = SecByteBlock(&sk[0], pqcrystals_kyber512_SECRETKEYBYTES);
+  std::shared_ptr<OwnKeys> keys = std::make_shared<OwnKeys>();
+  keys->current = keypair_pool->pop();
+  keys->current_params = keypair_pool->params();
+  std::shared_ptr<const OwnKeys> old = own_keys.load();
+  if (old) {
+    keys->previous = old->current;
+    keys->previous_params = old->current_params;
+  }
+  own_keys.store(keys);
+}
+
+/**
+ * Starts the chain for one direction of an epoch from a fresh KEM shared
+ * secret, mixed with the secret from the handshake.
+ */
+std::shared_ptr<RatchetChain>
+Client::start_chain(uint32_t epoch, const SecByteBlock &key_id,
+                    const SecByteBlock &shared_secret) {
+  std::shared_ptr<RatchetChain> chain = std::make_shared<RatchetChain>();
+  chain->epoch = epoch;
+  chain->key_id = key_id;
+  chain->counter = 0;
+  chain->chain_key =
+      crypto_driver->hybrid_shared_key(handshake_key, shared_secret);
+  chain->started = std::chrono::steady_clock::now();
+  return chain;
+}
+
+/**
+ * Steps a chain up to the message at `counter`.
+ * @param message_key set to the key of the message at `counter`
+ * @param skipped if given, gets the keys of the messages skipped on the way;
+ * otherwise they are dropped
+ * @return The chain as it stands after that message; null if `counter` is
+ * behind the chain, too far ahead of it, or the last position a chain has.
+ */
+std::shared_ptr<RatchetChain>
+Client::advance_chain(const RatchetChain &chain, uint32_t counter,
+                      SecByteBlock &message_key,
+                      std::vector<std::pair<uint32_t, SecByteBlock>> *skipped) {
+  if (counter < chain.counter || counter - chain.counter > MAX_CHAIN_SKIP ||
+      counter == UINT32_MAX)
+    return nullptr;
+  std::shared_ptr<RatchetChain> next = std::make_shared<RatchetChain>(chain);
+  // The chain key steps in place; only skipped keys that are kept get a
+  // block of their own.
+  message_key.New(SHA256::DIGESTSIZE);
+  while (true) {
+    crypto_driver->chain_step(bytes_of(next->chain_key),
+                              buffer_of(next->chain_key),
+                              buffer_of(message_key));
+    if (next->counter == counter) {
+      next->counter++;
+      return next;
+    }
+    if (skipped)
+      skipped->emplace_back(next->counter, message_key);
+    next->counter++;
+  }
+}
+
+/**
+ * Encrypts and tags one message under its message key, straight into the
+ * room for its sealed fields. The legacy suite pads and encrypts with CBC and
+ * puts the HMAC of iv || header || ciphertext in mac; AEAD suites append the
+ * tag to the ciphertext, authenticate the header as associated data and leave
+ * mac empty. The plaintext may already sit where the ciphertext goes.
+ * @param sealed room sized by CipherContext for the cipher suite
+ */
+void Client::encrypt_message(const SecByteBlock &message_key,
+                             ByteView plaintext, const SecByteBlock &header,
+                             const Message_Frame &sealed) {
+  FixedSizeSecBlock<byte, MAX_KEY_MATERIAL_SIZE> keys;
+  MutableByteView key_material{keys,
+                               CipherContext::key_material_size(cipher_suite)};
+  crypto_driver->CipherContext_derive_keys(bytes_of(message_key),
+                                           key_material);
+  if (cipher_suite == CipherSuite::AES_CBC_HMAC_SHA256) {
+    ByteView aes_key{keys, AES::DEFAULT_KEYLENGTH};
+    ByteView hmac_key{keys + AES::DEFAULT_KEYLENGTH, SHA256::BLOCKSIZE};
+    crypto_driver->AES_encrypt(aes_key, plaintext, sealed.iv,
+                               sealed.ciphertext);
+    crypto_driver->HMAC_generate(
+        hmac_key,
+        {ByteView{sealed.iv.data, sealed.iv.size}, bytes_of(header),
+         ByteView{sealed.ciphertext.data, sealed.ciphertext.size}},
+        sealed.mac);
+    return;
+  }
+  crypto_driver->AEAD_encrypt(cipher_suite,
+                              ByteView{key_material.data, key_material.size},
+                              plaintext, bytes_of(header), sealed.iv,
+                              sealed.ciphertext);
+}
+
+/**
+ * Verifies and decrypts one message under its message key, in place: the
+ * plaintext overwrites the front of the ciphertext. The legacy suite checks
+ * the HMAC before touching the ciphertext.
+ * @param ciphertext the message's ciphertext, writable
+ * @return Pair of the plaintext, inside ciphertext, and whether it verified.
+ */
+std::pair<ByteView, bool>
+Client::decrypt_message(const SecByteBlock &message_key,
+                        const Message_View &msg, MutableByteView ciphertext,
+                        const SecByteBlock &header) {
+  std::pair<ByteView, bool> failed = std::make_pair(ByteView(), false);
+  FixedSizeSecBlock<byte, MAX_KEY_MATERIAL_SIZE> keys;
+  MutableByteView key_material{keys,
+                               CipherContext::key_material_size(cipher_suite)};
+  crypto_driver->CipherContext_derive_keys(bytes_of(message_key),
+                                           key_material);
+  ByteView sealed{ciphertext.data, ciphertext.size};
+  if (cipher_suite == CipherSuite::AES_CBC_HMAC_SHA256) {
+    ByteView aes_key{keys, AES::DEFAULT_KEYLENGTH};
+    ByteView hmac_key{keys + AES::DEFAULT_KEYLENGTH, SHA256::BLOCKSIZE};
+    if (!crypto_driver->HMAC_verify(hmac_key,
+                                    {msg.iv, bytes_of(header), sealed},
+                                    msg.mac))
+      return failed;
+    try {
+      size_t size =
+          crypto_driver->AES_decrypt(aes_key, msg.iv, sealed, ciphertext);
+      return std::make_pair(ByteView{ciphertext.data, size}, true);
+    } catch (std::runtime_error &_) {
+      return failed;
+    }
+  }
+  if (ciphertext.size < AEAD_TAG_SIZE)
+    return failed;
+  MutableByteView plaintext{ciphertext.data, ciphertext.size - AEAD_TAG_SIZE};
+  if (!crypto_driver->AEAD_decrypt(
+          cipher_suite, ByteView{key_material.data, key_material.size},
+          msg.iv, sealed, bytes_of(header), plaintext))
+    return failed;
+  return std::make_pair(ByteView{plaintext.data, plaintext.size}, true);
+}
+
+/**
+ * Opens a message on one of our receiving chains. A message behind the
+ * chain's position takes its key from the skipped-key cache, and one ahead
+ * of it steps the chain, caching the keys of the messages it skips. Nothing
+ * changes unless the message verifies.
+ * @param next set to the chain as it stands after the message
+ */
+std::pair<ByteView, bool>
+Client::open_message(const RatchetChain &chain, const Message_View &msg,
+                     MutableByteView ciphertext, const SecByteBlock &header,
+                     std::shared_ptr<RatchetChain> &next) {
+  std::pair<ByteView, bool> failed = std::make_pair(ByteView(), false);
+  if (!chain.window.fresh(msg.counter))
+    return failed;
+  SecByteBlock message_key;
+  std::vector<std::pair<uint32_t, SecByteBlock>> skipped;
+  bool late = msg.counter < chain.counter;
+  if (late) {
+    if (!skipped_keys.find(chain.epoch, msg.counter, message_key))
+      return failed;
+    next = std::make_shared<RatchetChain>(chain);
+  } else {
+    next = advance_chain(chain, msg.counter, message_key, &skipped);
+    if (!next)
+      return failed;
+  }
+  std::pair<ByteView, bool> result =
+      decrypt_message(message_key, msg, ciphertext, header);
+  if (!result.second)
+    return result;
+  if (late)
+    skipped_keys.erase(chain.epoch, msg.counter);
+  for (const std::pair<uint32_t, SecByteBlock> &key : skipped)
+    skipped_keys.put(chain.epoch, key.first, key.second);
+  next->window.mark(msg.counter);
+  return result;
+}
+
+/**
+ * Whether the ratchet policy calls for a KEM step before the next message on
+ * this sending chain. A session's first message always runs one.
+ */
+bool Client::kem_step_due(const std::shared_ptr<const RatchetChain> &chain) {
+  if (!chain)
+    return true;
+  if (ratchet_policy.messages > 0 && chain->counter >= ratchet_policy.messages)
+    return true;
+  return ratchet_policy.seconds > 0 &&
+         std::chrono::steady_clock::now() - chain->started >=
+             std::chrono::seconds(ratchet_policy.seconds);
+}
+
+/**
+ * Sets when the ratchet runs its KEM step. Call before the key exchange.
+ */
+void Client::set_ratchet_policy(RatchetPolicy policy) {
+  ratchet_policy = policy;
+}
+
+/**
+ * The key ID is a truncated hash of the public value the KEM ciphertext was
+ * made for, the sender's new public value and the ciphertext. Tagging it
+ * binds a message to all three without re-tagging them, and lets the
+ * receiver tell which of its keypairs to decapsulate with.
+ */
+SecByteBlock Client::chain_key_id(ByteView recipient_public_value,
+                                  ByteView sender_public_value, ByteView ct) {
+  SecByteBlock key_id(KEY_ID_SIZE);
+  crypto_driver->hash({recipient_public_value, sender_public_value, ct},
+                      buffer_of(key_id));
+  return key_id;
+}
+
+/**
+ * Whether a received key ID is the one we hold.
+ */
+static bool same_key_id(const SecByteBlock &key_id, ByteView other) {
+  return key_id.size() == other.size &&
+         std::memcmp(key_id.BytePtr(), other.data, other.size) == 0;
 }
 
 /**
@@ -48,38 +293,90 @@ void Client::prepare_keys() {
  * 2) Encrypt and tag the message.
  */
 Message_Message Client::send(std::string plaintext) {
-  // Grab the lock to avoid race conditions between the receive and send threads
-  // Lock will automatically release at the end of the function.
-  std::unique_lock<std::mutex> lck(this->mtx);
-  // TODO: implement me!
-  SecByteBlock ct_block(1);
-  if (switched){
+  Message_Message message;
+  SecByteBlock message_key;
+  SecByteBlock header = next_message(message, message_key);
+  message.iv.New(CipherContext::iv_size(cipher_suite));
+  message.ciphertext.resize(
+      CipherContext::ciphertext_size(cipher_suite, plaintext.size()));
+  message.mac.resize(CipherContext::mac_size(cipher_suite));
+  encrypt_message(message_key, bytes_of(plaintext), header,
+                  Message_Frame{buffer_of(message.iv),
+                                buffer_of(message.ciphertext),
+                                buffer_of(message.mac)});
+  return message;
+}
+
+/**
+ * Encrypts the given message straight into a serialized Message frame, ready
+ * for the network: the header goes in first and the plaintext is encrypted
+ * into the room left after it, with no intermediate ciphertext.
+ * @param frame cleared and refilled; reusing one keeps its capacity
+ */
+void Client::send(ByteView plaintext, std::vector<unsigned char> &frame) {
+  Message_Message message;
+  SecByteBlock message_key;
+  SecByteBlock header = next_message(message, message_key);
+  frame.clear();
+  Message_Frame sealed = message.serialize_frame(
+      CipherContext::iv_size(cipher_suite),
+      CipherContext::ciphertext_size(cipher_suite, plaintext.size),
+      CipherContext::mac_size(cipher_suite), frame);
+  encrypt_message(message_key, plaintext, header, sealed);
+}
+
+/**
+ * Steps the sending ratchet for the next message. The KEM step runs only when
+ * the other party has a new public value out and the ratchet policy calls for
+ * it; every message steps the sending chain. Only touches the sending chain,
+ * so it never waits on receive().
+ * @param message gets its epoch, counter, key ID, and any public value and
+ * KEM ciphertext
+ * @param message_key set to the key to seal the message with
+ * @return The header to authenticate with the message.
+ */
+SecByteBlock Client::next_message(Message_Message &message,
+                                  SecByteBlock &message_key) {
+  std::shared_ptr<const RatchetChain> chain = sending_chain.load();
+  if (switched.load() && kem_step_due(chain)) {
+    switched.store(false);
     //sending new public key
     prepare_keys();
+    std::shared_ptr<const OwnKeys> keys = own_keys.load();
+    const SecByteBlock &public_value = keys->current.first;
+    std::shared_ptr<const PeerKey> other = other_public_value.load();
     //sending new shared secret
-    uint8_t ss[pqcrystals_kyber512_BYTES];
-    uint8_t ct[pqcrystals_kyber512_CIPHERTEXTBYTES];
-    randombytes(ss, pqcrystals_kyber512_BYTES);
-    pqcrystals_kyber512_ref_enc(ct, ss, &last_other_public_value[0]);
-    ct_block = SecByteBlock(&ct[0], pqcrystals_kyber512_CIPHERTEXTBYTES);
-    SecByteBlock shared_secret(&ss[0], pqcrystals_kyber512_BYTES);
-    SecByteBlock nss = crypto_driver->hash(shared_secret);
-    AES_key = crypto_driver->AES_generate_key(nss);
-    HMAC_key = crypto_driver->HMAC_generate_key(nss);
-    switched = false;
-  }
-
-  std::pair<std::string, SecByteBlock> cipher_iv = crypto_driver->AES_encrypt(AES_key, plaintext);
-  std::string ciphertext = cipher_iv.first;
-  SecByteBlock iv = cipher_iv.second;
-  std::string mac = crypto_driver->HMAC_generate(HMAC_key, concat_msg_fields(iv, current_public_value, ciphertext));
-  Message_Message message;
-  message.iv = iv;
-  message.public_value = current_public_value;
-  message.ciphertext = ciphertext;
-  message.ct = ct_block;
-  message.mac = mac;
-  return message;
+    std::pair<SecByteBlock, SecByteBlock> ct_ss =
+        KEMDriver(other->params).encapsulate(other->public_value);
+    chain = start_chain(chain ? chain->epoch + 1 : 1,
+                        chain_key_id(bytes_of(other->public_value),
+                                     bytes_of(public_value),
+                                     bytes_of(ct_ss.first)),
+                        ct_ss.second);
+    // The KEM step carries our public value anyway.
+    announce.store(false);
+    // Only the first message of an epoch carries the public value and KEM
+    // ciphertext.
+    message.public_value = public_value;
+    message.ct = ct_ss.first;
+  } else if (announce.exchange(false)) {
+    // A resumed session has no public value of ours yet; announcing one
+    // lets the other party run the next KEM step. It goes under the tag.
+    message.public_value = own_keys.load()->current.first;
+  }
+  if (chain->counter == UINT32_MAX)
+    throw std::runtime_error("Sending chain is exhausted; it needs a KEM "
+                             "step.");
+  message.epoch = chain->epoch;
+  message.counter = chain->counter;
+  message.key_id = chain->key_id;
+  SecByteBlock header =
+      epoch_header(chain->epoch, chain->counter, chain->key_id);
+  if (message.ct.size() == 0)
+    header += message.public_value;
+
+  sending_chain.store(advance_chain(*chain, chain->counter, message_key));
+  return header;
 }
 
 /**
@@ -89,23 +386,190 @@ Message_Message Client::send(std::string plaintext) {
  * 2) Decrypt and verify the message.
  */
 std::pair<std::string, bool> Client::receive(Message_Message msg) {
-  // Grab the lock to avoid race conditions between the receive and send threads
-  // Lock will automatically release at the end of the function.
-  std::unique_lock<std::mutex> lck(this->mtx);
-  if (!switched){
-    last_other_public_value = msg.public_value;
+  std::pair<ByteView, bool> result =
+      receive_in_place(msg.view(), buffer_of(msg.ciphertext));
+  if (!result.second)
+    return std::make_pair(std::string(), false);
+  return std::make_pair(
+      std::string((const char *)result.first.data, result.first.size), true);
+}
+
+/**
+ * Decrypts and verifies a serialized Message in the buffer it was read into,
+ * without copying it out: the plaintext overwrites the ciphertext.
+ *
+ * A message of the next epoch that arrives before the one carrying that
+ * epoch's KEM ciphertext cannot be opened yet. It is copied out and held,
+ * within MAX_SKIPPED_KEYS messages and MAX_EARLY_BYTES, and opened once its
+ * epoch starts; take_released hands over what it said.
+ * @param frame a whole Message frame, writable
+ * @param held set if the message did not verify only because it was held
+ * @return Pair of the plaintext, a view into frame, and whether it verified.
+ * @throws std::runtime_error if the frame is not a well-formed Message.
+ */
+std::pair<ByteView, bool> Client::receive(MutableByteView frame, bool *held) {
+  Message_View msg;
+  msg.parse(frame.data, frame.size);
+  MutableByteView ciphertext{
+      frame.data + (msg.ciphertext.data - frame.data), msg.ciphertext.size};
+  return receive_in_place(msg, ciphertext, held);
+}
+
+/**
+ * Plaintexts of held messages that have been opened since the last call, in
+ * the order they arrived.
+ */
+std::vector<std::string> Client::take_released() {
+  std::vector<std::string> texts;
+  texts.swap(released);
+  return texts;
+}
+
+/**
+ * Copies a message of the next epoch out to wait for that epoch to start.
+ * @return false if there is no room left to hold it
+ */
+bool Client::hold_early(const Message_View &msg) {
+  size_t size = msg.key_id.size + msg.iv.size + msg.public_value.size +
+                msg.ciphertext.size + msg.mac.size;
+  if (early_messages.size() >= MAX_SKIPPED_KEYS ||
+      early_bytes + size > MAX_EARLY_BYTES)
+    return false;
+  Message_Message message;
+  message.epoch = msg.epoch;
+  message.counter = msg.counter;
+  message.key_id.Assign(msg.key_id.data, msg.key_id.size);
+  message.iv.Assign(msg.iv.data, msg.iv.size);
+  message.public_value.Assign(msg.public_value.data, msg.public_value.size);
+  message.ciphertext.assign((const char *)msg.ciphertext.data,
+                            msg.ciphertext.size);
+  message.mac.assign((const char *)msg.mac.data, msg.mac.size);
+  early_messages.push_back(std::move(message));
+  early_bytes += size;
+  return true;
+}
+
+/**
+ * Opens the held messages of an epoch that has just started, or of any
+ * before it; those that do not verify now never will, and are dropped.
+ * Later ones keep waiting.
+ */
+void Client::release_early(uint32_t epoch) {
+  std::deque<Message_Message> waiting;
+  waiting.swap(early_messages);
+  early_bytes = 0;
+  for (Message_Message &message : waiting) {
+    Message_View msg = message.view();
+    if (message.epoch > epoch) {
+      hold_early(msg);
+      continue;
+    }
+    std::pair<ByteView, bool> result =
+        receive_in_place(msg, buffer_of(message.ciphertext));
+    if (result.second)
+      released.push_back(
+          std::string((const char *)result.first.data, result.first.size));
+  }
+}
+
+/**
+ * Both forms of receive. Only touches the receiving chain, so it never waits
+ * on send().
+ * @param ciphertext msg's ciphertext, writable, to decrypt in place
+ * @param held where to say whether the message was held; with none given,
+ * messages are not held
+ */
+std::pair<ByteView, bool>
+Client::receive_in_place(const Message_View &msg, MutableByteView ciphertext,
+                         bool *held) {
+  std::pair<ByteView, bool> failed = std::make_pair(ByteView(), false);
+  if (held)
+    *held = false;
+  std::shared_ptr<const RatchetChain> chain = receiving_chain.load();
+  // Only messages that start a new ratchet epoch carry a KEM ciphertext.
+  if (msg.ct.size > 0) {
+    if (chain && msg.epoch <= chain->epoch)
+      return failed;
+    // Find the keypair the sender encapsulated to.
+    std::shared_ptr<const OwnKeys> keys = own_keys.load();
+    const std::pair<SecByteBlock, SecByteBlock> *recipient = nullptr;
+    KEMParams::T recipient_params = kem_params;
+    if (same_key_id(chain_key_id(bytes_of(keys->current.first),
+                                 msg.public_value, msg.ct),
+                    msg.key_id)) {
+      recipient = &keys->current;
+      recipient_params = keys->current_params;
+    } else if (keys->previous.first.size() > 0 &&
+               same_key_id(chain_key_id(bytes_of(keys->previous.first),
+                                        msg.public_value, msg.ct),
+                           msg.key_id)) {
+      recipient = &keys->previous;
+      recipient_params = keys->previous_params;
+    }
+    if (!recipient)
+      return failed;
     //reading new shared secret
-    uint8_t ss[pqcrystals_kyber512_BYTES];
-    pqcrystals_kyber512_ref_dec(ss, &msg.ct[0], &current_private_value[0]);
-    SecByteBlock shared_secret(&ss[0], pqcrystals_kyber512_BYTES);
-    SecByteBlock nss = crypto_driver->hash(shared_secret);
-    AES_key = crypto_driver->AES_generate_key(nss);
-    HMAC_key = crypto_driver->HMAC_generate_key(nss);
-    switched = true;
+    SecByteBlock shared_secret = KEMDriver(recipient_params)
+                                     .decapsulate(SecByteBlock(msg.ct.data,
+                                                               msg.ct.size),
+                                                  recipient->second);
+    SecByteBlock key_id(msg.key_id.data, msg.key_id.size);
+    std::shared_ptr<RatchetChain> next;
+    SecByteBlock header = epoch_header(msg.epoch, msg.counter, key_id);
+    std::pair<ByteView, bool> result =
+        open_message(*start_chain(msg.epoch, key_id, shared_secret), msg,
+                     ciphertext, header, next);
+    // Only a message that verifies may move the ratchet forward.
+    if (!result.second)
+      return result;
+    // The epoch we leave stays open for stragglers; older ones are done.
+    if (chain)
+      skipped_keys.drop_epochs_before(chain->epoch);
+    previous_receiving_chain.store(chain);
+    receiving_chain.store(next);
+    if (!early_messages.empty())
+      release_early(msg.epoch);
+    // Every public value after the first is in the negotiated set.
+    other_public_value.store(std::make_shared<const PeerKey>(
+        PeerKey{SecByteBlock(msg.public_value.data, msg.public_value.size),
+                kem_params}));
+    switched.store(true);
+    return result;
   }
-  std::string plaintext = crypto_driver->AES_decrypt(AES_key, msg.iv, msg.ciphertext);
-  bool verified = crypto_driver->HMAC_verify(HMAC_key, concat_msg_fields(msg.iv, last_other_public_value, msg.ciphertext), msg.mac);
-  return std::make_pair(plaintext, verified);
+  // Every other message must name an epoch we hold keys for: the current
+  // one, or the one before for messages sent ahead of the latest KEM step.
+  // One of the next epoch overtook that epoch's first message, and waits.
+  AtomicSharedPtr<const RatchetChain> *slot = &receiving_chain;
+  if (!chain || msg.epoch != chain->epoch ||
+      !same_key_id(chain->key_id, msg.key_id)) {
+    uint32_t next_epoch = chain ? chain->epoch + 1 : 1;
+    slot = &previous_receiving_chain;
+    chain = slot->load();
+    if (!chain || msg.epoch != chain->epoch ||
+        !same_key_id(chain->key_id, msg.key_id)) {
+      if (held && msg.epoch == next_epoch)
+        *held = hold_early(msg);
+      return failed;
+    }
+  }
+  std::shared_ptr<RatchetChain> next;
+  SecByteBlock header = epoch_header(msg.epoch, msg.counter, chain->key_id);
+  if (msg.public_value.size > 0)
+    header += SecByteBlock(msg.public_value.data, msg.public_value.size);
+  std::pair<ByteView, bool> result =
+      open_message(*chain, msg, ciphertext, header, next);
+  if (!result.second)
+    return result;
+  slot->store(next);
+  // A resumed session learns the other party's first public value from an
+  // announcement, and answers it with a KEM step.
+  if (msg.public_value.size > 0 && !other_public_value.load()) {
+    other_public_value.store(std::make_shared<const PeerKey>(
+        PeerKey{SecByteBlock(msg.public_value.data, msg.public_value.size),
+                kem_params}));
+    switched.store(true);
+  }
+  return result;
 }
 
 /**
@@ -128,33 +592,369 @@ void Client::run(std::string command) {
 }
 
 /**
- * Run key exchange. This function:
- * 1) Listen for or generate and send DHParams_Message depending on `command`.
- * `command` can be either "listen" or "connect"; the listener should `read()`
- * for params, and the connector should generate and send params.
- * 2) Initialize DH object and keys
- * 3) Send your public value
- * 4) Listen for the other party's public value
- * 5) Generate DH, AES, and HMAC keys and set local variables
+ * Run key exchange. Unauthenticated and without tickets, both sides send
+ * their Kyber and X25519 public values at once and read the other's.
+ * Otherwise the initiator sends first and the responder answers. Either way
+ * it takes a single round trip, plus one more if a ticket is refused.
  */
 void Client::HandleKeyExchange(std::string command) {
+  std::vector<unsigned char> data = this->start_key_exchange();
+  if (!data.empty())
+    network_driver->send(data);
+  while (!this->handshake_complete()) {
+    std::vector<unsigned char> other_pk = network_driver->read();
+    std::vector<unsigned char> reply = this->finish_key_exchange(other_pk);
+    if (!reply.empty())
+      network_driver->send(reply);
+  }
+}
+
+/**
+ * Whether the key exchange is done and messages can flow. A responder that
+ * refused a ticket is still waiting for the full handshake.
+ */
+bool Client::handshake_complete() { return exchanged; }
+
+/**
+ * Keeps session tickets for this destination in the key store: the key
+ * exchange offers the one from the last session with the same peer, if any,
+ * instead of running the full handshake, and the ticket issued in its place
+ * is stored for next time. Call before starting the key exchange.
+ * @param destination address of the other party, e.g. "localhost:3000"
+ */
+void Client::resume_from(const std::string &destination) {
+  if (!key_store)
+    throw std::runtime_error("Session tickets are kept in the key store.");
+  ticket_destination.Assign((const unsigned char *)destination.data(),
+                            destination.size());
+  SecByteBlock id = KeyStore::key_id(ticket_destination);
+  if (key_store->kind(id) != KeyKind::TICKET)
+    return;
+  SecByteBlock stored = key_store->get(id).second;
+  std::vector<unsigned char> data(stored.begin(), stored.end());
+  std::shared_ptr<SessionTicket> state = std::make_shared<SessionTicket>();
+  try {
+    state->deserialize(data);
+  } catch (std::runtime_error &_) {
+    return;
+  }
+  std::memset(data.data(), 0, data.size());
+  // A ticket from a session with another peer would bypass authenticating
+  // to this one.
+  if (state->peer_key_id == peer_key_id)
+    ticket = state;
+}
+
+/**
+ * Holds on to a ticket the server issued, and stores it if we keep tickets.
+ */
+void Client::keep_ticket(const SessionTicket &state) {
+  ticket = std::make_shared<const SessionTicket>(state);
+  if (ticket_destination.empty())
+    return;
+  SessionTicket stored = state;
+  std::vector<unsigned char> data;
+  stored.serialize(data);
+  key_store->add(std::make_pair(ticket_destination,
+                                SecByteBlock(data.data(), data.size())),
+                 KeyKind::TICKET);
+  std::memset(data.data(), 0, data.size());
+}
+
+/**
+ * The ticket the server issued during the key exchange, to resume with next
+ * time; null if it issued none.
+ */
+std::shared_ptr<const SessionTicket> Client::session_ticket() {
+  return ticket;
+}
+
+/**
+ * Our public values for the key exchange, and our long-term key ID if we
+ * authenticate.
+ */
+PublicValue_Message Client::public_value_message() {
+  PublicValue_Message public_value_msg;
+  public_value_msg.public_value = own_keys.load()->current.first;
+  public_value_msg.dh_public_value = dh_public_value;
+  public_value_msg.cipher_suite = crypto_driver->AEAD_preferred_suite();
+  public_value_msg.kem_params = keypair_pool->params();
+  public_value_msg.sender_key_id = identity;
+  return public_value_msg;
+}
+
+/**
+ * Generates our first Kyber keypair and an X25519 keypair for a full
+ * handshake.
+ */
+void Client::begin_full_exchange() {
   prepare_keys();
-  std::vector<unsigned char> pk_vec(&current_public_value[0], &current_public_value[0] + pqcrystals_kyber512_PUBLICKEYBYTES);
-  network_driver->send(pk_vec);
-  
-  std::vector<unsigned char> other_pk = network_driver->read();
-  last_other_public_value = SecByteBlock(&other_pk[0], pqcrystals_kyber512_PUBLICKEYBYTES);
+  std::pair<SecByteBlock, SecByteBlock> dh_keys =
+      crypto_driver->X25519_generate_keypair();
+  dh_public_value = dh_keys.first;
+  dh_private_value = dh_keys.second;
+}
+
+/**
+ * First half of the key exchange, split out so that event-driven sessions can
+ * run it without blocking: returns the public values to send to the other
+ * party. An initiator also starts the authenticated key exchange towards the
+ * peer's long-term key. A client with a ticket sends it with a fresh nonce
+ * instead. A responder has nothing to send until the initiator's message
+ * arrives, and returns nothing.
+ */
+std::vector<unsigned char> Client::start_key_exchange() {
+  std::vector<unsigned char> data;
+  if (responder)
+    return data;
+  if (ticket) {
+    Resume_Message resume_msg;
+    resume_msg.ticket = ticket->ticket;
+    resume_nonce.New(RESUME_NONCE_SIZE);
+    rng->GenerateBlock(resume_nonce, resume_nonce.size());
+    resume_msg.nonce = resume_nonce;
+    resume_msg.serialize(data);
+    return data;
   }
+  begin_full_exchange();
+  PublicValue_Message public_value_msg = public_value_message();
+  if (key_store) {
+    std::pair<SecByteBlock, SecByteBlock> init =
+        KEMDriver().ake_init(key_store->get(peer_key_id).first);
+    public_value_msg.recipient_key_id = peer_key_id;
+    public_value_msg.ake_message = init.first;
+    ake_state = init.second;
+  }
+  public_value_msg.serialize(data);
+  return data;
+}
+
+/**
+ * Second half of the key exchange: agrees on the X25519 shared key, stores
+ * the other party's Kyber public value and settles on the cipher suite and
+ * Kyber parameter set both sides advertised. The first message each way then
+ * carries a Kyber ciphertext, and its chain is keyed from both secrets.
+ * Each first public value is in its sender's preferred set; every keypair
+ * after that is in the negotiated one, drawn from a private pool if the
+ * shared pool holds another set.
+ *
+ * With a key store, the key from the authenticated key exchange is mixed in
+ * as well, so only the holders of the two long-term keys can read or send
+ * messages; a peer that does not authenticate is refused. Both sides'
+ * offers are mixed in last, so if either was rewritten on the way the two
+ * sides end up with different keys rather than a weaker suite.
+ *
+ * A server with tickets seals the session's resumption secret into a ticket
+ * in its answer, and the client keeps it for next time. Resume messages are
+ * handed to finish_resume.
+ * @param other_public_value bytes received from the other party
+ * @return What a responder sends back, or a client whose ticket was refused;
+ * empty for everyone else.
+ */
+std::vector<unsigned char>
+Client::finish_key_exchange(std::vector<unsigned char> &other_public_value) {
+  if (!other_public_value.empty() &&
+      get_message_type(other_public_value) == MessageType::Resume)
+    return finish_resume(other_public_value);
+  PublicValue_Message public_value_msg;
+  public_value_msg.deserialize(other_public_value);
+  if (responder)
+    begin_full_exchange();
+  handshake_key = crypto_driver->X25519_generate_shared_key(
+      dh_private_value, public_value_msg.dh_public_value);
+  dh_private_value.CleanNew(0);
+
+  PublicValue_Message reply_msg;
+  if (responder && key_store) {
+    // Responder: the initiator must name our key and be a trusted peer.
+    if (public_value_msg.ake_message.size() == 0 ||
+        public_value_msg.recipient_key_id != identity ||
+        key_store->kind(public_value_msg.sender_key_id) != KeyKind::PEER)
+      throw std::runtime_error("Peer did not authenticate with a trusted "
+                               "long-term key.");
+    peer_key_id = public_value_msg.sender_key_id;
+    std::pair<SecByteBlock, SecByteBlock> response = KEMDriver().ake_respond(
+        public_value_msg.ake_message, key_store->get(identity).second,
+        key_store->get(peer_key_id).first);
+    handshake_key =
+        crypto_driver->hybrid_shared_key(handshake_key, response.second);
+    reply_msg = public_value_message();
+    reply_msg.recipient_key_id = peer_key_id;
+    reply_msg.ake_message = response.first;
+  } else if (responder) {
+    reply_msg = public_value_message();
+  } else if (key_store) {
+    // Initiator: the answer must come from the key we authenticated to.
+    if (public_value_msg.ake_message.size() == 0 ||
+        public_value_msg.sender_key_id != peer_key_id)
+      throw std::runtime_error("Peer did not authenticate with the expected "
+                               "long-term key.");
+    SecByteBlock ake_key =
+        KEMDriver().ake_finish(public_value_msg.ake_message, ake_state,
+                               key_store->get(identity).second);
+    ake_state.CleanNew(0);
+    handshake_key = crypto_driver->hybrid_shared_key(handshake_key, ake_key);
+  }
+
+  // Both sides' offers as each side saw them, the smaller first: peers that
+  // both connect have no initiator to put first.
+  unsigned char ours[2] = {(unsigned char)crypto_driver->AEAD_preferred_suite(),
+                           (unsigned char)keypair_pool->params()};
+  unsigned char theirs[2] = {(unsigned char)public_value_msg.cipher_suite,
+                             (unsigned char)public_value_msg.kem_params};
+  SecByteBlock offers = std::memcmp(ours, theirs, 2) < 0
+                            ? SecByteBlock(ours, 2) + SecByteBlock(theirs, 2)
+                            : SecByteBlock(theirs, 2) + SecByteBlock(ours, 2);
+  handshake_key = crypto_driver->bind_offers(handshake_key, offers);
+
+  cipher_suite = crypto_driver->AEAD_negotiate_suite(
+      crypto_driver->AEAD_preferred_suite(), public_value_msg.cipher_suite);
+  use_kem_params(kem_negotiate_params(keypair_pool->params(),
+                                      public_value_msg.kem_params));
+  this->other_public_value.store(std::make_shared<const PeerKey>(PeerKey{
+      public_value_msg.public_value, public_value_msg.kem_params}));
+
+  // The resumption secret never leaves either side; only the server can
+  // open the ticket that names it.
+  if ((responder && tickets) ||
+      (!responder && public_value_msg.ticket.size() > 0)) {
+    SessionTicket state;
+    state.ticket = public_value_msg.ticket;
+    state.resumption_secret = crypto_driver->resumption_secret(handshake_key);
+    state.cipher_suite = cipher_suite;
+    state.kem_params = kem_params;
+    state.peer_key_id = peer_key_id;
+    if (responder)
+      reply_msg.ticket = tickets->issue(state);
+    else
+      keep_ticket(state);
+  }
+
+  std::vector<unsigned char> reply;
+  if (responder)
+    reply_msg.serialize(reply);
+  // Each side's first message runs the initial KEM step, whatever the
+  // ratchet policy, on a fresh epoch 1.
+  sending_chain.store(nullptr);
+  receiving_chain.store(nullptr);
+  previous_receiving_chain.store(nullptr);
+  skipped_keys.clear();
+  early_messages.clear();
+  early_bytes = 0;
+  switched.store(true);
+  exchanged = true;
+  return reply;
+}
+
+/**
+ * Resumption, on either side. The server opens the client's ticket and, if it
+ * is still good and names a peer we still trust, answers with its own nonce
+ * and a fresh ticket; otherwise it answers with no nonce and waits for the
+ * full handshake. The client either finishes the same way or, refused, falls
+ * back to the full handshake and returns its public values to send.
+ *
+ * No KEM runs: the handshake key comes from the ticket's resumption secret
+ * and both nonces, and the ratchet restarts from the first messages.
+ */
+std::vector<unsigned char>
+Client::finish_resume(std::vector<unsigned char> &data) {
+  Resume_Message resume_msg;
+  resume_msg.deserialize(data);
+  std::vector<unsigned char> reply;
+
+  if (responder) {
+    SessionTicket state;
+    Resume_Message reply_msg;
+    if (!tickets || resume_msg.nonce.size() != RESUME_NONCE_SIZE ||
+        !tickets->redeem(resume_msg.ticket, state) ||
+        (key_store &&
+         key_store->kind(state.peer_key_id) != KeyKind::PEER)) {
+      reply_msg.serialize(reply);
+      return reply;
+    }
+    peer_key_id = state.peer_key_id;
+    reply_msg.nonce.New(RESUME_NONCE_SIZE);
+    rng->GenerateBlock(reply_msg.nonce, reply_msg.nonce.size());
+    handshake_key = crypto_driver->resumed_handshake_key(
+        state.resumption_secret, resume_msg.nonce + reply_msg.nonce);
+    start_resumed(state, resume_msg.nonce, reply_msg.nonce);
+    state.resumption_secret = crypto_driver->resumption_secret(handshake_key);
+    reply_msg.ticket = tickets->issue(state);
+    reply_msg.serialize(reply);
+    return reply;
+  }
+
+  if (!ticket || resume_nonce.empty())
+    throw std::runtime_error("Unexpected Resume message.");
+  if (resume_msg.nonce.size() != RESUME_NONCE_SIZE) {
+    // Refused: run the full handshake instead.
+    ticket = nullptr;
+    resume_nonce.CleanNew(0);
+    if (!ticket_destination.empty())
+      key_store->revoke(KeyStore::key_id(ticket_destination));
+    return start_key_exchange();
+  }
+  SessionTicket state = *ticket;
+  handshake_key = crypto_driver->resumed_handshake_key(
+      state.resumption_secret, resume_nonce + resume_msg.nonce);
+  start_resumed(state, resume_nonce, resume_msg.nonce);
+  state.ticket = resume_msg.ticket;
+  state.resumption_secret = crypto_driver->resumption_secret(handshake_key);
+  keep_ticket(state);
+  resume_nonce.CleanNew(0);
+  return reply;
+}
+
+/**
+ * Switches to the given Kyber parameter set. If the pool holds another set,
+ * keypairs come from its sibling pool for this one, which every client
+ * sharing the pool shares as well.
+ */
+void Client::use_kem_params(KEMParams::T params) {
+  kem_params = params;
+  if (kem_params != keypair_pool->params()) {
+    kem_driver = std::make_shared<KEMDriver>(kem_params);
+    keypair_pool = keypair_pool->for_params(kem_params);
+  }
+}
+
+/**
+ * Restores a session from its ticket: the cipher suite and parameter set
+ * carry over, and each direction's epoch 0 chain is keyed from the handshake
+ * key and its sender's nonce. Neither side holds the other's public value
+ * yet, so both announce theirs in their first message.
+ */
+void Client::start_resumed(const SessionTicket &state,
+                           const SecByteBlock &client_nonce,
+                           const SecByteBlock &server_nonce) {
+  cipher_suite = state.cipher_suite;
+  use_kem_params(state.kem_params);
+  prepare_keys();
+  const SecByteBlock &ours = responder ? server_nonce : client_nonce;
+  const SecByteBlock &theirs = responder ? client_nonce : server_nonce;
+  SecByteBlock our_id(KEY_ID_SIZE), their_id(KEY_ID_SIZE);
+  crypto_driver->hash({bytes_of(ours)}, buffer_of(our_id));
+  crypto_driver->hash({bytes_of(theirs)}, buffer_of(their_id));
+  sending_chain.store(start_chain(0, our_id, ours));
+  receiving_chain.store(start_chain(0, their_id, theirs));
+  previous_receiving_chain.store(nullptr);
+  skipped_keys.clear();
+  early_messages.clear();
+  early_bytes = 0;
+  announce.store(true);
+  exchanged = true;
+}
 
 /**
  * Listen for messages and print to cli_driver.
  */
 void Client::ReceiveThread() {
   while (true) {
-    // Try reading data from the other user.
-    std::vector<unsigned char> data;
+    // Try reading data from the other user, into a pooled buffer that goes
+    // back to the pool at the end of the iteration.
+    FrameBuffer frame;
     try {
-      data = this->network_driver->read();
+      frame = this->network_driver->read_frame();
     } catch (std::runtime_error &_) {
       // Exit cleanly.
       this->cli_driver->print_left("Received EOF; closing connection");
@@ -162,16 +962,23 @@ void Client::ReceiveThread() {
       return;
     }
 
-    // Deserialize, decrypt, and verify message.
-    Message_Message msg;
-    msg.deserialize(data);
-    auto decrypted_data = this->receive(msg);
+    // Decrypt and verify the message where it was read. One that does not
+    // verify is dropped; the next one may well be fine.
+    bool held;
+    std::pair<ByteView, bool> decrypted_data =
+        this->receive(frame.view(), &held);
+    if (held)
+      continue;
     if (!decrypted_data.second) {
-      this->cli_driver->print_left("Received invalid HMAC; the following "
-                                   "message may have been tampered with.");
-      throw std::runtime_error("Received invalid MAC!");
+      this->cli_driver->print_left("Received invalid HMAC; dropped a message "
+                                   "that may have been tampered with.");
+      continue;
     }
-    this->cli_driver->print_left(std::get<0>(decrypted_data));
+    this->cli_driver->print_left(
+        std::string((const char *)decrypted_data.first.data,
+                    decrypted_data.first.size));
+    for (const std::string &text : this->take_released())
+      this->cli_driver->print_left(text);
   }
 }
 
@@ -180,6 +987,8 @@ void Client::ReceiveThread() {
  */
 void Client::SendThread() {
   std::string plaintext;
+  // Every message is sealed into the same frame buffer.
+  std::vector<unsigned char> frame;
   while (true) {
     // Read from STDIN.
     std::getline(std::cin, plaintext);
@@ -191,10 +1000,8 @@ void Client::SendThread() {
 
     // Encrypt and send message.
     if (plaintext != "") {
-      Message_Message msg = this->send(plaintext);
-      std::vector<unsigned char> data;
-      msg.serialize(data);
-      this->network_driver->send(data);
+      this->send(bytes_of(plaintext), frame);
+      this->network_driver->send(frame);
     }
     this->cli_driver->print_right(plaintext);
   }
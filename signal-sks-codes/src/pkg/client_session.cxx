@@ -0,0 +1,166 @@
+#include "../../include/pkg/client_session.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+/**
+ * Constructor. The session's Client has no NetworkDriver of its own; frames
+ * come from and go to the AsyncConnection instead.
+ * @param crypto_driver Crypto driver shared between sessions.
+ * @param cli_driver CLI driver shared between sessions.
+ * @param keypair_pool Kyber keypair pool shared between sessions.
+ * @param key_store Our long-term key and trusted peers, shared between
+ * sessions; if given, every peer must authenticate.
+ * @param tickets Session ticket sealer shared between sessions; if given,
+ * peers may resume an earlier session with a ticket.
+ * @param ratchet_policy When each session runs its KEM ratchet step.
+ */
+ClientSession::ClientSession(std::shared_ptr<CryptoDriver> crypto_driver,
+                             std::shared_ptr<CLIDriver> cli_driver,
+                             std::shared_ptr<KeypairPool> keypair_pool,
+                             std::shared_ptr<KeyStore> key_store,
+                             std::shared_ptr<SessionTickets> tickets,
+                             RatchetPolicy ratchet_policy)
+    : cli_driver(cli_driver) {
+  this->client = std::make_shared<Client>(
+      nullptr, crypto_driver, keypair_pool, key_store, SecByteBlock(), tickets);
+  this->client->set_ratchet_policy(ratchet_policy);
+}
+
+/**
+ * Start the key exchange by sending our public value, unless we wait for the
+ * peer to authenticate first.
+ */
+void ClientSession::on_open(std::shared_ptr<AsyncConnection> conn) {
+  this->cli_driver->print_info("Session opened with " +
+                               conn->get_remote_info());
+  try {
+    std::lock_guard<std::mutex> lock(this->send_mtx);
+    this->conn = conn;
+    std::vector<unsigned char> data = this->client->start_key_exchange();
+    if (!data.empty())
+      conn->send(data);
+  } catch (std::exception &e) {
+    this->fail(conn, e.what());
+  }
+}
+
+/**
+ * Frames finish the key exchange until it is complete, which takes one unless
+ * a ticket is refused; every later frame is a Message_Message to decrypt and
+ * verify in place.
+ */
+void ClientSession::on_frame(std::shared_ptr<AsyncConnection> conn,
+                             std::vector<unsigned char> &data) {
+  try {
+    {
+      std::lock_guard<std::mutex> lock(this->send_mtx);
+      if (!this->client->handshake_complete()) {
+        std::vector<unsigned char> reply =
+            this->client->finish_key_exchange(data);
+        if (!reply.empty())
+          conn->send(reply);
+        return;
+      }
+    }
+
+    bool held;
+    std::pair<ByteView, bool> decrypted_data = this->client->receive(
+        MutableByteView{data.data(), data.size()}, &held);
+    if (held)
+      return;
+    if (!decrypted_data.second) {
+      this->fail(conn, "Received invalid HMAC.");
+      return;
+    }
+    this->cli_driver->print_left(
+        conn->get_remote_info() + ": " +
+        std::string((const char *)decrypted_data.first.data,
+                    decrypted_data.first.size));
+    for (const std::string &text : this->client->take_released())
+      this->cli_driver->print_left(conn->get_remote_info() + ": " + text);
+  } catch (std::exception &e) {
+    // Anything a peer can provoke, down to a failed allocation, ends only
+    // its own session; letting it out would stop the whole event loop.
+    this->fail(conn, e.what());
+  }
+}
+
+/**
+ * Log the end of the session; the Client goes away with the handler.
+ */
+void ClientSession::on_close(std::shared_ptr<AsyncConnection> conn) {
+  {
+    std::lock_guard<std::mutex> lock(this->send_mtx);
+    this->closed = true;
+  }
+  this->cli_driver->print_info("Session closed with " +
+                               conn->get_remote_info());
+}
+
+/**
+ * @brief Encrypts a message for the peer and queues it on the connection.
+ * Safe to call from any thread.
+ * @param plaintext message to send
+ * @return false if the session is not ready to send: its key exchange is
+ * still running, or it has closed.
+ */
+bool ClientSession::send(ByteView plaintext) {
+  std::lock_guard<std::mutex> lock(this->send_mtx);
+  std::shared_ptr<AsyncConnection> conn = this->conn.lock();
+  if (!conn || this->closed || !this->client->handshake_complete())
+    return false;
+  try {
+    std::vector<unsigned char> frame;
+    this->client->send(plaintext, frame);
+    conn->send(std::move(frame));
+  } catch (std::exception &e) {
+    this->fail(conn, e.what());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Closes the session after an error, leaving every other session alone.
+ */
+void ClientSession::fail(std::shared_ptr<AsyncConnection> conn,
+                         const std::string &reason) {
+  this->cli_driver->print_warning(conn->get_remote_info() + ": " + reason +
+                                  " Closing session.");
+  conn->disconnect();
+}
+
+/**
+ * Remember a session. Closed ones are forgotten on the next broadcast.
+ */
+void SessionRegistry::add(std::shared_ptr<ClientSession> session) {
+  std::lock_guard<std::mutex> lock(this->mtx);
+  this->sessions.push_back(session);
+}
+
+/**
+ * @brief Sends a message to every session that is ready for one.
+ * @param plaintext message to send
+ * @return Number of sessions it went to.
+ */
+size_t SessionRegistry::broadcast(ByteView plaintext) {
+  std::vector<std::shared_ptr<ClientSession>> open;
+  {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto expired = [](const std::weak_ptr<ClientSession> &session) {
+      return session.expired();
+    };
+    this->sessions.erase(std::remove_if(this->sessions.begin(),
+                                        this->sessions.end(), expired),
+                         this->sessions.end());
+    for (const std::weak_ptr<ClientSession> &session : this->sessions)
+      if (std::shared_ptr<ClientSession> locked = session.lock())
+        open.push_back(locked);
+  }
+  size_t sent = 0;
+  for (std::shared_ptr<ClientSession> &session : open)
+    if (session->send(plaintext))
+      sent++;
+  return sent;
+}
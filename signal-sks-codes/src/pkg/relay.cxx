@@ -0,0 +1,751 @@
+#include "../../include/pkg/relay.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+// Cells a circuit may send on towards a next hop that is still being dialed.
+// A well-behaved origin sends none before EXTENDED.
+static const size_t MAX_DIALING_CELLS = 64;
+
+// Bytes a circuit may have waiting on an outgoing link. A circuit that keeps
+// to its windows never has more than a window's worth in flight each way.
+static const size_t LINK_QUEUE_LIMIT =
+    (CIRCUIT_WINDOW_START + CIRCUIT_WINDOW_INCREMENT) * CELL_SIZE;
+
+// The exit owes a SENDME only once fewer than EXIT_QUEUE_LOW bytes are left
+// to write to the destination, so no more than EXIT_QUEUE_LIMIT can pile up.
+static const size_t EXIT_QUEUE_LOW =
+    CIRCUIT_WINDOW_INCREMENT * RELAY_DATA_SIZE;
+static const size_t EXIT_QUEUE_LIMIT =
+    EXIT_QUEUE_LOW + CIRCUIT_WINDOW_START * RELAY_DATA_SIZE;
+
+// ================================================
+// HELPERS
+// ================================================
+
+/**
+ * Seals a relay cell for the origin and sends it to the previous hop.
+ * Callers hold the circuit's mutex.
+ */
+static void seal_backward(Circuit &circuit, RelayCommand::T command,
+                          const unsigned char *data = nullptr,
+                          size_t size = 0) {
+  if (circuit.destroyed || !circuit.prev)
+    return;
+  unsigned char cell[CELL_SIZE];
+  put_relay_cell(circuit.prev_id, command, data, size, cell);
+  circuit.layer->seal(OnionDirection::BACKWARD, cell + CELL_HEADER_SIZE,
+                      CELL_PAYLOAD_SIZE);
+  circuit.prev->send_cells(cell, 1, circuit.prev_id);
+}
+
+/**
+ * Packages bytes from the destination into RELAY_DATA cells for as long as
+ * the package window allows. Callers hold the circuit's mutex.
+ * @return Number of bytes packaged; the rest must wait for a SENDME.
+ */
+static size_t package_exit_data(Circuit &circuit, const unsigned char *bytes,
+                                size_t size) {
+  if (circuit.destroyed || !circuit.prev)
+    return size;
+  size_t num_cells = std::min<size_t>(
+      (size + RELAY_DATA_SIZE - 1) / RELAY_DATA_SIZE,
+      std::max(circuit.package_window, 0));
+  circuit.exit_cells.resize(num_cells * CELL_SIZE);
+  size_t offset = 0;
+  for (size_t i = 0; i < num_cells; i++) {
+    unsigned char *cell = &circuit.exit_cells[i * CELL_SIZE];
+    size_t length = std::min(RELAY_DATA_SIZE, size - offset);
+    put_relay_cell(circuit.prev_id, RelayCommand::DATA, bytes + offset, length,
+                   cell);
+    circuit.layer->seal(OnionDirection::BACKWARD, cell + CELL_HEADER_SIZE,
+                        CELL_PAYLOAD_SIZE);
+    offset += length;
+  }
+  circuit.package_window -= num_cells;
+  if (num_cells > 0)
+    circuit.prev->send_cells(circuit.exit_cells.data(), num_cells,
+                             circuit.prev_id);
+  return offset;
+}
+
+/**
+ * Sends the SENDMEs the exit owes for RELAY_DATA it has delivered, as long
+ * as the destination has written most of it. Callers hold the circuit's
+ * mutex.
+ */
+static void credit_deliver_window(Circuit &circuit) {
+  while (circuit.exit &&
+         circuit.deliver_window <=
+             CIRCUIT_WINDOW_START - CIRCUIT_WINDOW_INCREMENT &&
+         circuit.exit->queued_bytes() < EXIT_QUEUE_LOW) {
+    circuit.deliver_window += CIRCUIT_WINDOW_INCREMENT;
+    seal_backward(circuit, RelayCommand::SENDME);
+  }
+}
+
+/**
+ * Sends a cell with no payload, e.g. DESTROY.
+ */
+static void send_control(std::shared_ptr<AsyncConnection> conn,
+                         MessageType::T command, uint32_t circuit_id) {
+  unsigned char cell[CELL_SIZE];
+  put_cell(circuit_id, command, nullptr, 0, cell);
+  conn->send_cells(cell, 1, circuit_id);
+}
+
+/**
+ * Extends the run with a cell, sending the run so far first if the cell is
+ * for another circuit or not adjacent to it.
+ */
+void CellRun::add(std::shared_ptr<AsyncConnection> conn, uint32_t circuit_id,
+                  unsigned char *cell) {
+  if (this->count > 0 &&
+      (conn != this->conn || circuit_id != this->circuit_id ||
+       cell != this->start + this->count * CELL_SIZE))
+    this->flush();
+  if (this->count == 0) {
+    this->conn = conn;
+    this->circuit_id = circuit_id;
+    this->start = cell;
+  }
+  this->count++;
+}
+
+/**
+ * Sends the run.
+ */
+void CellRun::flush() {
+  if (this->count > 0)
+    this->conn->send_cells(this->start, this->count, this->circuit_id);
+  this->conn = nullptr;
+  this->count = 0;
+}
+
+// ================================================
+// LINK
+// ================================================
+
+/**
+ * Constructor.
+ * @param relay Relay this link belongs to.
+ * @param pool_key Key of this link in the relay's outbound pool; empty for
+ * accepted links.
+ */
+RelayLink::RelayLink(Relay *relay, std::string pool_key)
+    : relay(relay), pool_key(pool_key), next_circuit_id(1) {}
+
+/**
+ * Links between relays carry fixed-size cells.
+ */
+size_t RelayLink::cell_size() { return CELL_SIZE; }
+
+/**
+ * Handle a batch of cells in place. Cells that are only passing through are
+ * collected into runs and forwarded together once the batch is done or
+ * something has to be sent in between. CREATEs are likewise held back and
+ * answered together, so their encapsulations run four at a time. A protocol
+ * error on one circuit destroys only that circuit; only a cell that cannot
+ * be framed at all drops the link.
+ */
+void RelayLink::on_cells(std::shared_ptr<AsyncConnection> conn,
+                         unsigned char *cells, size_t count) {
+  CellRun run;
+  std::vector<Cell_View> creates;
+  try {
+    for (size_t i = 0; i < count; i++)
+      this->handle_cell(conn, cells + i * CELL_SIZE, run, creates);
+    run.flush();
+    this->handle_creates(conn, creates);
+  } catch (std::runtime_error &e) {
+    run.flush();
+    this->relay->cli_driver->print_warning(conn->get_remote_info() + ": " +
+                                           e.what());
+    conn->disconnect();
+  }
+}
+
+/**
+ * Dispatch one cell. Cells for unknown circuits are dropped, since the
+ * circuit may have just been destroyed from the other end.
+ */
+void RelayLink::handle_cell(std::shared_ptr<AsyncConnection> conn,
+                            unsigned char *data, CellRun &run,
+                            std::vector<Cell_View> &creates) {
+  Cell_View cell;
+  cell.parse(data);
+  if (cell.command == MessageType::Onion_Create) {
+    creates.push_back(cell);
+    return;
+  }
+  // A cell for a circuit still waiting on its CREATE must see the circuit.
+  for (const Cell_View &create : creates)
+    if (create.circuit_id == cell.circuit_id) {
+      run.flush();
+      this->handle_creates(conn, creates);
+      break;
+    }
+
+  std::shared_ptr<Circuit> circuit;
+  bool is_prev;
+  {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto it = this->circuits.find(cell.circuit_id);
+    if (it == this->circuits.end())
+      return;
+    std::tie(circuit, is_prev) = it->second;
+  }
+
+  if (cell.command == MessageType::Onion_Relay &&
+      cell.size != CELL_PAYLOAD_SIZE) {
+    run.flush();
+    this->reject(conn, cell.circuit_id, "Relay cell is not fully layered.");
+    return;
+  }
+  if (cell.command == MessageType::Onion_Destroy) {
+    run.flush();
+    this->relay->destroy(circuit);
+  } else if (cell.command == MessageType::Onion_Relay && is_prev) {
+    this->handle_forward(circuit, data, cell, run);
+  } else if (cell.command == MessageType::Onion_Relay) {
+    this->handle_backward(circuit, data, cell, run);
+  } else if (cell.command == MessageType::Onion_Created && !is_prev) {
+    run.flush();
+    this->handle_created(circuit, cell);
+  } else {
+    run.flush();
+    this->reject(conn, cell.circuit_id, "Unexpected onion cell.");
+  }
+}
+
+/**
+ * Tear down every circuit that ran over this link.
+ */
+void RelayLink::on_close(std::shared_ptr<AsyncConnection>) {
+  if (!this->pool_key.empty())
+    this->relay->drop_link(this->pool_key, this);
+  std::map<uint32_t, std::pair<std::shared_ptr<Circuit>, bool>> circuits;
+  {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    circuits.swap(this->circuits);
+  }
+  for (auto &entry : circuits)
+    this->relay->destroy(entry.second.first);
+}
+
+/**
+ * Each circuit may queue up to LINK_QUEUE_LIMIT bytes on the link.
+ */
+size_t RelayLink::queue_limit() { return LINK_QUEUE_LIMIT; }
+
+/**
+ * A circuit filled its queue faster than the link drains it, so its sender
+ * is ignoring flow control. Destroy the circuit.
+ */
+void RelayLink::on_overflow(std::shared_ptr<AsyncConnection> conn,
+                            uint32_t circuit_id) {
+  this->reject(conn, circuit_id, "Circuit overran its write queue.");
+}
+
+/**
+ * Registers a circuit this relay is extending over this link.
+ * @return The circuit's ID on this link.
+ */
+uint32_t RelayLink::add_outbound(std::shared_ptr<Circuit> circuit) {
+  uint32_t circuit_id = this->next_circuit_id++;
+  std::lock_guard<std::mutex> lock(this->mtx);
+  this->circuits[circuit_id] = std::make_pair(circuit, false);
+  return circuit_id;
+}
+
+/**
+ * Forgets a circuit.
+ */
+void RelayLink::remove(uint32_t circuit_id) {
+  std::lock_guard<std::mutex> lock(this->mtx);
+  this->circuits.erase(circuit_id);
+}
+
+/**
+ * CREATE: encapsulate to each sender's ephemeral public value, key the layers
+ * from the shared secrets and answer each with its KEM ciphertext. A CREATE
+ * for a circuit ID already in use, on the link or elsewhere in the batch, is
+ * refused along with whatever circuit holds the ID, and one whose public
+ * value is the wrong size is refused on its own; the rest of the batch goes
+ * ahead. Empties `creates`.
+ */
+void RelayLink::handle_creates(std::shared_ptr<AsyncConnection> conn,
+                               std::vector<Cell_View> &creates) {
+  if (creates.empty())
+    return;
+  size_t public_key_size = this->relay->kem_driver->public_key_size();
+  std::vector<Cell_View> accepted;
+  std::vector<std::pair<uint32_t, std::string>> refused;
+  {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    for (size_t i = 0; i < creates.size(); i++) {
+      bool clash = this->circuits.count(creates[i].circuit_id) > 0;
+      for (size_t j = 0; j < creates.size(); j++)
+        if (j != i && creates[j].circuit_id == creates[i].circuit_id)
+          clash = true;
+      if (clash)
+        refused.push_back(std::make_pair(creates[i].circuit_id,
+                                         "Circuit ID already in use."));
+      else if (creates[i].size != public_key_size)
+        refused.push_back(std::make_pair(
+            creates[i].circuit_id, "CREATE carries a public value of the "
+                                   "wrong size."));
+      else
+        accepted.push_back(creates[i]);
+    }
+  }
+  creates.clear();
+  for (const std::pair<uint32_t, std::string> &entry : refused)
+    this->reject(conn, entry.first, entry.second);
+
+  std::vector<SecByteBlock> public_values;
+  for (const Cell_View &create : accepted)
+    public_values.push_back(SecByteBlock(create.payload, create.size));
+  std::vector<std::pair<SecByteBlock, SecByteBlock>> ct_ss =
+      this->relay->kem_driver->encapsulate(public_values);
+
+  for (size_t i = 0; i < accepted.size(); i++) {
+    std::shared_ptr<Circuit> circuit = std::make_shared<Circuit>();
+    circuit->layer =
+        this->relay->crypto_driver->OnionLayer_generate(ct_ss[i].second);
+    circuit->prev_link = shared_from_this();
+    circuit->prev = conn;
+    circuit->prev_id = accepted[i].circuit_id;
+    {
+      std::lock_guard<std::mutex> lock(this->mtx);
+      this->circuits[accepted[i].circuit_id] = std::make_pair(circuit, true);
+    }
+    unsigned char created[CELL_SIZE];
+    put_cell(accepted[i].circuit_id, MessageType::Onion_Created,
+             ct_ss[i].first.BytePtr(), ct_ss[i].first.size(), created);
+    conn->send_cells(created, 1, accepted[i].circuit_id);
+  }
+}
+
+/**
+ * Refuses one circuit after a protocol error on it: destroys the circuit if
+ * this link knows it, and otherwise answers DESTROY for its ID. The link and
+ * its other circuits carry on.
+ */
+void RelayLink::reject(std::shared_ptr<AsyncConnection> conn,
+                       uint32_t circuit_id, const std::string &reason) {
+  this->relay->cli_driver->print_warning(conn->get_remote_info() + ": " +
+                                         reason + " Destroying circuit.");
+  std::shared_ptr<Circuit> circuit;
+  {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto it = this->circuits.find(circuit_id);
+    if (it != this->circuits.end())
+      circuit = it->second.first;
+  }
+  if (circuit)
+    this->relay->destroy(circuit);
+  else
+    send_control(conn, MessageType::Onion_Destroy, circuit_id);
+}
+
+/**
+ * RELAY from the previous hop: peel our layer. If the cell is addressed to
+ * us, act on it; otherwise pass the same bytes on under the next hop's
+ * circuit ID.
+ */
+void RelayLink::handle_forward(std::shared_ptr<Circuit> circuit,
+                               unsigned char *data, Cell_View &cell,
+                               CellRun &run) {
+  std::unique_lock<std::mutex> lock(circuit->mtx);
+  if (circuit->destroyed)
+    return;
+  if (circuit->layer->open(OnionDirection::FORWARD, cell.payload,
+                           cell.size)) {
+    lock.unlock();
+    run.flush();
+    // A misbehaving circuit only takes itself down, not the shared link.
+    try {
+      Relay_View msg;
+      msg.parse(cell.payload, cell.size);
+      this->handle_command(circuit, msg);
+    } catch (std::runtime_error &e) {
+      this->relay->cli_driver->print_warning(std::string(e.what()) +
+                                             " Destroying circuit.");
+      this->relay->destroy(circuit);
+    }
+    return;
+  }
+  if (circuit->dialing && circuit->next_pending.size() <
+                              MAX_DIALING_CELLS * CELL_SIZE) {
+    circuit->next_pending.insert(circuit->next_pending.end(), data,
+                                 data + CELL_SIZE);
+    return;
+  }
+  if (!circuit->next) {
+    lock.unlock();
+    this->relay->cli_driver->print_warning(
+        "Unrecognized cell at the end of a circuit; destroying it.");
+    run.flush();
+    this->relay->destroy(circuit);
+    return;
+  }
+  put_u32(circuit->next_id, data);
+  run.add(circuit->next, circuit->next_id, data);
+}
+
+/**
+ * RELAY from the next hop: add our layer and pass it back.
+ */
+void RelayLink::handle_backward(std::shared_ptr<Circuit> circuit,
+                                unsigned char *data, Cell_View &cell,
+                                CellRun &run) {
+  std::lock_guard<std::mutex> lock(circuit->mtx);
+  if (circuit->destroyed || !circuit->prev)
+    return;
+  circuit->layer->crypt(OnionDirection::BACKWARD, cell.payload, cell.size);
+  put_u32(circuit->prev_id, data);
+  run.add(circuit->prev, circuit->prev_id, data);
+}
+
+/**
+ * CREATED from the next hop: the extension is done, so hand its KEM
+ * ciphertext back to the origin as EXTENDED.
+ */
+void RelayLink::handle_created(std::shared_ptr<Circuit> circuit,
+                               Cell_View &cell) {
+  this->relay->send_backward(circuit, RelayCommand::EXTENDED, cell.payload,
+                             cell.size);
+}
+
+/**
+ * Acts on a relay command addressed to this hop. A failed EXTEND or BEGIN
+ * answers END rather than dropping the link, which other circuits share.
+ */
+void RelayLink::handle_command(std::shared_ptr<Circuit> circuit,
+                               Relay_View &msg) {
+  switch (msg.command) {
+  case RelayCommand::EXTEND: {
+    RelayTarget target;
+    target.deserialize(msg.data.data, msg.data.size);
+    // The next relay would refuse it anyway; better not to bother it.
+    if (target.public_value.size() !=
+        this->relay->kem_driver->public_key_size())
+      throw std::runtime_error("EXTEND carries a public value of the wrong "
+                               "size.");
+    {
+      std::lock_guard<std::mutex> lock(circuit->mtx);
+      if (circuit->next || circuit->exit || circuit->dialing)
+        throw std::runtime_error("Circuit already extended.");
+      circuit->dialing = true;
+    }
+    // Not holding the circuit's mutex: the link may already be up, in which
+    // case this runs right away.
+    SecByteBlock public_value = target.public_value;
+    this->relay->link_to(
+        target.address, target.port,
+        [circuit, public_value](std::shared_ptr<AsyncConnection> conn,
+                                std::shared_ptr<RelayLink> link) {
+          std::lock_guard<std::mutex> lock(circuit->mtx);
+          circuit->dialing = false;
+          std::vector<unsigned char> pending;
+          pending.swap(circuit->next_pending);
+          if (circuit->destroyed)
+            return;
+          if (!conn) {
+            seal_backward(*circuit, RelayCommand::END);
+            return;
+          }
+          circuit->next_link = link;
+          circuit->next = conn;
+          circuit->next_id = link->add_outbound(circuit);
+          unsigned char create[CELL_SIZE];
+          put_cell(circuit->next_id, MessageType::Onion_Create,
+                   public_value.BytePtr(), public_value.size(), create);
+          conn->send_cells(create, 1, circuit->next_id);
+          for (size_t i = 0; i < pending.size(); i += CELL_SIZE)
+            put_u32(circuit->next_id, &pending[i]);
+          if (!pending.empty())
+            conn->send_cells(pending.data(), pending.size() / CELL_SIZE,
+                             circuit->next_id);
+        });
+    return;
+  }
+  case RelayCommand::BEGIN: {
+    RelayTarget target;
+    target.deserialize(msg.data.data, msg.data.size);
+    {
+      std::lock_guard<std::mutex> lock(circuit->mtx);
+      if (circuit->next || circuit->exit || circuit->dialing)
+        throw std::runtime_error("Circuit already extended.");
+      circuit->dialing = true;
+    }
+    // The stream starts reading only once this has run, so nothing from the
+    // destination can overtake CONNECTED.
+    this->relay->network_driver.async_connect(
+        target.address, target.port,
+        std::make_shared<ExitStream>(this->relay, circuit),
+        [circuit](std::shared_ptr<AsyncConnection> conn) {
+          std::lock_guard<std::mutex> lock(circuit->mtx);
+          circuit->dialing = false;
+          if (circuit->destroyed) {
+            if (conn)
+              conn->disconnect();
+            return;
+          }
+          circuit->exit = conn;
+          seal_backward(*circuit, conn ? RelayCommand::CONNECTED
+                                       : RelayCommand::END);
+        });
+    return;
+  }
+  case RelayCommand::DATA: {
+    std::lock_guard<std::mutex> lock(circuit->mtx);
+    if (!circuit->exit)
+      throw std::runtime_error("No stream open on circuit.");
+    if (--circuit->deliver_window < 0)
+      throw std::runtime_error("Circuit sent past its window.");
+    circuit->exit->send_cells(msg.data.data, msg.data.size);
+    credit_deliver_window(*circuit);
+    return;
+  }
+  case RelayCommand::SENDME: {
+    std::lock_guard<std::mutex> lock(circuit->mtx);
+    circuit->package_window += CIRCUIT_WINDOW_INCREMENT;
+    if (circuit->package_window > CIRCUIT_WINDOW_START)
+      throw std::runtime_error("Unexpected SENDME.");
+    std::vector<unsigned char> &pending = circuit->exit_pending;
+    size_t sent = package_exit_data(*circuit, pending.data(), pending.size());
+    pending.erase(pending.begin(), pending.begin() + sent);
+    if (pending.empty() && circuit->exit)
+      circuit->exit->set_reading(true);
+    return;
+  }
+  case RelayCommand::END: {
+    std::lock_guard<std::mutex> lock(circuit->mtx);
+    if (circuit->exit) {
+      circuit->exit->disconnect();
+      circuit->exit = nullptr;
+    }
+    circuit->exit_pending.clear();
+    return;
+  }
+  default:
+    throw std::runtime_error("Unexpected relay command.");
+  }
+}
+
+// ================================================
+// EXIT
+// ================================================
+
+/**
+ * Constructor.
+ */
+ExitStream::ExitStream(Relay *relay, std::weak_ptr<Circuit> circuit)
+    : relay(relay), circuit(circuit) {}
+
+/**
+ * The destination speaks its own protocol, so the stream is passed through
+ * byte for byte.
+ */
+size_t ExitStream::cell_size() { return 1; }
+
+/**
+ * Send whatever the destination wrote back down the circuit, split into as
+ * many RELAY_DATA cells as it takes and queued in one go. Once the package
+ * window runs out, the rest is held and the destination is no longer read
+ * until a SENDME arrives.
+ */
+void ExitStream::on_cells(std::shared_ptr<AsyncConnection> conn,
+                          unsigned char *bytes, size_t count) {
+  std::shared_ptr<Circuit> circuit = this->circuit.lock();
+  if (!circuit) {
+    conn->disconnect();
+    return;
+  }
+  std::lock_guard<std::mutex> lock(circuit->mtx);
+  std::vector<unsigned char> &pending = circuit->exit_pending;
+  size_t sent = 0;
+  if (pending.empty())
+    sent = package_exit_data(*circuit, bytes, count);
+  if (sent < count) {
+    pending.insert(pending.end(), bytes + sent, bytes + count);
+    conn->set_reading(false);
+  }
+}
+
+/**
+ * Tell the origin the destination hung up, unless the origin asked for it.
+ */
+void ExitStream::on_close(std::shared_ptr<AsyncConnection> conn) {
+  std::shared_ptr<Circuit> circuit = this->circuit.lock();
+  if (!circuit)
+    return;
+  std::lock_guard<std::mutex> lock(circuit->mtx);
+  if (circuit->exit != conn)
+    return;
+  circuit->exit = nullptr;
+  seal_backward(*circuit, RelayCommand::END);
+}
+
+/**
+ * Bytes for the destination may queue up to EXIT_QUEUE_LIMIT.
+ */
+size_t ExitStream::queue_limit() { return EXIT_QUEUE_LIMIT; }
+
+/**
+ * The origin sent more than its withheld SENDMEs allow. Destroy the circuit.
+ */
+void ExitStream::on_overflow(std::shared_ptr<AsyncConnection>, uint32_t) {
+  this->relay->cli_driver->print_warning(
+      "Circuit overran its exit stream. Destroying circuit.");
+  if (std::shared_ptr<Circuit> circuit = this->circuit.lock())
+    this->relay->destroy(circuit);
+}
+
+/**
+ * The destination took some bytes; send any SENDME that was held back.
+ */
+void ExitStream::on_written(std::shared_ptr<AsyncConnection> conn) {
+  std::shared_ptr<Circuit> circuit = this->circuit.lock();
+  if (!circuit)
+    return;
+  std::lock_guard<std::mutex> lock(circuit->mtx);
+  if (circuit->exit == conn)
+    credit_deliver_window(*circuit);
+}
+
+// ================================================
+// RELAY
+// ================================================
+
+/**
+ * Constructor.
+ * @param num_threads Size of the network driver's pool; 0 means one per
+ * core.
+ * @param key_store Where to keep the identity keypair; optional.
+ */
+Relay::Relay(int num_threads, std::shared_ptr<KeyStore> key_store)
+    : network_driver(num_threads), key_store(key_store) {
+  this->crypto_driver = std::make_shared<CryptoDriver>();
+  this->kem_driver = std::make_shared<KEMDriver>();
+  this->cli_driver = std::make_shared<CLIDriver>();
+  if (this->key_store)
+    this->identity = this->key_store->long_term_key_id(
+        [this]() { return this->kem_driver->generate_keypair(); });
+}
+
+/**
+ * Key ID of the relay's identity keypair, or empty without a key store.
+ */
+SecByteBlock Relay::identity_key_id() { return this->identity; }
+
+/**
+ * Accept links from clients and other relays on the given port.
+ */
+void Relay::listen(int port) {
+  this->network_driver.listen(
+      port, [this]() { return std::make_shared<RelayLink>(this); });
+}
+
+/**
+ * Run until stop() is called.
+ */
+void Relay::run() { this->network_driver.run(); }
+
+/**
+ * Stop accepting and let run() return.
+ */
+void Relay::stop() { this->network_driver.stop(); }
+
+/**
+ * Seal a relay cell for the origin and send it to the previous hop. Safe to
+ * call from any thread.
+ */
+void Relay::send_backward(std::shared_ptr<Circuit> circuit,
+                          RelayCommand::T command, const unsigned char *data,
+                          size_t size) {
+  std::lock_guard<std::mutex> lock(circuit->mtx);
+  seal_backward(*circuit, command, data, size);
+}
+
+/**
+ * Tear down a circuit in both directions. Safe to call more than once.
+ */
+void Relay::destroy(std::shared_ptr<Circuit> circuit) {
+  std::lock_guard<std::mutex> lock(circuit->mtx);
+  if (circuit->destroyed)
+    return;
+  circuit->destroyed = true;
+  if (circuit->prev)
+    send_control(circuit->prev, MessageType::Onion_Destroy, circuit->prev_id);
+  if (circuit->next)
+    send_control(circuit->next, MessageType::Onion_Destroy, circuit->next_id);
+  if (auto link = circuit->prev_link.lock())
+    link->remove(circuit->prev_id);
+  if (auto link = circuit->next_link.lock())
+    link->remove(circuit->next_id);
+  if (circuit->exit)
+    circuit->exit->disconnect();
+  circuit->prev = circuit->next = circuit->exit = nullptr;
+  circuit->exit_pending.clear();
+  circuit->next_pending.clear();
+}
+
+/**
+ * Hands on_link the pooled link to another relay, dialing it first if
+ * needed. The dial does not block: on_link runs right away if the link is
+ * up, and otherwise on the link's thread once the dial completes, with nulls
+ * if it failed. Circuits waiting on the same dial share it.
+ */
+void Relay::link_to(std::string address, int port, LinkHandler on_link) {
+  std::string pool_key = address + ":" + std::to_string(port);
+  std::pair<std::shared_ptr<AsyncConnection>, std::shared_ptr<RelayLink>>
+      pooled;
+  {
+    std::lock_guard<std::mutex> lock(this->links_mtx);
+    auto it = this->links.find(pool_key);
+    if (it != this->links.end()) {
+      pooled = it->second;
+    } else {
+      std::vector<LinkHandler> &waiting = this->dialing[pool_key];
+      waiting.push_back(on_link);
+      if (waiting.size() > 1)
+        return;
+    }
+  }
+  // Waiters are always called outside links_mtx.
+  if (pooled.first) {
+    on_link(pooled.first, pooled.second);
+    return;
+  }
+  auto link = std::make_shared<RelayLink>(this, pool_key);
+  this->network_driver.async_connect(
+      address, port, link,
+      [this, pool_key, link](std::shared_ptr<AsyncConnection> conn) {
+        std::vector<LinkHandler> waiting;
+        {
+          std::lock_guard<std::mutex> lock(this->links_mtx);
+          waiting.swap(this->dialing[pool_key]);
+          this->dialing.erase(pool_key);
+          if (conn)
+            this->links[pool_key] = std::make_pair(conn, link);
+        }
+        for (LinkHandler &on_link : waiting)
+          on_link(conn, conn ? link : nullptr);
+      });
+}
+
+/**
+ * Removes a closed link from the pool, unless a newer link to the same
+ * address has already taken its place.
+ * @param pool_key address the link was pooled under
+ * @param link the link that closed
+ */
+void Relay::drop_link(const std::string &pool_key, RelayLink *link) {
+  std::lock_guard<std::mutex> lock(this->links_mtx);
+  auto it = this->links.find(pool_key);
+  if (it != this->links.end() && it->second.second.get() == link)
+    this->links.erase(it);
+}
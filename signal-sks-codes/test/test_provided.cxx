@@ -1,4 +1,822 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest/doctest.h"
 
-TEST_CASE("sample") { CHECK(true); }
\ No newline at end of file
+#include <ctime>
+#include <filesystem>
+
+#include <unistd.h>
+
+#include "../include-shared/messages.hpp"
+#include "../include/drivers/frame_pool.hpp"
+#include "../include/drivers/kem_driver.hpp"
+#include "../include/drivers/key_store.hpp"
+#include "../include/drivers/replay_window.hpp"
+#include "../include/drivers/session_tickets.hpp"
+#include "../include/pkg/client.hpp"
+
+TEST_CASE("sample") { CHECK(true); }
+
+TEST_CASE("Message_Message round trip") {
+  Message_Message msg;
+  msg.epoch = 7;
+  msg.counter = 300;
+  msg.key_id = CryptoPP::SecByteBlock(KEY_ID_SIZE);
+  msg.iv = CryptoPP::SecByteBlock(16);
+  msg.public_value = CryptoPP::SecByteBlock(800);
+  msg.ciphertext = std::string("ciphertext\0bytes", 16);
+  msg.mac = std::string(32, 'm');
+  msg.ct = CryptoPP::SecByteBlock(768);
+  for (size_t i = 0; i < msg.public_value.size(); i++)
+    msg.public_value[i] = i;
+
+  std::vector<unsigned char> data;
+  msg.serialize(data);
+  CHECK(data[1] == WIRE_FORMAT_VERSION);
+
+  Message_View view;
+  CHECK(view.parse(data.data(), data.size()) == (int)data.size());
+  CHECK(view.epoch == 7);
+  CHECK(view.counter == 300);
+  CHECK(view.public_value.data ==
+        data.data() + 2 + 4 + 4 + KEY_ID_SIZE + 4 + 16 + 4);
+  CHECK(view.ciphertext.size == 16);
+
+  Message_Message out;
+  out.deserialize(data);
+  CHECK(out.epoch == msg.epoch);
+  CHECK(out.counter == msg.counter);
+  CHECK(out.key_id == msg.key_id);
+  CHECK(out.iv == msg.iv);
+  CHECK(out.public_value == msg.public_value);
+  CHECK(out.ciphertext == msg.ciphertext);
+  CHECK(out.mac == msg.mac);
+  CHECK(out.ct == msg.ct);
+
+  data.resize(data.size() - 1);
+  CHECK_THROWS(view.parse(data.data(), data.size()));
+}
+
+TEST_CASE("Message frame sealed in place") {
+  Message_Message msg;
+  msg.epoch = 2;
+  msg.counter = 9;
+  msg.key_id = CryptoPP::SecByteBlock(KEY_ID_SIZE);
+  msg.public_value = CryptoPP::SecByteBlock(800);
+
+  std::vector<unsigned char> data;
+  Message_Frame frame = msg.serialize_frame(12, 40, 0, data);
+  std::memset(frame.iv.data, 'i', frame.iv.size);
+  std::memset(frame.ciphertext.data, 'c', frame.ciphertext.size);
+
+  Message_View view;
+  CHECK(view.parse(data.data(), data.size()) == (int)data.size());
+  CHECK(view.iv.data == frame.iv.data);
+  CHECK(view.ciphertext.data == frame.ciphertext.data);
+  CHECK(view.ciphertext.size == 40);
+  CHECK(view.mac.size == 0);
+  CHECK(view.public_value.size == 800);
+
+  // Filled in place, the frame is what serialize writes.
+  msg.iv = CryptoPP::SecByteBlock(12);
+  std::memset(msg.iv.BytePtr(), 'i', 12);
+  msg.ciphertext = std::string(40, 'c');
+  std::vector<unsigned char> serialized;
+  msg.serialize(serialized);
+  CHECK(serialized == data);
+  CHECK(msg.view().ciphertext.data ==
+        (const unsigned char *)msg.ciphertext.data());
+}
+
+TEST_CASE("Onion relay cell round trip") {
+  Relay_Message msg;
+  msg.command = RelayCommand::DATA;
+  msg.data = std::vector<unsigned char>(300, 'd');
+
+  std::vector<unsigned char> cell(CELL_SIZE, 0xff);
+  msg.serialize_cell(42, cell.data());
+
+  Cell_View view;
+  view.parse(cell.data());
+  CHECK(view.circuit_id == 42);
+  CHECK(view.command == MessageType::Onion_Relay);
+  CHECK(view.payload == cell.data() + CELL_HEADER_SIZE);
+  CHECK(view.size == CELL_PAYLOAD_SIZE);
+  CHECK(cell.back() == 0);
+
+  Relay_Message out;
+  out.deserialize(view.payload, view.size);
+  CHECK(out.command == RelayCommand::DATA);
+  CHECK(out.data == msg.data);
+
+  msg.data.resize(RELAY_DATA_SIZE + 1);
+  CHECK_THROWS(msg.serialize_cell(42, cell.data()));
+  cell[sizeof(uint32_t)] = MessageType::Message;
+  CHECK_THROWS(view.parse(cell.data()));
+}
+
+TEST_CASE("PublicValue_Message round trip") {
+  PublicValue_Message msg;
+  msg.public_value = CryptoPP::SecByteBlock(1184);
+  msg.dh_public_value = CryptoPP::SecByteBlock(32);
+  msg.sender_key_id = CryptoPP::SecByteBlock(KEY_ID_SIZE);
+  msg.ake_message = CryptoPP::SecByteBlock(1568);
+  msg.cipher_suite = CipherSuite::AES_GCM;
+  msg.kem_params = KEMParams::KYBER768_90S;
+
+  std::vector<unsigned char> data;
+  msg.serialize(data);
+  PublicValue_Message out;
+  CHECK(out.deserialize(data) == (int)data.size());
+  CHECK(out.cipher_suite == CipherSuite::AES_GCM);
+  CHECK(out.kem_params == KEMParams::KYBER768_90S);
+  CHECK(out.public_value.size() == 1184);
+  CHECK(out.dh_public_value.size() == 32);
+  CHECK(out.sender_key_id.size() == KEY_ID_SIZE);
+  CHECK(out.recipient_key_id.size() == 0);
+  CHECK(out.ake_message.size() == 1568);
+  CHECK(out.ticket.size() == 0);
+
+  data[3] = 0;
+  CHECK_THROWS(out.deserialize(data));
+}
+
+TEST_CASE("SessionTicket round trip") {
+  SessionTicket state;
+  state.ticket = CryptoPP::SecByteBlock(120);
+  state.resumption_secret = CryptoPP::SecByteBlock(32);
+  state.cipher_suite = CipherSuite::CHACHA20_POLY1305;
+  state.kem_params = KEMParams::KYBER1024;
+  state.peer_key_id = CryptoPP::SecByteBlock(KEY_ID_SIZE);
+
+  std::vector<unsigned char> data;
+  state.serialize(data);
+  SessionTicket out;
+  CHECK(out.deserialize(data) == (int)data.size());
+  CHECK(out.cipher_suite == CipherSuite::CHACHA20_POLY1305);
+  CHECK(out.kem_params == KEMParams::KYBER1024);
+  CHECK(out.ticket.size() == 120);
+  CHECK(out.resumption_secret.size() == 32);
+  CHECK(out.peer_key_id.size() == KEY_ID_SIZE);
+
+  // A refused resumption carries no nonce.
+  Resume_Message refused;
+  data.clear();
+  refused.serialize(data);
+  Resume_Message resume;
+  CHECK(resume.deserialize(data) == (int)data.size());
+  CHECK(resume.nonce.size() == 0);
+  CHECK_THROWS(out.deserialize(data));
+}
+
+TEST_CASE("Replay window and skipped keys") {
+  ReplayWindow window;
+  CHECK(window.fresh(0));
+  window.mark(0);
+  window.mark(5);
+  CHECK_FALSE(window.fresh(0));
+  CHECK_FALSE(window.fresh(5));
+  CHECK(window.fresh(3));
+  window.mark(3);
+  CHECK_FALSE(window.fresh(3));
+  window.mark(5 + ReplayWindow::SIZE);
+  CHECK_FALSE(window.fresh(4));
+  CHECK(window.fresh(6 + ReplayWindow::SIZE / 2));
+
+  SkippedKeys keys(4);
+  CryptoPP::SecByteBlock key(SkippedKeys::KEY_SIZE), found;
+  for (uint32_t counter = 0; counter < 6; counter++) {
+    key[0] = counter;
+    keys.put(1, counter, key);
+  }
+  CHECK(keys.size() == 4);
+  CHECK_FALSE(keys.find(1, 1, found));
+  CHECK(keys.find(1, 5, found));
+  CHECK(found[0] == 5);
+  keys.erase(1, 5);
+  CHECK_FALSE(keys.find(1, 5, found));
+  keys.put(2, 0, key);
+  keys.drop_epochs_before(2);
+  CHECK(keys.size() == 1);
+  CHECK(keys.find(2, 0, found));
+}
+
+TEST_CASE("Frame pool recycles buffers") {
+  std::shared_ptr<FramePool> pool = std::make_shared<FramePool>(4096, 2);
+  const unsigned char *first;
+  {
+    FrameBuffer frame = pool->take(100);
+    CHECK(frame.size() == 100);
+    first = frame.data();
+  }
+  CHECK(pool->spares() == 1);
+  {
+    // Same slab class, same buffer.
+    FrameBuffer frame = pool->take(FramePool::MIN_SLAB_SIZE);
+    CHECK(frame.data() == first);
+    CHECK(pool->spares() == 0);
+  }
+
+  {
+    FrameBuffer a = pool->take(1000), b = pool->take(1000),
+                c = pool->take(1000);
+    FrameBuffer moved = std::move(c);
+    CHECK(c.size() == 0);
+    CHECK(moved.view().size == 1000);
+  }
+  // Each class keeps at most two spares.
+  CHECK(pool->spares() == 3);
+
+  CHECK_NOTHROW(pool->take(4096));
+  CHECK_THROWS(pool->take(4097));
+
+  FrameBuffer unpooled(std::vector<unsigned char>(10, 'u'));
+  CHECK(unpooled.size() == 10);
+  CHECK(unpooled.data()[9] == 'u');
+}
+
+// Only the AVX2 backend has the four-lane Kyber paths, and only CPUs with
+// AVX2 get it.
+static bool kem_x4_available() {
+  return select_kem_backend(KEMParams::KYBER512).dec_x4 != nullptr;
+}
+
+TEST_CASE("Batched encapsulation decapsulates with the reference backend" *
+          doctest::skip(!kem_x4_available())) {
+  for (int params = 1; kem_params_valid(params); params++) {
+    const KEMBackend &ref = ref_kem_backend((KEMParams::T)params);
+    KEMDriver kem_driver((KEMParams::T)params);
+    std::vector<CryptoPP::SecByteBlock> public_keys, private_keys;
+    for (int i = 0; i < 4; i++) {
+      public_keys.emplace_back(ref.public_key_bytes);
+      private_keys.emplace_back(ref.secret_key_bytes);
+      ref.keypair(public_keys[i].BytePtr(), private_keys[i].BytePtr());
+    }
+    auto encapsulated = kem_driver.encapsulate(public_keys);
+    REQUIRE(encapsulated.size() == 4);
+    for (int i = 0; i < 4; i++) {
+      CryptoPP::SecByteBlock shared_secret(ref.shared_secret_bytes);
+      ref.dec(shared_secret.BytePtr(), encapsulated[i].first.BytePtr(),
+              private_keys[i].BytePtr());
+      CHECK(shared_secret == encapsulated[i].second);
+    }
+  }
+}
+
+TEST_CASE("Batched keypairs work with the reference backend" *
+          doctest::skip(!kem_x4_available())) {
+  for (int params = 1; kem_params_valid(params); params++) {
+    const KEMBackend &ref = ref_kem_backend((KEMParams::T)params);
+    KEMDriver kem_driver((KEMParams::T)params);
+    auto keypairs = kem_driver.generate_keypairs(4);
+    REQUIRE(keypairs.size() == 4);
+    for (int i = 0; i < 4; i++) {
+      CryptoPP::SecByteBlock ciphertext(ref.ciphertext_bytes),
+          sent(ref.shared_secret_bytes), received(ref.shared_secret_bytes);
+      ref.enc(ciphertext.BytePtr(), sent.BytePtr(),
+              keypairs[i].first.BytePtr());
+      ref.dec(received.BytePtr(), ciphertext.BytePtr(),
+              keypairs[i].second.BytePtr());
+      CHECK(received == sent);
+    }
+    CHECK(keypairs[0].first != keypairs[1].first);
+  }
+}
+
+TEST_CASE("Batched decapsulation rejects tampering like the reference" *
+          doctest::skip(!kem_x4_available())) {
+  for (int params = 1; kem_params_valid(params); params++) {
+    const KEMBackend &ref = ref_kem_backend((KEMParams::T)params);
+    KEMDriver kem_driver((KEMParams::T)params);
+    auto keypairs = kem_driver.generate_keypairs(4);
+    std::vector<CryptoPP::SecByteBlock> ciphertexts, private_keys, sent;
+    for (int i = 0; i < 4; i++) {
+      ciphertexts.emplace_back(ref.ciphertext_bytes);
+      sent.emplace_back(ref.shared_secret_bytes);
+      ref.enc(ciphertexts[i].BytePtr(), sent[i].BytePtr(),
+              keypairs[i].first.BytePtr());
+      private_keys.push_back(keypairs[i].second);
+    }
+    // Tamper with two lanes; the other two must still decapsulate.
+    ciphertexts[1][0] ^= 1;
+    ciphertexts[3][ref.ciphertext_bytes - 1] ^= 0x80;
+    auto received = kem_driver.decapsulate(ciphertexts, private_keys);
+    REQUIRE(received.size() == 4);
+    for (int i = 0; i < 4; i++) {
+      CryptoPP::SecByteBlock expected(ref.shared_secret_bytes);
+      ref.dec(expected.BytePtr(), ciphertexts[i].BytePtr(),
+              private_keys[i].BytePtr());
+      CHECK(received[i] == expected);
+      CHECK((received[i] == sent[i]) == (i % 2 == 0));
+    }
+  }
+}
+
+/**
+ * Two clients that have exchanged public values in memory, without a
+ * network in between, as in the benchmarks.
+ */
+struct ClientPair {
+  ClientPair(RatchetPolicy policy = RatchetPolicy()) {
+    auto crypto_driver = std::make_shared<CryptoDriver>();
+    this->alice = std::make_shared<Client>(nullptr, crypto_driver);
+    this->bob = std::make_shared<Client>(nullptr, crypto_driver);
+    this->alice->set_ratchet_policy(policy);
+    this->bob->set_ratchet_policy(policy);
+    std::vector<unsigned char> alice_pk = this->alice->start_key_exchange();
+    std::vector<unsigned char> bob_pk = this->bob->start_key_exchange();
+    this->alice->finish_key_exchange(bob_pk);
+    this->bob->finish_key_exchange(alice_pk);
+  }
+
+  /**
+   * Seals plaintext into a serialized Message frame.
+   */
+  static std::vector<unsigned char> frame(Client &from,
+                                          const std::string &plaintext) {
+    std::vector<unsigned char> frame;
+    from.send(bytes_of(plaintext), frame);
+    return frame;
+  }
+
+  /**
+   * Opens a copy of a frame in place.
+   */
+  static std::pair<std::string, bool>
+  open(Client &to, std::vector<unsigned char> frame, bool *held = nullptr) {
+    std::pair<ByteView, bool> result =
+        to.receive(MutableByteView{frame.data(), frame.size()}, held);
+    return std::make_pair(
+        std::string((const char *)result.first.data, result.first.size),
+        result.second);
+  }
+
+  /**
+   * A copy of a frame with one bit of its ciphertext flipped.
+   */
+  static std::vector<unsigned char>
+  tampered(const std::vector<unsigned char> &frame) {
+    std::vector<unsigned char> copy = frame;
+    Message_View msg;
+    msg.parse(copy.data(), copy.size());
+    copy[msg.ciphertext.data - copy.data()] ^= 1;
+    return copy;
+  }
+
+  std::shared_ptr<Client> alice;
+  std::shared_ptr<Client> bob;
+};
+
+TEST_CASE("Client opens messages out of order and refuses replays") {
+  ClientPair pair;
+  std::vector<unsigned char> first = ClientPair::frame(*pair.alice, "first"),
+                             second = ClientPair::frame(*pair.alice, "second"),
+                             third = ClientPair::frame(*pair.alice, "third");
+  CHECK(ClientPair::open(*pair.bob, first) ==
+        std::make_pair(std::string("first"), true));
+  CHECK(ClientPair::open(*pair.bob, third) ==
+        std::make_pair(std::string("third"), true));
+  CHECK(ClientPair::open(*pair.bob, second) ==
+        std::make_pair(std::string("second"), true));
+  CHECK_FALSE(ClientPair::open(*pair.bob, second).second);
+  CHECK_FALSE(ClientPair::open(*pair.bob, first).second);
+
+  Message_Message msg = pair.alice->send("fourth");
+  CHECK(pair.bob->receive(msg).second);
+  CHECK_FALSE(pair.bob->receive(msg).second);
+}
+
+TEST_CASE("Client refuses a skip past MAX_CHAIN_SKIP") {
+  RatchetPolicy policy;
+  policy.messages = 0;
+  policy.seconds = 0;
+  ClientPair pair(policy);
+  CHECK(ClientPair::open(*pair.bob, ClientPair::frame(*pair.alice, "0"))
+            .second);
+  std::vector<std::vector<unsigned char>> frames;
+  for (uint32_t i = 1; i <= MAX_CHAIN_SKIP + 2; i++)
+    frames.push_back(ClientPair::frame(*pair.alice, std::to_string(i)));
+  CHECK_FALSE(ClientPair::open(*pair.bob, frames.back()).second);
+  // The furthest a message may skip is still fine.
+  CHECK(ClientPair::open(*pair.bob, frames[MAX_CHAIN_SKIP]).second);
+  CHECK(ClientPair::open(*pair.bob, frames.back()).second);
+}
+
+TEST_CASE("Client drops a message that fails to verify") {
+  ClientPair pair;
+  std::vector<unsigned char> first = ClientPair::frame(*pair.alice, "first"),
+                             second = ClientPair::frame(*pair.alice, "second");
+  CHECK(ClientPair::open(*pair.bob, first).second);
+  bool held = true;
+  CHECK_FALSE(
+      ClientPair::open(*pair.bob, ClientPair::tampered(second), &held).second);
+  CHECK_FALSE(held);
+  // Nothing moved, so the genuine message still opens.
+  CHECK(ClientPair::open(*pair.bob, second, &held) ==
+        std::make_pair(std::string("second"), true));
+}
+
+TEST_CASE("Client holds messages that overtake their epoch's start") {
+  RatchetPolicy policy;
+  policy.messages = 1;
+  policy.seconds = 0;
+  ClientPair pair(policy);
+  for (int round = 0; round < 3; round++) {
+    std::vector<unsigned char> one = ClientPair::frame(*pair.alice, "one"),
+                               two = ClientPair::frame(*pair.alice, "two"),
+                               three = ClientPair::frame(*pair.alice, "three");
+    bool held;
+    CHECK_FALSE(ClientPair::open(*pair.bob, three, &held).second);
+    CHECK(held);
+    // Held now, but it never verifies, so it is never released.
+    CHECK_FALSE(
+        ClientPair::open(*pair.bob, ClientPair::tampered(two), &held).second);
+    CHECK(held);
+    CHECK_FALSE(ClientPair::open(*pair.bob, two, &held).second);
+    CHECK(held);
+    CHECK(pair.bob->take_released().empty());
+
+    CHECK(ClientPair::open(*pair.bob, one, &held) ==
+          std::make_pair(std::string("one"), true));
+    CHECK_FALSE(held);
+    std::vector<std::string> released = pair.bob->take_released();
+    REQUIRE(released.size() == 2);
+    CHECK(released[0] == "three");
+    CHECK(released[1] == "two");
+    CHECK(pair.bob->take_released().empty());
+    CHECK_FALSE(ClientPair::open(*pair.bob, two, &held).second);
+    CHECK_FALSE(held);
+
+    // The answer runs a KEM step, so Alice's next round starts an epoch.
+    CHECK(ClientPair::open(*pair.alice, ClientPair::frame(*pair.bob, "ack"))
+              .second);
+  }
+}
+
+TEST_CASE("Ratchet policy runs a KEM step after its message count") {
+  const uint32_t messages = 4;
+  RatchetPolicy policy;
+  policy.messages = messages;
+  policy.seconds = 0;
+  ClientPair pair(policy);
+  // A session's first message always runs a KEM step. Once Bob's answer has
+  // announced a new public value, Alice's next one is due after `messages`.
+  Message_Message msg = pair.alice->send("0");
+  CHECK(msg.ct.size() > 0);
+  CHECK(pair.bob->receive(msg).second);
+  CHECK(pair.alice->receive(pair.bob->send("ack")).second);
+  for (uint32_t i = 1; i < messages; i++) {
+    msg = pair.alice->send(std::to_string(i));
+    CHECK(msg.ct.size() == 0);
+    CHECK(msg.epoch == 1);
+    CHECK(pair.bob->receive(msg).second);
+  }
+  msg = pair.alice->send(std::to_string(messages));
+  CHECK(msg.ct.size() > 0);
+  CHECK(msg.epoch == 2);
+  CHECK(pair.bob->receive(msg).second);
+}
+
+TEST_CASE("Ratchet policy of one message steps on every turn") {
+  RatchetPolicy policy;
+  policy.messages = 1;
+  policy.seconds = 0;
+  ClientPair pair(policy);
+  for (uint32_t turn = 1; turn <= 4; turn++) {
+    Message_Message msg = pair.alice->send("ping");
+    CHECK(msg.ct.size() > 0);
+    CHECK(msg.epoch == turn);
+    CHECK(pair.bob->receive(msg).second);
+    msg = pair.bob->send("pong");
+    CHECK(msg.ct.size() > 0);
+    CHECK(msg.epoch == turn);
+    CHECK(pair.alice->receive(msg).second);
+  }
+}
+
+TEST_CASE("Ratchet chain gives every message its own key") {
+  Client client(nullptr, std::make_shared<CryptoDriver>());
+  RatchetChain chain;
+  chain.epoch = 1;
+  chain.key_id = CryptoPP::SecByteBlock(KEY_ID_SIZE);
+  chain.counter = 0;
+  chain.chain_key = CryptoPP::SecByteBlock(32);
+  chain.started = std::chrono::steady_clock::now();
+
+  CryptoPP::SecByteBlock first, second;
+  std::shared_ptr<RatchetChain> next = client.advance_chain(chain, 0, first);
+  REQUIRE(next);
+  CHECK(next->counter == 1);
+  CHECK(next->chain_key != chain.chain_key);
+  REQUIRE(client.advance_chain(*next, 1, second));
+  CHECK(first != second);
+  CHECK_FALSE(client.advance_chain(*next, 0, second));
+
+  // Stepping past a message hands over its key.
+  std::vector<std::pair<uint32_t, CryptoPP::SecByteBlock>> skipped;
+  CryptoPP::SecByteBlock direct;
+  next = client.advance_chain(chain, 1, direct, &skipped);
+  REQUIRE(next);
+  CHECK(next->counter == 2);
+  CHECK(direct == second);
+  REQUIRE(skipped.size() == 1);
+  CHECK(skipped[0].first == 0);
+  CHECK(skipped[0].second == first);
+  CHECK_FALSE(client.advance_chain(chain, MAX_CHAIN_SKIP + 1, direct));
+
+  // The last position a counter can hold is never used.
+  chain.counter = UINT32_MAX - 1;
+  next = client.advance_chain(chain, UINT32_MAX - 1, direct);
+  REQUIRE(next);
+  CHECK(next->counter == UINT32_MAX);
+  CHECK_FALSE(client.advance_chain(*next, UINT32_MAX, direct));
+  CHECK_FALSE(client.advance_chain(chain, UINT32_MAX, direct));
+}
+
+TEST_CASE("AEAD suites round trip and reject tampering") {
+  CryptoDriver crypto_driver;
+  CryptoPP::SecByteBlock shared_key(32);
+  for (size_t i = 0; i < shared_key.size(); i++)
+    shared_key[i] = i;
+  std::string plaintext = "attack at dawn", associated_data = "header";
+  for (CipherSuite::T suite :
+       {CipherSuite::AES_GCM, CipherSuite::CHACHA20_POLY1305}) {
+    CryptoPP::SecByteBlock key =
+        crypto_driver.AEAD_generate_key(shared_key, suite);
+    std::pair<std::string, CryptoPP::SecByteBlock> sealed =
+        crypto_driver.AEAD_encrypt(suite, key, plaintext, associated_data);
+    const std::string &ciphertext = sealed.first;
+    const CryptoPP::SecByteBlock &iv = sealed.second;
+    CHECK(ciphertext.size() == plaintext.size() + AEAD_TAG_SIZE);
+    CHECK(crypto_driver.AEAD_decrypt(suite, key, iv, ciphertext,
+                                     associated_data) ==
+          std::make_pair(plaintext, true));
+
+    // In place: the ciphertext and then the tag overwrite the plaintext.
+    std::string buffer = plaintext + std::string(AEAD_TAG_SIZE, '\0');
+    CryptoPP::SecByteBlock buffer_iv(AEAD_IV_SIZE);
+    crypto_driver.AEAD_encrypt(
+        suite, bytes_of(key),
+        ByteView{(const unsigned char *)buffer.data(), plaintext.size()},
+        bytes_of(associated_data), buffer_of(buffer_iv), buffer_of(buffer));
+    CHECK(buffer.compare(0, plaintext.size(), plaintext) != 0);
+    CHECK(crypto_driver.AEAD_decrypt(
+        suite, bytes_of(key), bytes_of(buffer_iv), bytes_of(buffer),
+        bytes_of(associated_data),
+        MutableByteView{(unsigned char *)&buffer[0], plaintext.size()}));
+    CHECK(buffer.compare(0, plaintext.size(), plaintext) == 0);
+
+    std::string bad_tag = ciphertext;
+    bad_tag.back() ^= 1;
+    CHECK_FALSE(
+        crypto_driver.AEAD_decrypt(suite, key, iv, bad_tag, associated_data)
+            .second);
+    CryptoPP::SecByteBlock bad_iv = iv;
+    bad_iv[0] ^= 1;
+    CHECK_FALSE(crypto_driver
+                    .AEAD_decrypt(suite, key, bad_iv, ciphertext,
+                                  associated_data)
+                    .second);
+    std::string bad_associated_data = associated_data;
+    bad_associated_data[0] ^= 1;
+    CHECK_FALSE(crypto_driver
+                    .AEAD_decrypt(suite, key, iv, ciphertext,
+                                  bad_associated_data)
+                    .second);
+  }
+}
+
+TEST_CASE("Cipher suite negotiation") {
+  CryptoDriver crypto_driver;
+  CHECK(crypto_driver.AEAD_negotiate_suite(CipherSuite::AES_GCM,
+                                           CipherSuite::AES_GCM) ==
+        CipherSuite::AES_GCM);
+  CHECK(crypto_driver.AEAD_negotiate_suite(CipherSuite::AES_CBC_HMAC_SHA256,
+                                           CipherSuite::AES_CBC_HMAC_SHA256) ==
+        CipherSuite::AES_CBC_HMAC_SHA256);
+  // Mismatched offers settle on ChaCha20-Poly1305, whichever side made them.
+  CHECK(crypto_driver.AEAD_negotiate_suite(CipherSuite::AES_GCM,
+                                           CipherSuite::CHACHA20_POLY1305) ==
+        CipherSuite::CHACHA20_POLY1305);
+  CHECK(crypto_driver.AEAD_negotiate_suite(CipherSuite::CHACHA20_POLY1305,
+                                           CipherSuite::AES_GCM) ==
+        CipherSuite::CHACHA20_POLY1305);
+  CHECK(crypto_driver.AEAD_negotiate_suite(CipherSuite::AES_CBC_HMAC_SHA256,
+                                           CipherSuite::AES_GCM) ==
+        CipherSuite::CHACHA20_POLY1305);
+
+  CHECK(CryptoDriver(CipherSuite::AES_CBC_HMAC_SHA256).AEAD_preferred_suite() ==
+        CipherSuite::AES_CBC_HMAC_SHA256);
+  CHECK(cipher_suite_from_name("chacha20-poly1305") ==
+        CipherSuite::CHACHA20_POLY1305);
+  CHECK_THROWS(cipher_suite_from_name("rot13"));
+}
+
+TEST_CASE("Rewritten offers give the two sides different keys") {
+  CryptoDriver crypto_driver;
+  CryptoPP::SecByteBlock handshake_key(32);
+  unsigned char offers[4] = {CipherSuite::AES_GCM, KEMParams::KYBER512,
+                             CipherSuite::CHACHA20_POLY1305,
+                             KEMParams::KYBER512};
+  CryptoPP::SecByteBlock seen(offers, 4);
+  CHECK(crypto_driver.bind_offers(handshake_key, seen) ==
+        crypto_driver.bind_offers(handshake_key, seen));
+  CryptoPP::SecByteBlock rewritten = seen;
+  rewritten[0] = CipherSuite::CHACHA20_POLY1305;
+  CHECK(crypto_driver.bind_offers(handshake_key, seen) !=
+        crypto_driver.bind_offers(handshake_key, rewritten));
+
+  // Alice prefers AES-GCM and Bob ChaCha20-Poly1305. Rewriting Alice's offer
+  // to ChaCha20-Poly1305 leaves both negotiating the same suite, but not the
+  // same key.
+  for (bool rewrite : {false, true}) {
+    Client alice(nullptr, std::make_shared<CryptoDriver>(CipherSuite::AES_GCM));
+    Client bob(nullptr,
+               std::make_shared<CryptoDriver>(CipherSuite::CHACHA20_POLY1305));
+    std::vector<unsigned char> alice_pk = alice.start_key_exchange();
+    std::vector<unsigned char> bob_pk = bob.start_key_exchange();
+    if (rewrite) {
+      PublicValue_Message msg;
+      msg.deserialize(alice_pk);
+      msg.cipher_suite = CipherSuite::CHACHA20_POLY1305;
+      alice_pk.clear();
+      msg.serialize(alice_pk);
+    }
+    alice.finish_key_exchange(bob_pk);
+    bob.finish_key_exchange(alice_pk);
+    CHECK(bob.receive(alice.send("hello")).second == !rewrite);
+  }
+}
+
+/**
+ * A key store file of its own for one test, removed when it is done.
+ */
+struct TestKeyStorePath {
+  TestKeyStorePath()
+      : path((std::filesystem::temp_directory_path() /
+              ("test_key_store_" + std::to_string(::getpid())))
+                 .string()) {
+    std::filesystem::remove(this->path);
+  }
+  ~TestKeyStorePath() { std::filesystem::remove(this->path); }
+
+  std::string path;
+};
+
+/**
+ * A made-up keypair; the store does not look inside keys.
+ */
+static std::pair<CryptoPP::SecByteBlock, CryptoPP::SecByteBlock>
+test_keypair(unsigned char seed, size_t size = 64) {
+  CryptoPP::SecByteBlock public_key(size), private_key(size);
+  for (size_t i = 0; i < size; i++) {
+    public_key[i] = seed + i;
+    private_key[i] = seed ^ i;
+  }
+  return std::make_pair(public_key, private_key);
+}
+
+TEST_CASE("Key store drops a torn record and keeps the rest") {
+  TestKeyStorePath store;
+  auto first = test_keypair(1), second = test_keypair(2);
+  CryptoPP::SecByteBlock first_id, second_id;
+  {
+    KeyStore key_store(store.path);
+    first_id = key_store.add(first, KeyKind::LONG_TERM);
+    second_id = key_store.add(second, KeyKind::PEER);
+  }
+  // A crash halfway through writing the second record.
+  std::filesystem::resize_file(store.path,
+                               std::filesystem::file_size(store.path) - 5);
+  {
+    KeyStore key_store(store.path);
+    CHECK(key_store.size() == 1);
+    CHECK_FALSE(key_store.contains(second_id));
+    CHECK(key_store.kind(first_id) == KeyKind::LONG_TERM);
+    CHECK(key_store.get(first_id) == first);
+    second_id = key_store.add(second, KeyKind::PEER);
+  }
+  KeyStore key_store(store.path);
+  CHECK(key_store.size() == 2);
+  CHECK(key_store.get(second_id).first == second.first);
+}
+
+TEST_CASE("Key store revocations survive a reopen") {
+  TestKeyStorePath store;
+  CryptoPP::SecByteBlock kept, revoked;
+  {
+    KeyStore key_store(store.path);
+    kept = key_store.add(test_keypair(1), KeyKind::PREKEY);
+    revoked = key_store.add(test_keypair(2), KeyKind::PREKEY);
+    CHECK(key_store.revoke(revoked));
+    CHECK_FALSE(key_store.revoke(revoked));
+  }
+  KeyStore key_store(store.path);
+  CHECK(key_store.contains(kept));
+  CHECK_FALSE(key_store.contains(revoked));
+  CHECK(key_store.kind(revoked) == KeyKind::REVOKED);
+  CHECK(key_store.key_ids(KeyKind::PREKEY).size() == 1);
+}
+
+TEST_CASE("Key store compaction keeps every live key") {
+  TestKeyStorePath store;
+  std::vector<CryptoPP::SecByteBlock> live;
+  size_t largest = 0;
+  {
+    KeyStore key_store(store.path);
+    for (unsigned char seed = 0; seed < 16; seed++)
+      live.push_back(key_store.add(test_keypair(seed), KeyKind::PEER));
+    // Used prekeys pile up dead records until the file is rewritten.
+    for (int i = 0; i < 200; i++) {
+      CryptoPP::SecByteBlock prekey =
+          key_store.add(test_keypair(100 + i % 100, 1024), KeyKind::PREKEY);
+      CHECK(key_store.revoke(prekey));
+      largest = std::max<size_t>(largest,
+                                 std::filesystem::file_size(store.path));
+    }
+    CHECK(std::filesystem::file_size(store.path) < largest);
+    // The rewritten file is locked too.
+    CHECK_THROWS(KeyStore(store.path));
+    CHECK(key_store.size() == live.size());
+    for (size_t i = 0; i < live.size(); i++)
+      CHECK(key_store.get(live[i]) == test_keypair(i));
+  }
+  CHECK_FALSE(std::filesystem::exists(store.path + ".compact"));
+  KeyStore key_store(store.path);
+  CHECK(key_store.size() == live.size());
+  for (size_t i = 0; i < live.size(); i++)
+    CHECK(key_store.get(live[i]) == test_keypair(i));
+}
+
+TEST_CASE("Key store refuses a second opener") {
+  TestKeyStorePath store;
+  {
+    KeyStore key_store(store.path);
+    CHECK_THROWS(KeyStore(store.path));
+  }
+  CHECK_NOTHROW(KeyStore(store.path));
+}
+
+/**
+ * Seals a ticket the way SessionTickets::issue does, but stamped with the
+ * given issue time.
+ */
+static CryptoPP::SecByteBlock
+backdated_ticket(CryptoDriver &crypto_driver, const CryptoPP::SecByteBlock &key,
+                 SessionTicket state, uint32_t issued) {
+  std::vector<unsigned char> plaintext(sizeof(uint32_t));
+  put_u32(issued, plaintext.data());
+  state.serialize(plaintext);
+  std::pair<std::string, CryptoPP::SecByteBlock> ciphertext =
+      crypto_driver.AEAD_encrypt(
+          CipherSuite::CHACHA20_POLY1305, key,
+          std::string(plaintext.begin(), plaintext.end()), "");
+  std::vector<unsigned char> ticket;
+  put_bytes(ciphertext.second.BytePtr(), ciphertext.second.size(), ticket);
+  put_bytes((const unsigned char *)ciphertext.first.data(),
+            ciphertext.first.size(), ticket);
+  return CryptoPP::SecByteBlock(ticket.data(), ticket.size());
+}
+
+TEST_CASE("Session tickets refuse tampering, other keys and expiry") {
+  auto crypto_driver = std::make_shared<CryptoDriver>();
+  CryptoPP::SecByteBlock key(32), other_key(32);
+  for (size_t i = 0; i < key.size(); i++) {
+    key[i] = i;
+    other_key[i] = i + 1;
+  }
+  SessionTicket state;
+  state.resumption_secret = CryptoPP::SecByteBlock(32);
+  state.resumption_secret[0] = 7;
+  state.cipher_suite = CipherSuite::AES_GCM;
+  state.kem_params = KEMParams::KYBER768;
+  state.peer_key_id = CryptoPP::SecByteBlock(KEY_ID_SIZE);
+
+  SessionTickets tickets(crypto_driver, key);
+  CryptoPP::SecByteBlock ticket = tickets.issue(state);
+  SessionTicket redeemed;
+  REQUIRE(tickets.redeem(ticket, redeemed));
+  CHECK(redeemed.resumption_secret == state.resumption_secret);
+  CHECK(redeemed.cipher_suite == CipherSuite::AES_GCM);
+  CHECK(redeemed.kem_params == KEMParams::KYBER768);
+  CHECK(redeemed.ticket.size() == 0);
+
+  for (size_t i = 0; i < ticket.size(); i += 7) {
+    CryptoPP::SecByteBlock tampered = ticket;
+    tampered[i] ^= 1;
+    CHECK_FALSE(tickets.redeem(tampered, redeemed));
+  }
+  CHECK_FALSE(tickets.redeem(
+      CryptoPP::SecByteBlock(ticket.BytePtr(), ticket.size() - 1), redeemed));
+  CHECK_FALSE(
+      SessionTickets(crypto_driver, other_key).redeem(ticket, redeemed));
+
+  // An hour old: fine for the default lifetime, stale for none at all.
+  uint32_t issued = (uint32_t)std::time(nullptr) - 60 * 60;
+  CryptoPP::SecByteBlock old =
+      backdated_ticket(*crypto_driver, key, state, issued);
+  CHECK(tickets.redeem(old, redeemed));
+  CHECK_FALSE(SessionTickets(crypto_driver, key, 0).redeem(old, redeemed));
+  CryptoPP::SecByteBlock future =
+      backdated_ticket(*crypto_driver, key, state, issued + 2 * 60 * 60);
+  CHECK_FALSE(tickets.redeem(future, redeemed));
+}